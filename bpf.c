@@ -119,6 +119,8 @@ static const char *bpf_dump_linux_k(uint32_t k)
 		return "#vlant";
 	case SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT:
 		return "#vlanp";
+	case SKF_AD_OFF + SKF_AD_RANDOM:
+		return "#rand";
 	}
 }
 
@@ -763,3 +765,40 @@ void bpf_parse_rules(char *rulefile, struct sock_fprog *bpf, uint32_t link_type)
 	if (__bpf_validate(bpf) == 0)
 		panic("This is not a valid BPF program!\n");
 }
+
+void bpf_prepend_sampling(struct sock_fprog *bpf, uint32_t rate)
+{
+	struct sock_filter *filter;
+	struct sock_filter sampler[] = {
+		/* A = prandom_u32() */
+		{ BPF_LD_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_RANDOM },
+		/* A = A % rate */
+		{ BPF_ALU_MOD | BPF_K, 0, 0, rate },
+		/* 1 out of rate packets falls through to the user filter */
+		{ BPF_JMP_JEQ | BPF_K, 1, 0, 0 },
+		{ BPF_RET | BPF_K, 0, 0, 0 },
+	};
+
+	if (rate <= 1)
+		return;
+
+	/* Older kernels lack BPF_MOD, so avoid it where we can. */
+	if (ispow2(rate)) {
+		sampler[1].code = BPF_ALU_AND | BPF_K;
+		sampler[1].k = rate - 1;
+	}
+
+	filter = xmalloc((bpf->len + array_size(sampler)) * sizeof(*filter));
+
+	fmemcpy(filter, sampler, sizeof(sampler));
+	fmemcpy(filter + array_size(sampler), bpf->filter,
+		bpf->len * sizeof(*filter));
+
+	xfree(bpf->filter);
+
+	bpf->filter = filter;
+	bpf->len += array_size(sampler);
+
+	if (__bpf_validate(bpf) == 0)
+		panic("This is not a valid BPF program!\n");
+}
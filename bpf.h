@@ -22,6 +22,7 @@ extern void bpf_attach_to_sock(int sock, struct sock_fprog *bpf);
 extern void bpf_detach_from_sock(int sock);
 extern int enable_kernel_bpf_jit_compiler(void);
 extern void bpf_parse_rules(char *rulefile, struct sock_fprog *bpf, uint32_t link_type);
+extern void bpf_prepend_sampling(struct sock_fprog *bpf, uint32_t rate);
 #ifdef __WITH_TCPDUMP_LIKE_FILTER
 extern void bpf_try_compile(const char *rulefile, struct sock_fprog *bpf,
 			    uint32_t link_type);
@@ -131,5 +132,8 @@ static inline void bpf_release(struct sock_fprog *bpf)
 #ifndef SKF_AD_VLAN_TAG_PRESENT
 # define SKF_AD_VLAN_TAG_PRESENT	48
 #endif
+#ifndef SKF_AD_RANDOM
+# define SKF_AD_RANDOM			56
+#endif
 
 #endif /* BPF_I_H */
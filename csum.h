@@ -7,21 +7,214 @@
 #ifndef CSUM_H
 #define	CSUM_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
 #include "built_in.h"
 
-static inline unsigned short csum(unsigned short *buf, int nwords)
+/*
+ * Internet checksum kernels. All of them add up the buffer as 16 bit
+ * words in memory order into a 64 bit one's complement accumulator,
+ * which works for either byte order since 2^16 = 1 (mod 0xffff), and
+ * csum_fold() reduces that to the final 16 bit sum. Buffers of at
+ * least CSUM_SIMD_MIN bytes use SSE2 on x86_64, or AVX2 if the CPU has
+ * it, other architectures use the 64 bit scalar loop.
+ */
+#define CSUM_SIMD_MIN		128
+/* 32 bit SIMD lanes take this many vectors before they might overflow */
+#define CSUM_SIMD_BLOCKS	16384
+
+static inline uint64_t csum_add64(uint64_t sum, uint64_t val)
+{
+	sum += val;
+	return sum + (sum < val);
+}
+
+static inline uint16_t csum_fold(uint64_t sum)
 {
-	unsigned long sum;
+	sum = (sum & 0xffffffffULL) + (sum >> 32);
+	sum = (sum & 0xffffffffULL) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
 
-	for (sum = 0; nwords > 0; nwords--)
-		sum += *buf++;
-	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
+	return sum;
+}
 
-	return ~sum;
+static inline uint64_t __csum_add_scalar(const uint8_t *p, size_t len,
+					 uint64_t sum)
+{
+	/* 32 bit halves, so that no add has to wait for a carry */
+	uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0, v0, v1, v2, v3;
+	uint32_t w32;
+	uint16_t w16;
+	uint8_t last[2];
+
+	while (len >= 32) {
+		fmemcpy(&v0, p, sizeof(v0));
+		fmemcpy(&v1, p + 8, sizeof(v1));
+		fmemcpy(&v2, p + 16, sizeof(v2));
+		fmemcpy(&v3, p + 24, sizeof(v3));
+
+		a0 += (uint32_t) v0 + (v0 >> 32);
+		a1 += (uint32_t) v1 + (v1 >> 32);
+		a2 += (uint32_t) v2 + (v2 >> 32);
+		a3 += (uint32_t) v3 + (v3 >> 32);
+
+		p += 32;
+		len -= 32;
+	}
+
+	while (len >= 8) {
+		fmemcpy(&v0, p, sizeof(v0));
+		a0 += (uint32_t) v0 + (v0 >> 32);
+		p += 8;
+		len -= 8;
+	}
+
+	if (len >= 4) {
+		fmemcpy(&w32, p, sizeof(w32));
+		a1 += w32;
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		fmemcpy(&w16, p, sizeof(w16));
+		a2 += w16;
+		p += 2;
+		len -= 2;
+	}
+
+	/* A trailing byte is padded with zero */
+	if (len) {
+		last[0] = *p;
+		last[1] = 0;
+		fmemcpy(&w16, last, sizeof(w16));
+		a3 += w16;
+	}
+
+	sum = csum_add64(sum, a0);
+	sum = csum_add64(sum, a1);
+	sum = csum_add64(sum, a2);
+
+	return csum_add64(sum, a3);
+}
+
+#if defined(__x86_64__)
+/*
+ * Even and odd words of each 32 bit lane are split with a mask and a
+ * shift rather than unpacked, which keeps the shuffle port free.
+ */
+static inline uint64_t __csum_add_sse2(const uint8_t *p, size_t len,
+				       uint64_t sum)
+{
+	const __m128i mask = _mm_set1_epi32(0xffff);
+	uint32_t lanes[4];
+	size_t n;
+
+	while (len >= 32) {
+		__m128i v0, v1, acc0, acc1, acc2, acc3;
+
+		acc0 = acc1 = acc2 = acc3 = _mm_setzero_si128();
+
+		n = min(len / 32, (size_t) CSUM_SIMD_BLOCKS);
+		len -= n * 32;
+
+		for (; n > 0; n--, p += 32) {
+			v0 = _mm_loadu_si128((const __m128i *) p);
+			v1 = _mm_loadu_si128((const __m128i *) (p + 16));
+
+			acc0 = _mm_add_epi32(acc0, _mm_and_si128(v0, mask));
+			acc1 = _mm_add_epi32(acc1, _mm_srli_epi32(v0, 16));
+			acc2 = _mm_add_epi32(acc2, _mm_and_si128(v1, mask));
+			acc3 = _mm_add_epi32(acc3, _mm_srli_epi32(v1, 16));
+		}
+
+		/* Lanes hold at most 2 * 0xffff * CSUM_SIMD_BLOCKS each */
+		_mm_storeu_si128((__m128i *) lanes,
+				 _mm_add_epi32(_mm_add_epi32(acc0, acc1),
+					       _mm_add_epi32(acc2, acc3)));
+		sum = csum_add64(sum, (uint64_t) lanes[0] + lanes[1] +
+				      lanes[2] + lanes[3]);
+	}
+
+	return __csum_add_scalar(p, len, sum);
+}
+
+static inline __attribute__ ((target("avx2")))
+uint64_t __csum_add_avx2(const uint8_t *p, size_t len, uint64_t sum)
+{
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	uint32_t lanes[8];
+	size_t n;
+
+	while (len >= 64) {
+		__m256i v0, v1, acc0, acc1, acc2, acc3;
+
+		acc0 = acc1 = acc2 = acc3 = _mm256_setzero_si256();
+
+		n = min(len / 64, (size_t) CSUM_SIMD_BLOCKS);
+		len -= n * 64;
+
+		for (; n > 0; n--, p += 64) {
+			v0 = _mm256_loadu_si256((const __m256i *) p);
+			v1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+
+			acc0 = _mm256_add_epi32(acc0, _mm256_and_si256(v0, mask));
+			acc1 = _mm256_add_epi32(acc1, _mm256_srli_epi32(v0, 16));
+			acc2 = _mm256_add_epi32(acc2, _mm256_and_si256(v1, mask));
+			acc3 = _mm256_add_epi32(acc3, _mm256_srli_epi32(v1, 16));
+		}
+
+		_mm256_storeu_si256((__m256i *) lanes,
+				    _mm256_add_epi32(_mm256_add_epi32(acc0, acc1),
+						     _mm256_add_epi32(acc2, acc3)));
+		sum = csum_add64(sum, (uint64_t) lanes[0] + lanes[1] +
+				      lanes[2] + lanes[3] + lanes[4] +
+				      lanes[5] + lanes[6] + lanes[7]);
+	}
+
+	return __csum_add_scalar(p, len, sum);
+}
+
+static inline bool __csum_cpu_avx2(void)
+{
+	static int avx2 = -1;
+
+	if (unlikely(avx2 < 0)) {
+		__builtin_cpu_init();
+		avx2 = !!__builtin_cpu_supports("avx2");
+	}
+
+	return avx2;
+}
+#endif /* __x86_64__ */
+
+/* Adds len bytes at buf to the one's complement sum */
+static inline uint64_t csum_partial(const void *buf, size_t len, uint64_t sum)
+{
+#if defined(__x86_64__)
+	if (len >= CSUM_SIMD_MIN) {
+		if (__csum_cpu_avx2())
+			return __csum_add_avx2(buf, len, sum);
+		return __csum_add_sse2(buf, len, sum);
+	}
+#endif
+	return __csum_add_scalar(buf, len, sum);
+}
+
+static inline unsigned short csum(unsigned short *buf, int nwords)
+{
+	if (nwords <= 0)
+		return 0xffff;
+
+	return ~csum_fold(csum_partial(buf, (size_t) nwords * 2, 0));
 }
 
 static inline uint16_t calc_csum(void *addr, size_t len, int ccsum)
@@ -41,6 +234,38 @@ static inline uint16_t csum_expected(uint16_t sum, uint16_t computed_sum)
 	return shouldbe;
 }
 
+/*
+ * Incrementally updates checksum check when a 16 bit word changes from
+ * old to new, RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). All in the same
+ * (usually network) byte order.
+ */
+static inline uint16_t csum_replace2(uint16_t check, uint16_t old, uint16_t new)
+{
+	uint32_t sum;
+
+	sum = (uint16_t) ~check + (uint16_t) ~old + new;
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+
+	return ~sum;
+}
+
+/* Applies csum_replace2() to a checksum field at check for a len byte field */
+static inline void csum_replace(uint8_t *check, const void *old,
+				const void *new, size_t len)
+{
+	uint16_t sum, o, n;
+	size_t i;
+
+	fmemcpy(&sum, check, sizeof(sum));
+	for (i = 0; i < len; i += sizeof(uint16_t)) {
+		fmemcpy(&o, (const uint8_t *) old + i, sizeof(o));
+		fmemcpy(&n, (const uint8_t *) new + i, sizeof(n));
+		sum = csum_replace2(sum, o, n);
+	}
+	fmemcpy(check, &sum, sizeof(sum));
+}
+
 /* Taken and modified from tcpdump, Copyright belongs to them! */
 
 struct cksum_vec {
@@ -48,104 +273,29 @@ struct cksum_vec {
 	int len;
 };
 
-#define ADDCARRY(x)		\
-	do { if ((x) > 65535)	\
-		(x) -= 65535;	\
-	} while (0)
-
-#define REDUCE						\
-	do {						\
-		l_util.l = sum;				\
-		sum = l_util.s[0] + l_util.s[1];	\
-		ADDCARRY(sum);				\
-	} while (0)
-
+/*
+ * A vector that starts at an odd offset of the whole has its bytes in
+ * the other halves of the 16 bit words, so its sum is byte swapped.
+ */
 static inline u16 __in_cksum(const struct cksum_vec *vec, int veclen)
 {
-	const u16 *w;
-	int sum = 0, mlen = 0;
-	int byte_swapped = 0;
-	union {
-		u8 c[2];
-		u16 s;
-	} s_util;
-	union {
-		u16 s[2];
-		u32 l;
-	} l_util;
+	uint64_t sum = 0;
+	uint16_t part;
+	bool odd = false;
 
 	for (; veclen != 0; vec++, veclen--) {
 		if (vec->len == 0)
 			continue;
 
-		w = (const u16 *) (void *) vec->ptr;
-
-		if (mlen == -1) {
-			s_util.c[1] = *(const u8 *) w;
-			sum += s_util.s;
-			w = (const u16 *) (void *) ((const u8 *) w + 1);
-			mlen = vec->len - 1;
-		} else
-			mlen = vec->len;
-
-		if ((1 & (unsigned long) w) && (mlen > 0)) {
-			REDUCE;
-			sum <<= 8;
-			s_util.c[0] = *(const u8 *) w;
-			w = (const u16 *) (void *) ((const u8 *) w + 1);
-			mlen--;
-			byte_swapped = 1;
-		}
-
-		while ((mlen -= 32) >= 0) {
-			sum +=  w[0]; sum +=  w[1]; sum +=  w[2]; sum +=  w[3];
-			sum +=  w[4]; sum +=  w[5]; sum +=  w[6]; sum +=  w[7];
-			sum +=  w[8]; sum +=  w[9]; sum += w[10]; sum += w[11];
-			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-			w += 16;
-		}
-
-		mlen += 32;
+		part = csum_fold(csum_partial(vec->ptr, vec->len, 0));
+		if (odd)
+			part = (part << 8) | (part >> 8);
 
-		while ((mlen -= 8) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			w += 4;
-		}
-
-		mlen += 8;
-
-		if (mlen == 0 && byte_swapped == 0)
-			continue;
-
-		REDUCE;
-
-		while ((mlen -= 2) >= 0) {
-			sum += *w++;
-		}
-
-		if (byte_swapped) {
-			REDUCE;
-			sum <<= 8;
-			byte_swapped = 0;
-
-			if (mlen == -1) {
-				s_util.c[1] = *(const u8 *) w;
-				sum += s_util.s;
-				mlen = 0;
-			} else
-				mlen = -1;
-		} else if (mlen == -1)
-			s_util.c[0] = *(const u8 *) w;
+		sum += part;
+		odd ^= vec->len & 1;
 	}
 
-	if (mlen == -1) {
-		s_util.c[1] = 0;
-		sum += s_util.s;
-	}
-
-	REDUCE;
-
-	return (~sum & 0xffff);
+	return (~csum_fold(sum) & 0xffff);
 }
 
 static inline u16 p4_csum(const struct ip *ip, const u8 *data, u16 len,
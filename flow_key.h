@@ -0,0 +1,166 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef FLOW_KEY_H
+#define FLOW_KEY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "built_in.h"
+#include "ipv4.h"
+#include "ipv6.h"
+
+enum flow_key_type {
+	FLOW_KEY_SRC,
+	FLOW_KEY_DST,
+	FLOW_KEY_5TUPLE,
+	FLOW_KEY_NET24,
+};
+
+/* Fixed 40 byte layout, so we can hash it as five 64 bit words. */
+struct flow_key {
+	uint8_t family;
+	uint8_t proto;
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t __pad;
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+};
+
+#ifndef ETH_P_8021AD
+# define ETH_P_8021AD	0x88A8
+#endif
+
+static inline void __flow_key_ports(struct flow_key *key, const uint8_t *l4,
+				    const uint8_t *end)
+{
+	if (key->proto != IPPROTO_TCP && key->proto != IPPROTO_UDP)
+		return;
+	if (l4 + 2 * sizeof(uint16_t) > end)
+		return;
+
+	fmemcpy(&key->sport, l4, sizeof(key->sport));
+	fmemcpy(&key->dport, l4 + sizeof(uint16_t), sizeof(key->dport));
+}
+
+/*
+ * Extracts the requested key from an Ethernet frame, skipping up to two
+ * VLAN tags. Returns -1 for non-IP frames. Ports are in network byte order.
+ */
+static inline int flow_key_extract(struct flow_key *key, enum flow_key_type type,
+				   const uint8_t *packet, size_t len)
+{
+	uint16_t proto;
+	const uint8_t *ptr = packet, *end = packet + len;
+
+	fmemset(key, 0, sizeof(*key));
+
+	if (unlikely(len < ETH_HLEN))
+		return -1;
+
+	fmemcpy(&proto, ptr + 2 * ETH_ALEN, sizeof(proto));
+	ptr += ETH_HLEN;
+
+	while (proto == htons(ETH_P_8021Q) || proto == htons(ETH_P_8021AD)) {
+		if (ptr + 4 > end)
+			return -1;
+		fmemcpy(&proto, ptr + 2, sizeof(proto));
+		ptr += 4;
+	}
+
+	switch (ntohs(proto)) {
+	case ETH_P_IP: {
+		const struct ipv4hdr *ip4 = (const void *) ptr;
+
+		if (ptr + sizeof(*ip4) > end || ip4->h_ihl < 5)
+			return -1;
+
+		key->family = AF_INET;
+		key->proto = ip4->h_protocol;
+		fmemcpy(key->saddr, &ip4->h_saddr, sizeof(ip4->h_saddr));
+		fmemcpy(key->daddr, &ip4->h_daddr, sizeof(ip4->h_daddr));
+
+		if ((ntohs(ip4->h_frag_off) & 0x1fff) == 0)
+			__flow_key_ports(key, ptr + ip4->h_ihl * 4, end);
+		break; }
+	case ETH_P_IPV6: {
+		const struct ipv6hdr *ip6 = (const void *) ptr;
+
+		if (ptr + sizeof(*ip6) > end)
+			return -1;
+
+		key->family = AF_INET6;
+		key->proto = ip6->nexthdr;
+		fmemcpy(key->saddr, &ip6->saddr, sizeof(ip6->saddr));
+		fmemcpy(key->daddr, &ip6->daddr, sizeof(ip6->daddr));
+
+		__flow_key_ports(key, ptr + sizeof(*ip6), end);
+		break; }
+	default:
+		return -1;
+	}
+
+	switch (type) {
+	case FLOW_KEY_SRC:
+		fmemset(key->daddr, 0, sizeof(key->daddr));
+		key->proto = key->sport = key->dport = 0;
+		break;
+	case FLOW_KEY_DST:
+		fmemset(key->saddr, 0, sizeof(key->saddr));
+		key->proto = key->sport = key->dport = 0;
+		break;
+	case FLOW_KEY_NET24:
+		/* IPv4 source /24, IPv6 source /48 */
+		if (key->family == AF_INET)
+			key->saddr[3] = 0;
+		else
+			fmemset(key->saddr + 6, 0, sizeof(key->saddr) - 6);
+		fmemset(key->daddr, 0, sizeof(key->daddr));
+		key->proto = key->sport = key->dport = 0;
+		break;
+	case FLOW_KEY_5TUPLE:
+		break;
+	}
+
+	return 0;
+}
+
+static inline int flow_key_equal(const struct flow_key *a,
+				 const struct flow_key *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+static inline uint64_t __flow_mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline uint64_t flow_key_hash(const struct flow_key *key)
+{
+	int i;
+	uint64_t h = 0x9e3779b97f4a7c15ULL, w[sizeof(*key) / sizeof(uint64_t)];
+
+	fmemcpy(w, key, sizeof(w));
+
+	for (i = 0; i < array_size(w); ++i)
+		h = __flow_mix64(h ^ w[i]);
+
+	return h;
+}
+
+#endif /* FLOW_KEY_H */
@@ -28,10 +28,13 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/fsuid.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <math.h>
+#include <sched.h>
 
 #include "ring_rx.h"
 #include "ring_tx.h"
@@ -46,26 +49,50 @@
 #include "tprintf.h"
 #include "dissector.h"
 #include "xmalloc.h"
+#include "sketch.h"
+#include "flow_key.h"
+#include "pcap_arena.h"
+#include "rewrite.h"
+#include "txf.h"
+#include "pcap_merge.h"
+#include "pcap_slice.h"
+#include "xtime.h"
+#include "rec_queue.h"
 
 enum dump_mode {
 	DUMP_INTERVAL_TIME,
 	DUMP_INTERVAL_SIZE,
 };
 
+enum tx_split {
+	TX_SPLIT_RR,
+	TX_SPLIT_FLOW,
+};
+
 struct ctx {
 	char *device_in, *device_out, *device_trans, *filter, *prefix;
 	int cpu, rfraw, dump, print_mode, dump_dir, packet_type, verbose;
 	unsigned long kpull, dump_interval, reserve_size, tx_bytes, tx_packets;
+	unsigned long sample;
+	unsigned int top_k; enum flow_key_type top_key;
+	double replay_speed;
+	bool replay_timing;
+	unsigned int tx_threads, rd_threads; enum tx_split tx_split;
+	unsigned long loops; enum pcap_arena_incr loop_incr;
+	bool loop, shared_ring, txf_infer, merge;
+	unsigned int bridge_queues; char *filter_rev; int packet_type_rev;
+	char *rewrite, *slice;
 	bool randomize, promiscuous, enforce, jumbo, dump_bpf;
 	enum pcap_ops_groups pcap; enum dump_mode dump_mode;
 	uid_t uid; gid_t gid; uint32_t link_type, magic;
+	const struct pcap_codec *codec;
 };
 
 volatile sig_atomic_t sigint = 0;
 
 static volatile bool next_dump = false;
 
-static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DB";
+static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DBa:K:Y:W:L:zx:y:p:w:Ij:OE:Z";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"in",			required_argument,	NULL, 'i'},
@@ -81,10 +108,25 @@ static const struct option long_options[] = {
 	{"user",		required_argument,	NULL, 'u'},
 	{"group",		required_argument,	NULL, 'g'},
 	{"magic",		required_argument,	NULL, 'T'},
+	{"sample",		required_argument,	NULL, 'a'},
+	{"top",			required_argument,	NULL, 'K'},
+	{"replay-timing",	required_argument,	NULL, 'Y'},
+	{"tx-threads",		required_argument,	NULL, 'W'},
+	{"read-threads",	required_argument,	NULL, 'j'},
+	{"loop",		required_argument,	NULL, 'L'},
+	{"bridge",		required_argument,	NULL, 'x'},
+	{"filter-rev",		required_argument,	NULL, 'y'},
+	{"type-rev",		required_argument,	NULL, 'p'},
+	{"rewrite",		required_argument,	NULL, 'w'},
+	{"extract",		required_argument,	NULL, 'E'},
 	{"rand",		no_argument,		NULL, 'r'},
+	{"shared-ring",		no_argument,		NULL, 'z'},
+	{"infer",		no_argument,		NULL, 'I'},
+	{"merge",		no_argument,		NULL, 'O'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"mmap",		no_argument,		NULL, 'm'},
 	{"sg",			no_argument,		NULL, 'G'},
+	{"read-ahead",		no_argument,		NULL, 'Z'},
 	{"clrw",		no_argument,		NULL, 'c'},
 	{"jumbo-support",	no_argument,		NULL, 'J'},
 	{"no-promisc",		no_argument,		NULL, 'M'},
@@ -123,13 +165,6 @@ static void signal_handler(int number)
 	}
 }
 
-static void timer_elapsed(int unused)
-{
-	set_itimer_interval_value(&itimer, 0, interval);
-	pull_and_flush_tx_ring(tx_sock);
-	setitimer(ITIMER_REAL, &itimer, NULL);
-}
-
 static void timer_next_dump(int unused)
 {
 	set_itimer_interval_value(&itimer, interval, 0);
@@ -142,6 +177,69 @@ static inline bool dump_to_pcap(struct ctx *ctx)
 	return ctx->dump;
 }
 
+struct replay_timing {
+	uint64_t base_mono, base_pcap, last_target;
+	uint64_t packets, late, err_min, err_max;
+	long double err_sum, err_sq;
+};
+
+#define REPLAY_LATE_NS		NSEC_PER_USEC
+
+static void replay_wait_for_slot(struct replay_timing *rt, double speed,
+				 struct tpacket2_hdr *thdr)
+{
+	uint64_t ts, target, now, err;
+
+	ts = thdr->tp_sec * NSEC_PER_SEC + thdr->tp_nsec;
+	if (unlikely(rt->packets == 0)) {
+		rt->base_pcap = ts;
+		rt->base_mono = rt->last_target = time_now_ns();
+		rt->err_min = ~0ULL;
+	}
+
+	/* Out of order timestamps are sent back to back. */
+	target = rt->base_mono;
+	if (ts > rt->base_pcap)
+		target += (uint64_t) ((ts - rt->base_pcap) / speed);
+	target = max(target, rt->last_target);
+	rt->last_target = target;
+
+	while ((now = time_wait_until_ns(target)) < target)
+		if (unlikely(sigint == 1))
+			return;
+
+	err = now - target;
+
+	rt->packets++;
+	rt->err_sum += err;
+	rt->err_sq += (long double) err * err;
+	rt->err_min = min(rt->err_min, err);
+	rt->err_max = max(rt->err_max, err);
+	if (err > REPLAY_LATE_NS)
+		rt->late++;
+}
+
+static void replay_timing_print(struct replay_timing *rt, double speed)
+{
+	long double mean, var;
+
+	if (rt->packets == 0)
+		return;
+
+	mean = rt->err_sum / rt->packets;
+	var = rt->err_sq / rt->packets - mean * mean;
+
+	printf("\r%12llu packets paced at %.2lfx speed\n",
+	       (unsigned long long) rt->packets, speed);
+	printf("\r%12.3Lf us mean timing error (stddev %.3Lf us)\n",
+	       mean / NSEC_PER_USEC, sqrtl(var > 0 ? var : 0) / NSEC_PER_USEC);
+	printf("\r%12.3lf us min, %.3lf us max timing error\n",
+	       1.0 * rt->err_min / NSEC_PER_USEC,
+	       1.0 * rt->err_max / NSEC_PER_USEC);
+	printf("\r%12llu packets later than %llu us\n",
+	       (unsigned long long) rt->late, REPLAY_LATE_NS / NSEC_PER_USEC);
+}
+
 static void pcap_to_xmit(struct ctx *ctx)
 {
 	__label__ out;
@@ -153,6 +251,10 @@ static void pcap_to_xmit(struct ctx *ctx)
 	struct frame_map *hdr;
 	struct sock_fprog bpf_ops;
 	struct timeval start, end, diff;
+	struct replay_timing rt;
+	struct tx_flush flush;
+	struct rewrite rw;
+	struct stat st;
 	pcap_pkthdr_t phdr;
 
 	if (!device_up_and_running(ctx->device_out) && !ctx->rfraw)
@@ -175,6 +277,8 @@ static void pcap_to_xmit(struct ctx *ctx)
 	if (ret)
 		panic("Error reading pcap header!\n");
 
+	ctx->codec = pcap_codec_get(ctx->magic);
+
 	if (__pcap_io->prepare_access_pcap) {
 		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
 		if (ret)
@@ -183,6 +287,7 @@ static void pcap_to_xmit(struct ctx *ctx)
 
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+	fmemset(&rt, 0, sizeof(rt));
 
 	if (ctx->rfraw) {
 		ctx->device_trans = xstrdup(ctx->device_out);
@@ -201,6 +306,9 @@ static void pcap_to_xmit(struct ctx *ctx)
 	if (ctx->dump_bpf)
 		bpf_dump_all(&bpf_ops);
 
+	if (ctx->rewrite)
+		rewrite_init(&rw, ctx->rewrite, ctx->link_type);
+
 	set_packet_loss_discard(tx_sock);
 	set_sockopt_hwtimestamp(tx_sock, ctx->device_out);
 
@@ -221,11 +329,12 @@ static void pcap_to_xmit(struct ctx *ctx)
 			       ctx->device_out, irq, ctx->cpu);
 	}
 
-	if (ctx->kpull)
-		interval = ctx->kpull;
-
-	set_itimer_interval_value(&itimer, 0, interval);
-	setitimer(ITIMER_REAL, &itimer, NULL); 
+	tx_flush_init(&flush, tx_sock, &tx_ring, ctx->kpull);
+	/* Reads from a pipe may block with frames pending. */
+	if (fstat(fd, &st) < 0)
+		panic("Cannot fstat pcap input!\n");
+	if (!S_ISREG(st.st_mode))
+		tx_flush_timer_start(&flush);
 
 	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
@@ -240,22 +349,27 @@ static void pcap_to_xmit(struct ctx *ctx)
 			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
 			do {
-				ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic, out,
+				tx_flush_may_block(&flush);
+
+				ret = __pcap_io->read_pcap(fd, &phdr, ctx->codec, out,
 							   ring_frame_size(&tx_ring));
 				if (unlikely(ret <= 0))
 					goto out;
 
 				if (ring_frame_size(&tx_ring) <
-				    pcap_get_length(&phdr, ctx->magic)) {
-					pcap_set_length(&phdr, ctx->magic,
-							ring_frame_size(&tx_ring));
+				    ctx->codec->get_length(&phdr)) {
+					ctx->codec->set_length(&phdr,
+							       ring_frame_size(&tx_ring));
 					trunced++;
 				}
 			} while (ctx->filter &&
 				 !bpf_run_filter(&bpf_ops, out,
-						 pcap_get_length(&phdr, ctx->magic)));
+						 ctx->codec->get_length(&phdr)));
 
-			pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &hdr->tp_h, &hdr->s_ll);
+			ctx->codec->to_tpacket(&phdr, &hdr->tp_h);
+
+			if (ctx->rewrite)
+				rewrite_apply(&rw, out, hdr->tp_h.tp_snaplen);
 
 			ctx->tx_bytes += hdr->tp_h.tp_len;;
 			ctx->tx_packets++;
@@ -265,7 +379,16 @@ static void pcap_to_xmit(struct ctx *ctx)
 			dissector_entry_point(out, hdr->tp_h.tp_snaplen,
 					      ctx->link_type, ctx->print_mode);
 
+			if (ctx->replay_timing)
+				replay_wait_for_slot(&rt, ctx->replay_speed,
+						     &hdr->tp_h);
+
 			kernel_may_pull_from_tx(&hdr->tp_h);
+			tx_flush_queued(&flush);
+
+			/* In paced mode, every frame is kicked out at its own deadline. */
+			if (ctx->replay_timing)
+				tx_flush_kick(&flush);
 
 			it++;
 			if (it >= tx_ring.layout.tp_frame_nr)
@@ -281,10 +404,15 @@ static void pcap_to_xmit(struct ctx *ctx)
 				}
 			}
 		}
+
+		tx_flush_kick(&flush);
 	}
 
 	out:
 
+	tx_flush_kick(&flush);
+	tx_flush_timer_stop(&flush);
+
 	bug_on(gettimeofday(&end, NULL));
 	timersub(&end, &start, &diff);
 
@@ -312,210 +440,1283 @@ static void pcap_to_xmit(struct ctx *ctx)
 	printf("\r%12lu packets truncated in file\n", trunced);
 	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
 	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+	tx_flush_print(&flush);
+
+	if (ctx->replay_timing)
+		replay_timing_print(&rt, ctx->replay_speed);
+
+	if (ctx->rewrite) {
+		printf("\r%12lu packets rewritten\n", rw.rewritten);
+		rewrite_destroy(&rw);
+	}
 }
 
-static void receive_to_xmit(struct ctx *ctx)
+static void pcap_loop_to_xmit(struct ctx *ctx)
 {
-	short ifflags = 0;
-	uint8_t *in, *out;
-	int rx_sock, ifindex_in, ifindex_out;
-	unsigned int size_in, size_out, it_in = 0, it_out = 0;
-	unsigned long frame_count = 0;
-	struct frame_map *hdr_in, *hdr_out;
-	struct ring tx_ring, rx_ring;
-	struct pollfd rx_poll;
+	uint8_t *out = NULL;
+	int ifindex, fd, ret;
+	unsigned int size, it = 0;
+	unsigned long trunced = 0, loop;
+	size_t i;
+	struct ring tx_ring;
+	struct frame_map *hdr;
 	struct sock_fprog bpf_ops;
+	struct timeval start, end, diff;
+	struct pcap_arena arena;
+	struct pcap_desc *d;
+	struct tpacket2_hdr thdr;
+	struct stat st;
+	struct tx_flush flush;
+	struct rewrite rw;
+	pcap_pkthdr_t phdr;
 
-	if (!strncmp(ctx->device_in, ctx->device_out, IFNAMSIZ))
-		panic("Ingress/egress devices must be different!\n");
 	if (!device_up_and_running(ctx->device_out))
-		panic("Egress device not up and running!\n");
-	if (!device_up_and_running(ctx->device_in))
-		panic("Ingress device not up and running!\n");
+		panic("Device not up and running!\n");
+
+	bug_on(!__pcap_io);
+
+	if (!strncmp("-", ctx->device_in, strlen("-")))
+		panic("Looped replay needs a pcap file, not stdin!\n");
 
-	rx_sock = pf_socket();
 	tx_sock = pf_socket();
 
+	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	if (fstat(fd, &st) < 0)
+		panic("Cannot fstat pcap file!\n");
+
+	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
+	if (ret)
+		panic("Error reading pcap header!\n");
+
+	ctx->codec = pcap_codec_get(ctx->magic);
+
+	if (__pcap_io->prepare_access_pcap) {
+		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
+		if (ret)
+			panic("Error prepare reading pcap!\n");
+	}
+
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
-	fmemset(&rx_ring, 0, sizeof(rx_ring));
-	fmemset(&rx_poll, 0, sizeof(rx_poll));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
 
-	ifindex_in = device_ifindex(ctx->device_in);
-	ifindex_out = device_ifindex(ctx->device_out);
-
-	size_in = ring_size(ctx->device_in, ctx->reserve_size);
-	size_out = ring_size(ctx->device_out, ctx->reserve_size);
+	ifindex = device_ifindex(ctx->device_out);
 
-	enable_kernel_bpf_jit_compiler();
+	size = ring_size(ctx->device_out, ctx->reserve_size);
 
 	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
 	if (ctx->dump_bpf)
 		bpf_dump_all(&bpf_ops);
-	bpf_attach_to_sock(rx_sock, &bpf_ops);
-
-	setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo);
-	create_rx_ring(rx_sock, &rx_ring, ctx->verbose);
-	mmap_rx_ring(rx_sock, &rx_ring);
-	alloc_rx_ring_frames(&rx_ring);
-	bind_rx_ring(rx_sock, &rx_ring, ifindex_in);
-	prepare_polling(rx_sock, &rx_poll);
 
 	set_packet_loss_discard(tx_sock);
-	setup_tx_ring_layout(tx_sock, &tx_ring, size_out, ctx->jumbo);
+	set_sockopt_hwtimestamp(tx_sock, ctx->device_out);
+
+	setup_tx_ring_layout(tx_sock, &tx_ring, size, ctx->jumbo);
 	create_tx_ring(tx_sock, &tx_ring, ctx->verbose);
 	mmap_tx_ring(tx_sock, &tx_ring);
 	alloc_tx_ring_frames(&tx_ring);
-	bind_tx_ring(tx_sock, &tx_ring, ifindex_out);
+	bind_tx_ring(tx_sock, &tx_ring, ifindex);
 
-	dissector_init_all(ctx->print_mode);
+	/* Packet data never exceeds the file, plus room for one read. */
+	pcap_arena_init(&arena, st.st_size + ring_frame_size(&tx_ring),
+			ctx->link_type);
 
-	 if (ctx->promiscuous)
-		ifflags = enter_promiscuous_mode(ctx->device_in);
+	while (1) {
+		out = pcap_arena_reserve(&arena, ring_frame_size(&tx_ring));
+		bug_on(!out);
 
-	if (ctx->kpull)
-		interval = ctx->kpull;
+		ret = __pcap_io->read_pcap(fd, &phdr, ctx->codec, out,
+					   ring_frame_size(&tx_ring));
+		if (ret <= 0)
+			break;
 
-	set_itimer_interval_value(&itimer, 0, interval);
-	setitimer(ITIMER_REAL, &itimer, NULL);
+		if (ring_frame_size(&tx_ring) < ctx->codec->get_length(&phdr)) {
+			ctx->codec->set_length(&phdr, ring_frame_size(&tx_ring));
+			trunced++;
+		}
 
-	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+		if (ctx->filter &&
+		    !bpf_run_filter(&bpf_ops, out, ctx->codec->get_length(&phdr)))
+			continue;
 
-	printf("Running! Hang up with ^C!\n\n");
-	fflush(stdout);
+		ctx->codec->to_tpacket(&phdr, &thdr);
+		pcap_arena_commit(&arena, thdr.tp_snaplen, thdr.tp_len);
+	}
 
-	while (likely(sigint == 0)) {
-		while (user_may_pull_from_rx(rx_ring.frames[it_in].iov_base)) {
-			__label__ next;
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
+	close(fd);
 
-			hdr_in = rx_ring.frames[it_in].iov_base;
-			in = ((uint8_t *) hdr_in) + hdr_in->tp_h.tp_mac;
+	if (arena.nr == 0)
+		panic("No packets to replay!\n");
 
-			frame_count++;
+	if (ctx->rewrite)
+		rewrite_init(&rw, ctx->rewrite, ctx->link_type);
 
-			if (ctx->packet_type != -1)
-				if (ctx->packet_type != hdr_in->s_ll.sll_pkttype)
-					goto next;
+	if (ctx->verbose)
+		printf("Loaded %zu packets, %zu bytes into %s arena\n",
+		       arena.nr, arena.used, arena.huge ? "hugepage" : "regular");
 
-			hdr_out = tx_ring.frames[it_out].iov_base;
-			out = ((uint8_t *) hdr_out) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+	dissector_init_all(ctx->print_mode);
 
-			for (; !user_may_pull_from_tx(tx_ring.frames[it_out].iov_base) &&
-			       likely(!sigint);) {
-				if (ctx->randomize)
-					next_rnd_slot(&it_out, &tx_ring);
-				else {
-					it_out++;
-					if (it_out >= tx_ring.layout.tp_frame_nr)
-						it_out = 0;
-				}
+	tx_flush_init(&flush, tx_sock, &tx_ring, ctx->kpull);
 
-				hdr_out = tx_ring.frames[it_out].iov_base;
-				out = ((uint8_t *) hdr_out) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
-			}
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
-			tpacket_hdr_clone(&hdr_out->tp_h, &hdr_in->tp_h);
-			fmemcpy(out, in, hdr_in->tp_h.tp_len);
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
 
-			kernel_may_pull_from_tx(&hdr_out->tp_h);
-			if (ctx->randomize)
-				next_rnd_slot(&it_out, &tx_ring);
-			else {
-				it_out++;
-				if (it_out >= tx_ring.layout.tp_frame_nr)
-					it_out = 0;
-			}
+	bug_on(gettimeofday(&start, NULL));
 
-			show_frame_hdr(hdr_in, ctx->print_mode);
+	for (loop = 0; !ctx->loops || loop < ctx->loops; ++loop) {
+		for (i = 0; i < arena.nr; ++i) {
+			d = &arena.descs[i];
+			hdr = tx_ring.frames[it].iov_base;
 
-			dissector_entry_point(in, hdr_in->tp_h.tp_snaplen,
-					      ctx->link_type, ctx->print_mode);
+			if (!user_may_pull_from_tx(&hdr->tp_h))
+				tx_flush_kick(&flush);
 
-			if (frame_count_max != 0) {
-				if (frame_count >= frame_count_max) {
-					sigint = 1;
-					break;
-				}
+			while (!user_may_pull_from_tx(&hdr->tp_h)) {
+				if (unlikely(sigint == 1))
+					goto out;
 			}
 
-			next:
+			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
-			kernel_may_pull_from_rx(&hdr_in->tp_h);
+			fmemcpy(out, d->data, d->snaplen);
+			pcap_arena_rewrite(d, out, ctx->loop_incr, loop);
+			if (ctx->rewrite)
+				rewrite_apply(&rw, out, d->snaplen);
 
-			it_in++;
-			if (it_in >= rx_ring.layout.tp_frame_nr)
-				it_in = 0;
+			hdr->tp_h.tp_snaplen = d->snaplen;
+			hdr->tp_h.tp_len = d->len;
+
+			ctx->tx_bytes += d->len;
+			ctx->tx_packets++;
+
+			show_frame_hdr(hdr, ctx->print_mode);
+
+			dissector_entry_point(out, hdr->tp_h.tp_snaplen,
+					      ctx->link_type, ctx->print_mode);
+
+			kernel_may_pull_from_tx(&hdr->tp_h);
+			tx_flush_queued(&flush);
+
+			it++;
+			if (it >= tx_ring.layout.tp_frame_nr)
+				it = 0;
 
 			if (unlikely(sigint == 1))
 				goto out;
-		}
 
-		poll(&rx_poll, 1, -1);
+			if (frame_count_max != 0) {
+				if (ctx->tx_packets >= frame_count_max) {
+					sigint = 1;
+					goto out;
+				}
+			}
+		}
 	}
 
 	out:
 
-	sock_print_net_stats(rx_sock, 0);
+	tx_flush_kick(&flush);
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	pull_and_flush_tx_ring_wait(tx_sock);
 
 	bpf_release(&bpf_ops);
 
 	dissector_cleanup_all();
-
 	destroy_tx_ring(tx_sock, &tx_ring);
-	destroy_rx_ring(rx_sock, &rx_ring);
-
-	if (ctx->promiscuous)
-		leave_promiscuous_mode(ctx->device_in, ifflags);
+	pcap_arena_destroy(&arena);
 
 	close(tx_sock);
-	close(rx_sock);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12lu loops completed\n", loop);
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+	tx_flush_print(&flush);
+
+	if (ctx->rewrite) {
+		printf("\r%12lu packets rewritten\n", rw.rewritten);
+		rewrite_destroy(&rw);
+	}
+}
+
+/* Packets handed to the same worker in a row when splitting round robin */
+#define TX_RR_CHUNK		64
+#define TX_RING_SIZE_MIN	(1 << 22)
+/* Per worker record queue in bytes, filled by the pcap reader */
+#define TX_QUEUE_SIZE		(4 * 1024 * 1024)
+
+/* Size first, see struct rec_queue */
+struct tx_record {
+	uint32_t size;
+	pcap_pkthdr_t phdr;
+	uint8_t data[0];
+};
+
+/*
+ * The reader only pulls records off the file and queues them. Filtering,
+ * rewriting, dissection and the copy into the TX ring are up to the worker
+ * that owns the ring.
+ */
+struct tx_worker {
+	pthread_t trid;
+	int sock, cpu;
+	unsigned int it;
+	struct ring ring;
+	struct tx_flush flush;
+	struct ctx *ctx;
+	struct sock_fprog *bpf_ops;
+	struct rewrite *rw;
+	unsigned long packets, bytes;
+	struct rec_queue queue;
+} __cacheline_aligned;
+
+static unsigned long tx_matched = 0;
+
+/* The dissector output is shared by all workers */
+static pthread_mutex_t tx_print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct frame_map *tx_worker_next_frame(struct tx_worker *w)
+{
+	struct frame_map *hdr = w->ring.frames[w->it].iov_base;
+
+	/* Ring is full, so sleep in the kernel until it sent what we have. */
+	while (!user_may_pull_from_tx(&hdr->tp_h)) {
+		if (unlikely(sigint == 1))
+			return NULL;
+
+		tx_flush_kick(&w->flush);
+		pull_and_flush_tx_ring_wait(w->sock);
+	}
+
+	return hdr;
 }
 
-static void translate_pcap_to_txf(int fdo, uint8_t *out, size_t len)
+static bool tx_worker_process(struct tx_worker *w, struct tx_record *r)
 {
-	size_t bytes_done = 0;
-	char bout[80];
+	struct ctx *ctx = w->ctx;
+	size_t len = ctx->codec->get_length(&r->phdr);
+	struct frame_map *hdr;
+	uint8_t *out;
+
+	if (ctx->filter && !bpf_run_filter(w->bpf_ops, r->data, len))
+		return true;
+
+	if (frame_count_max != 0 &&
+	    __sync_add_and_fetch(&tx_matched, 1) > frame_count_max) {
+		sigint = 1;
+		return false;
+	}
 
-	slprintf(bout, sizeof(bout), "{\n  ");
-	write_or_die(fdo, bout, strlen(bout));
+	hdr = tx_worker_next_frame(w);
+	if (unlikely(!hdr))
+		return false;
 
-	while (bytes_done < len) {
-		slprintf(bout, sizeof(bout), "0x%02x, ", out[bytes_done]);
-		write_or_die(fdo, bout, strlen(bout));
+	out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
-		bytes_done++;
+	ctx->codec->to_tpacket(&r->phdr, &hdr->tp_h);
+	/* The kernel sends tp_len bytes, only len are in the frame. */
+	hdr->tp_h.tp_len = len;
+	tx_frame_copy(out, r->data, len);
 
-		if (bytes_done % 10 == 0) {
-			slprintf(bout, sizeof(bout), "\n");
-			write_or_die(fdo, bout, strlen(bout));
+	/* Rewrite counters are updated atomically, no lock needed. */
+	if (ctx->rewrite)
+		rewrite_apply(w->rw, out, len);
 
-			if (bytes_done < len) {
-				slprintf(bout, sizeof(bout), "  ");
-				write_or_die(fdo, bout, strlen(bout));
-			}
-		}
+	w->packets++;
+	w->bytes += hdr->tp_h.tp_len;
+
+	if (ctx->print_mode != PRINT_NONE) {
+		pthread_mutex_lock(&tx_print_lock);
+		show_frame_hdr(hdr, ctx->print_mode);
+		dissector_entry_point(out, len, ctx->link_type,
+				      ctx->print_mode);
+		pthread_mutex_unlock(&tx_print_lock);
 	}
-	if (bytes_done % 10 != 0) {
-		slprintf(bout, sizeof(bout), "\n");
-		write_or_die(fdo, bout, strlen(bout));
+
+	/* Frame content must be visible before the kernel may pick it up. */
+	__sync_synchronize();
+	kernel_may_pull_from_tx(&hdr->tp_h);
+	tx_flush_queued(&w->flush);
+
+	w->it++;
+	if (w->it >= w->ring.layout.tp_frame_nr)
+		w->it = 0;
+
+	return true;
+}
+
+static void *tx_worker_loop(void *arg)
+{
+	struct tx_worker *w = arg;
+	struct tx_record *r;
+
+	while (likely(sigint == 0)) {
+		r = rec_queue_peek(&w->queue);
+		if (!r) {
+			/* Nothing to batch with, the kernel gets what is pending. */
+			tx_flush_kick(&w->flush);
+			if (!rec_queue_wait_more(&w->queue))
+				break;
+			continue;
+		}
+
+		if (unlikely(!tx_worker_process(w, r)))
+			break;
+
+		rec_queue_pop(&w->queue, r);
 	}
 
-	slprintf(bout, sizeof(bout), "}\n\n");
-	write_or_die(fdo, bout, strlen(bout));
+	tx_flush_kick(&w->flush);
+	pull_and_flush_tx_ring_wait(w->sock);
+
+	rec_queue_quit(&w->queue);
+
+	pthread_exit(NULL);
 }
 
-static void read_pcap(struct ctx *ctx)
+static inline unsigned int flow_worker(uint8_t *packet, size_t len,
+				       uint32_t link_type, unsigned int nr)
 {
-	__label__ out;
-	uint8_t *out;
-	int ret, fd, fdo = 0;
+	struct flow_key key;
+
+	/* Everything we cannot classify stays in order on the first worker. */
+	if (link_type != LINKTYPE_EN10MB ||
+	    flow_key_extract(&key, FLOW_KEY_5TUPLE, packet, len) < 0)
+		return 0;
+
+	return flow_key_hash(&key) % nr;
+}
+
+static void pcap_to_xmit_parallel(struct ctx *ctx)
+{
+	uint8_t *out, *stage = NULL;
+	int ifindex, fd = 0, ret, cpus;
+	unsigned int size, i, cur = 0, chunk = 0;
 	unsigned long trunced = 0;
-	size_t out_len;
-	pcap_pkthdr_t phdr;
+	size_t frame_size, len;
+	struct tx_worker *workers, *w = NULL;
+	struct tx_record *r = NULL;
 	struct sock_fprog bpf_ops;
-	struct frame_map fm;
 	struct timeval start, end, diff;
-	struct sockaddr_ll sll;
+	struct rewrite rw;
+	pcap_pkthdr_t phdr;
+	double secs;
+
+	if (!device_up_and_running(ctx->device_out))
+		panic("Device not up and running!\n");
+
+	bug_on(!__pcap_io);
+
+	if (!strncmp("-", ctx->device_in, strlen("-"))) {
+		fd = dup(fileno(stdin));
+		close(fileno(stdin));
+		if (ctx->pcap == PCAP_OPS_MM)
+			ctx->pcap = PCAP_OPS_SG;
+	} else {
+		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	}
+
+	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
+	if (ret)
+		panic("Error reading pcap header!\n");
+
+	ctx->codec = pcap_codec_get(ctx->magic);
+
+	if (__pcap_io->prepare_access_pcap) {
+		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
+		if (ret)
+			panic("Error prepare reading pcap!\n");
+	}
+
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	ifindex = device_ifindex(ctx->device_out);
+
+	/* The ring memory is spread over all workers. */
+	size = max(ring_size(ctx->device_out, ctx->reserve_size) /
+		   ctx->tx_threads, (unsigned int) TX_RING_SIZE_MIN);
+
+	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+
+	if (ctx->rewrite)
+		rewrite_init(&rw, ctx->rewrite, ctx->link_type);
+
+	dissector_init_all(ctx->print_mode);
+
+	cpus = get_number_cpus_online();
+	workers = xzmalloc_aligned(ctx->tx_threads * sizeof(*workers),
+				   CO_CACHE_LINE_SIZE);
+
+	for (i = 0; i < ctx->tx_threads; ++i) {
+		cpu_set_t cpuset;
+
+		w = &workers[i];
+		w->sock = pf_socket();
+		w->cpu = i % cpus;
+		w->ctx = ctx;
+		w->bpf_ops = &bpf_ops;
+		w->rw = &rw;
+
+		set_packet_loss_discard(w->sock);
+		if (set_sockopt_qdisc_bypass(w->sock) && ctx->verbose && i == 0)
+			printf("No qdisc bypass support, using qdisc path!\n");
+
+		setup_tx_ring_layout(w->sock, &w->ring, size, ctx->jumbo);
+		create_tx_ring(w->sock, &w->ring, ctx->verbose);
+		mmap_tx_ring(w->sock, &w->ring);
+		alloc_tx_ring_frames(&w->ring);
+		bind_tx_ring(w->sock, &w->ring, ifindex);
+
+		tx_flush_init(&w->flush, w->sock, &w->ring, 0);
+
+		rec_queue_init(&w->queue, TX_QUEUE_SIZE,
+			       sizeof(*r) + ring_frame_size(&w->ring));
+
+		ret = pthread_create(&w->trid, NULL, tx_worker_loop, w);
+		if (ret)
+			panic("Thread creation failed!\n");
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(w->cpu, &cpuset);
+
+		ret = pthread_setaffinity_np(w->trid, sizeof(cpuset), &cpuset);
+		if (ret)
+			panic("Thread CPU migration failed!\n");
+	}
+
+	frame_size = ring_frame_size(&workers[0].ring);
+
+	if (ctx->tx_split == TX_SPLIT_FLOW)
+		stage = xmalloc_aligned(frame_size, CO_CACHE_LINE_SIZE);
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Running with %u TX threads (%s)! Hang up with ^C!\n\n",
+	       ctx->tx_threads, ctx->tx_split == TX_SPLIT_FLOW ?
+	       "per flow" : "round robin");
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	while (likely(sigint == 0)) {
+		if (ctx->tx_split == TX_SPLIT_RR) {
+			if (chunk++ == TX_RR_CHUNK) {
+				chunk = 1;
+				cur = (cur + 1) % ctx->tx_threads;
+			}
+
+			/* Round robin reads straight into the worker's queue. */
+			w = &workers[cur];
+			r = rec_queue_reserve(&w->queue, sizeof(*r) + frame_size);
+			if (unlikely(!r))
+				break;
+
+			out = r->data;
+		} else {
+			out = stage;
+		}
+
+		ret = __pcap_io->read_pcap(fd, &phdr, ctx->codec, out,
+					   frame_size);
+		if (unlikely(ret <= 0))
+			break;
+
+		len = ctx->codec->get_length(&phdr);
+		if (frame_size < len) {
+			ctx->codec->set_length(&phdr, frame_size);
+			len = frame_size;
+			trunced++;
+		}
+
+		if (ctx->tx_split == TX_SPLIT_FLOW) {
+			w = &workers[flow_worker(stage, len, ctx->link_type,
+						 ctx->tx_threads)];
+			r = rec_queue_reserve(&w->queue, sizeof(*r) + len);
+			if (unlikely(!r))
+				break;
+
+			fmemcpy(r->data, stage, len);
+		}
+
+		fmemcpy(&r->phdr, &phdr, sizeof(phdr));
+		rec_queue_commit(&w->queue, r, sizeof(*r) + len);
+	}
+
+	for (i = 0; i < ctx->tx_threads; ++i) {
+		rec_queue_close(&workers[i].queue);
+		pthread_join(workers[i].trid, NULL);
+	}
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	secs = diff.tv_sec + diff.tv_usec / 1e6;
+
+	bpf_release(&bpf_ops);
+
+	dissector_cleanup_all();
+
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
+
+	if (strncmp("-", ctx->device_in, strlen("-")))
+		close(fd);
+	else
+		dup2(fd, fileno(stdin));
+
+	ctx->tx_packets = ctx->tx_bytes = 0;
+
+	fflush(stdout);
+	printf("\n");
+
+	for (i = 0; i < ctx->tx_threads; ++i) {
+		w = &workers[i];
+
+		printf("\r  TX%-3u CPU%-3d %12lu packets %14lu bytes %12.0lf pps\n",
+		       i, w->cpu, w->packets, w->bytes,
+		       secs > 0 ? w->packets / secs : 0.0);
+
+		ctx->tx_packets += w->packets;
+		ctx->tx_bytes += w->bytes;
+
+		destroy_tx_ring(w->sock, &w->ring);
+		close(w->sock);
+
+		rec_queue_destroy(&w->queue);
+	}
+
+
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	printf("\r%12.0lf pps, %.2lf Mbit/s in total\n",
+	       secs > 0 ? ctx->tx_packets / secs : 0.0,
+	       secs > 0 ? 8.0 * ctx->tx_bytes / secs / 1e6 : 0.0);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+
+	if (ctx->rewrite) {
+		printf("\r%12lu packets rewritten\n", rw.rewritten);
+		rewrite_destroy(&rw);
+	}
+
+	if (stage)
+		xfree(stage);
+	xfree(workers);
+}
+
+static void receive_to_xmit(struct ctx *ctx)
+{
+	short ifflags = 0;
+	uint8_t *in, *out;
+	int rx_sock, ifindex_in, ifindex_out;
+	unsigned int size_in, size_out, it_in = 0, it_out = 0;
+	unsigned long frame_count = 0, forwarded = 0;
+	uint64_t cycles = 0, t0;
+	struct frame_map *hdr_in, *hdr_out;
+	struct ring tx_ring, rx_ring;
+	struct pollfd rx_poll;
+	struct sock_fprog bpf_ops;
+	struct tx_flush flush;
+	struct rewrite rw;
+
+	if (!strncmp(ctx->device_in, ctx->device_out, IFNAMSIZ))
+		panic("Ingress/egress devices must be different!\n");
+	if (!device_up_and_running(ctx->device_out))
+		panic("Egress device not up and running!\n");
+	if (!device_up_and_running(ctx->device_in))
+		panic("Ingress device not up and running!\n");
+
+	rx_sock = pf_socket();
+	tx_sock = ctx->shared_ring ? rx_sock : pf_socket();
+
+	fmemset(&tx_ring, 0, sizeof(tx_ring));
+	fmemset(&rx_ring, 0, sizeof(rx_ring));
+	fmemset(&rx_poll, 0, sizeof(rx_poll));
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	ifindex_in = device_ifindex(ctx->device_in);
+	ifindex_out = device_ifindex(ctx->device_out);
+
+	size_in = ring_size(ctx->device_in, ctx->reserve_size);
+	size_out = ring_size(ctx->device_out, ctx->reserve_size);
+
+	enable_kernel_bpf_jit_compiler();
+
+	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+	bpf_attach_to_sock(rx_sock, &bpf_ops);
+
+	if (ctx->rewrite)
+		rewrite_init(&rw, ctx->rewrite, ctx->link_type);
+
+	if (ctx->shared_ring) {
+		/*
+		 * One socket bound to the ingress device carries both rings
+		 * in one mapping, TX is directed to the egress device.
+		 */
+		setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo);
+		create_rx_ring(rx_sock, &rx_ring, ctx->verbose);
+
+		set_packet_loss_discard(tx_sock);
+		setup_tx_ring_layout(tx_sock, &tx_ring, size_out, ctx->jumbo);
+		create_tx_ring(tx_sock, &tx_ring, ctx->verbose);
+
+		mmap_rx_tx_ring(rx_sock, &rx_ring, &tx_ring);
+		alloc_rx_ring_frames(&rx_ring);
+		alloc_tx_ring_frames(&tx_ring);
+
+		bind_rx_ring(rx_sock, &rx_ring, ifindex_in);
+		set_tx_ring_dest(&tx_ring, ifindex_out);
+	} else {
+		setup_rx_ring_layout(rx_sock, &rx_ring, size_in, ctx->jumbo);
+		create_rx_ring(rx_sock, &rx_ring, ctx->verbose);
+		mmap_rx_ring(rx_sock, &rx_ring);
+		alloc_rx_ring_frames(&rx_ring);
+		bind_rx_ring(rx_sock, &rx_ring, ifindex_in);
+
+		set_packet_loss_discard(tx_sock);
+		setup_tx_ring_layout(tx_sock, &tx_ring, size_out, ctx->jumbo);
+		create_tx_ring(tx_sock, &tx_ring, ctx->verbose);
+		mmap_tx_ring(tx_sock, &tx_ring);
+		alloc_tx_ring_frames(&tx_ring);
+		bind_tx_ring(tx_sock, &tx_ring, ifindex_out);
+	}
+
+	prepare_polling(rx_sock, &rx_poll);
+
+	dissector_init_all(ctx->print_mode);
+
+	 if (ctx->promiscuous)
+		ifflags = enter_promiscuous_mode(ctx->device_in);
+
+	tx_flush_init(&flush, tx_sock, &tx_ring, ctx->kpull);
+	if (ctx->shared_ring)
+		flush.dest = &tx_ring.s_ll;
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	while (likely(sigint == 0)) {
+		while (user_may_pull_from_rx(rx_ring.frames[it_in].iov_base)) {
+			__label__ next;
+
+			hdr_in = rx_ring.frames[it_in].iov_base;
+			in = ((uint8_t *) hdr_in) + hdr_in->tp_h.tp_mac;
+
+			frame_count++;
+
+			if (ctx->packet_type != -1)
+				if (ctx->packet_type != hdr_in->s_ll.sll_pkttype)
+					goto next;
+
+			t0 = xcycles();
+
+			if (!user_may_pull_from_tx(tx_ring.frames[it_out].iov_base))
+				tx_flush_kick(&flush);
+
+			/*
+			 * Frames complete in ring order, so unless we pick
+			 * slots at random, only the next one is worth waiting for.
+			 */
+			while (!user_may_pull_from_tx(tx_ring.frames[it_out].iov_base) &&
+			       likely(!sigint)) {
+				if (ctx->randomize)
+					next_rnd_slot(&it_out, &tx_ring);
+			}
+
+			hdr_out = tx_ring.frames[it_out].iov_base;
+			out = ((uint8_t *) hdr_out) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+			tpacket_hdr_clone(&hdr_out->tp_h, &hdr_in->tp_h);
+			/* The kernel sends tp_len bytes, only snaplen are in the frame. */
+			hdr_out->tp_h.tp_len = hdr_out->tp_h.tp_snaplen;
+			tx_frame_copy(out, in, hdr_in->tp_h.tp_snaplen);
+
+			if (ctx->rewrite)
+				rewrite_apply(&rw, out, hdr_out->tp_h.tp_snaplen);
+
+			kernel_may_pull_from_tx(&hdr_out->tp_h);
+			tx_flush_queued(&flush);
+
+			cycles += xcycles() - t0;
+			forwarded++;
+
+			if (ctx->randomize)
+				next_rnd_slot(&it_out, &tx_ring);
+			else {
+				it_out++;
+				if (it_out >= tx_ring.layout.tp_frame_nr)
+					it_out = 0;
+			}
+
+			show_frame_hdr(hdr_in, ctx->print_mode);
+
+			dissector_entry_point(in, hdr_in->tp_h.tp_snaplen,
+					      ctx->link_type, ctx->print_mode);
+
+			if (frame_count_max != 0) {
+				if (frame_count >= frame_count_max) {
+					sigint = 1;
+					break;
+				}
+			}
+
+			next:
+
+			kernel_may_pull_from_rx(&hdr_in->tp_h);
+
+			it_in++;
+			if (it_in >= rx_ring.layout.tp_frame_nr)
+				it_in = 0;
+
+			if (unlikely(sigint == 1))
+				goto out;
+		}
+
+		/* Nothing must linger in the TX ring while we sleep. */
+		tx_flush_kick(&flush);
+		poll(&rx_poll, 1, -1);
+	}
+
+	out:
+
+	tx_flush_kick(&flush);
+
+	sock_print_net_stats(rx_sock, 0, 0);
+	tx_flush_print(&flush);
+	printf("\r%12.1lf cycles per forwarded packet\n",
+	       forwarded ? 1.0 * cycles / forwarded : 0.0);
+
+	if (ctx->rewrite) {
+		printf("\r%12lu packets rewritten\n", rw.rewritten);
+		rewrite_destroy(&rw);
+	}
+
+	bpf_release(&bpf_ops);
+
+	dissector_cleanup_all();
+
+	destroy_tx_ring(tx_sock, &tx_ring);
+	destroy_rx_ring(rx_sock, &rx_ring);
+
+	if (ctx->promiscuous)
+		leave_promiscuous_mode(ctx->device_in, ifflags);
+
+	if (!ctx->shared_ring)
+		close(tx_sock);
+	close(rx_sock);
+}
+
+#define BRIDGE_QUEUES_MAX	64
+#define BRIDGE_POLL_MS		100
+
+struct bridge_queue {
+	pthread_t trid;
+	int rx_sock, tx_sock, cpu, dir, queue, packet_type;
+	const char *dev_in, *dev_out;
+	struct ring rx_ring, tx_ring;
+	struct tx_flush flush;
+	unsigned long packets, bytes;
+} __cacheline_aligned;
+
+static void *bridge_queue_loop(void *arg)
+{
+	uint8_t *in, *out;
+	unsigned int it_in = 0, it_out = 0;
+	struct bridge_queue *q = arg;
+	struct frame_map *hdr_in, *hdr_out;
+	struct pollfd rx_poll;
+
+	prepare_polling(q->rx_sock, &rx_poll);
+
+	while (likely(sigint == 0)) {
+		while (user_may_pull_from_rx(q->rx_ring.frames[it_in].iov_base)) {
+			hdr_in = q->rx_ring.frames[it_in].iov_base;
+			in = ((uint8_t *) hdr_in) + hdr_in->tp_h.tp_mac;
+
+			/* What we send out on our RX device must never come back. */
+			if (hdr_in->s_ll.sll_pkttype == PACKET_OUTGOING ||
+			    (q->packet_type != -1 &&
+			     q->packet_type != hdr_in->s_ll.sll_pkttype))
+				goto next;
+
+			hdr_out = q->tx_ring.frames[it_out].iov_base;
+			if (!user_may_pull_from_tx(&hdr_out->tp_h))
+				tx_flush_kick(&q->flush);
+
+			while (!user_may_pull_from_tx(&hdr_out->tp_h)) {
+				if (unlikely(sigint == 1))
+					goto out;
+			}
+
+			out = ((uint8_t *) hdr_out) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+			tpacket_hdr_clone(&hdr_out->tp_h, &hdr_in->tp_h);
+			/* The kernel sends tp_len bytes, only snaplen are in the frame. */
+			hdr_out->tp_h.tp_len = hdr_out->tp_h.tp_snaplen;
+			tx_frame_copy(out, in, hdr_in->tp_h.tp_snaplen);
+
+			kernel_may_pull_from_tx(&hdr_out->tp_h);
+			tx_flush_queued(&q->flush);
+
+			q->packets++;
+			q->bytes += hdr_out->tp_h.tp_len;
+
+			it_out++;
+			if (it_out >= q->tx_ring.layout.tp_frame_nr)
+				it_out = 0;
+		next:
+			kernel_may_pull_from_rx(&hdr_in->tp_h);
+
+			it_in++;
+			if (it_in >= q->rx_ring.layout.tp_frame_nr)
+				it_in = 0;
+
+			if (unlikely(sigint == 1))
+				goto out;
+		}
+
+		tx_flush_kick(&q->flush);
+		poll(&rx_poll, 1, BRIDGE_POLL_MS);
+	}
+out:
+	tx_flush_kick(&q->flush);
+
+	pthread_exit(NULL);
+}
+
+static void bridge_align_irqs(struct bridge_queue *queues, unsigned int nr,
+			      const char *dev, int verbose)
+{
+	int irqs[BRIDGE_QUEUES_MAX * 4], nirqs, i;
+
+	nirqs = device_queue_irqs(dev, irqs, array_size(irqs));
+	if (nirqs == 0) {
+		irqs[0] = device_irq_number(dev);
+		if (irqs[0] <= 0)
+			return;
+		nirqs = 1;
+	}
+
+	/* RX queue i raises its IRQ on the CPU of bridge thread i mod nr. */
+	for (i = 0; i < nirqs; ++i) {
+		int cpu = queues[i % nr].cpu;
+
+		if (device_set_irq_affinity_list(irqs[i], cpu, cpu) < 0)
+			continue;
+		if (verbose)
+			printf("IRQ: %s:%d > CPU%d\n", dev, irqs[i], cpu);
+	}
+}
+
+static void bridge_xmit(struct ctx *ctx)
+{
+	short ifflags[2] = { 0, 0 };
+	int ret, cpus, dir, fanout_id[2], ifindex[2], one = 1;
+	unsigned int i, nr = ctx->bridge_queues, size[2];
+	unsigned long packets = 0, bytes = 0;
+	const char *dev[2] = { ctx->device_in, ctx->device_out };
+	char *filter[2] = { ctx->filter, ctx->filter_rev };
+	int packet_type[2] = { ctx->packet_type, ctx->packet_type_rev };
+	struct sock_fprog bpf_ops[2];
+	struct bridge_queue *queues, *q;
+	struct timeval start, end, diff;
+
+	if (!strncmp(ctx->device_in, ctx->device_out, IFNAMSIZ))
+		panic("Bridge devices must be different!\n");
+	if (!device_up_and_running(ctx->device_in) ||
+	    !device_up_and_running(ctx->device_out))
+		panic("Bridge devices must be up and running!\n");
+
+	cpus = get_number_cpus_online();
+	queues = xzmalloc_aligned(2 * nr * sizeof(*queues), CO_CACHE_LINE_SIZE);
+
+	enable_kernel_bpf_jit_compiler();
+
+	for (dir = 0; dir < 2; ++dir) {
+		fmemset(&bpf_ops[dir], 0, sizeof(bpf_ops[dir]));
+		bpf_parse_rules(filter[dir], &bpf_ops[dir], ctx->link_type);
+		if (ctx->dump_bpf)
+			bpf_dump_all(&bpf_ops[dir]);
+
+		ifindex[dir] = device_ifindex(dev[dir]);
+		size[dir] = max(ring_size((char *) dev[dir], ctx->reserve_size) / nr,
+				(unsigned int) TX_RING_SIZE_MIN);
+		fanout_id[dir] = (getpid() + dir) & 0xffff;
+	}
+
+	/*
+	 * Queue i of direction dir receives from dev[dir] as member of a
+	 * fanout group, so flows stay on one queue, and sends to the other
+	 * device on its own TX ring.
+	 */
+	for (dir = 0; dir < 2; ++dir) {
+		for (i = 0; i < nr; ++i) {
+			q = &queues[dir * nr + i];
+
+			q->dir = dir;
+			q->queue = i;
+			q->cpu = (dir * nr + i) % cpus;
+			q->dev_in = dev[dir];
+			q->dev_out = dev[!dir];
+			q->packet_type = packet_type[dir];
+
+			q->rx_sock = pf_socket();
+			q->tx_sock = pf_socket();
+
+			bpf_attach_to_sock(q->rx_sock, &bpf_ops[dir]);
+			setsockopt(q->rx_sock, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+				   &one, sizeof(one));
+
+			setup_rx_ring_layout(q->rx_sock, &q->rx_ring, size[dir], ctx->jumbo);
+			create_rx_ring(q->rx_sock, &q->rx_ring, ctx->verbose);
+			mmap_rx_ring(q->rx_sock, &q->rx_ring);
+			alloc_rx_ring_frames(&q->rx_ring);
+			bind_rx_ring(q->rx_sock, &q->rx_ring, ifindex[dir]);
+			if (nr > 1)
+				set_sockopt_fanout(q->rx_sock, fanout_id[dir],
+						   PACKET_FANOUT_HASH);
+
+			set_packet_loss_discard(q->tx_sock);
+			set_sockopt_qdisc_bypass(q->tx_sock);
+			setup_tx_ring_layout(q->tx_sock, &q->tx_ring, size[!dir], ctx->jumbo);
+			create_tx_ring(q->tx_sock, &q->tx_ring, ctx->verbose);
+			mmap_tx_ring(q->tx_sock, &q->tx_ring);
+			alloc_tx_ring_frames(&q->tx_ring);
+			bind_tx_ring(q->tx_sock, &q->tx_ring, ifindex[!dir]);
+
+			tx_flush_init(&q->flush, q->tx_sock, &q->tx_ring, ctx->kpull);
+		}
+
+		if (ctx->cpu != -2)
+			bridge_align_irqs(&queues[dir * nr], nr, dev[dir], ctx->verbose);
+
+		if (ctx->promiscuous)
+			ifflags[dir] = enter_promiscuous_mode((char *) dev[dir]);
+	}
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Running bridge %s <-> %s with %u queues per direction! "
+	       "Hang up with ^C!\n\n", dev[0], dev[1], nr);
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	for (i = 0; i < 2 * nr; ++i) {
+		cpu_set_t cpuset;
+
+		q = &queues[i];
+
+		ret = pthread_create(&q->trid, NULL, bridge_queue_loop, q);
+		if (ret)
+			panic("Thread creation failed!\n");
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(q->cpu, &cpuset);
+
+		ret = pthread_setaffinity_np(q->trid, sizeof(cpuset), &cpuset);
+		if (ret)
+			panic("Thread CPU migration failed!\n");
+	}
+
+	for (i = 0; i < 2 * nr; ++i)
+		pthread_join(queues[i].trid, NULL);
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	fflush(stdout);
+	printf("\n");
+
+	for (i = 0; i < 2 * nr; ++i) {
+		q = &queues[i];
+
+		printf("\r  %s -> %s q%-3d CPU%-3d %12lu packets %14lu bytes "
+		       "%8.1lf per kick\n", q->dev_in, q->dev_out, q->queue,
+		       q->cpu, q->packets, q->bytes, q->flush.kicks ?
+		       1.0 * q->flush.frames / q->flush.kicks : 0.0);
+
+		packets += q->packets;
+		bytes += q->bytes;
+
+		destroy_tx_ring(q->tx_sock, &q->tx_ring);
+		destroy_rx_ring(q->rx_sock, &q->rx_ring);
+
+		close(q->tx_sock);
+		close(q->rx_sock);
+	}
+
+	printf("\r%12lu packets forwarded\n", packets);
+	printf("\r%12lu bytes forwarded\n", bytes);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+
+	for (dir = 0; dir < 2; ++dir) {
+		if (ctx->promiscuous)
+			leave_promiscuous_mode((char *) dev[dir], ifflags[dir]);
+		bpf_release(&bpf_ops[dir]);
+	}
+
+	xfree(queues);
+}
+
+static void read_pcap(struct ctx *ctx)
+{
+	__label__ out;
+	uint8_t *out;
+	int ret, fd, fdo = 0;
+	unsigned long trunced = 0;
+	size_t out_len;
+	pcap_pkthdr_t phdr;
+	struct sock_fprog bpf_ops;
+	struct frame_map fm;
+	struct timeval start, end, diff;
+	struct txf txf;
+
+	bug_on(!__pcap_io);
+
+	if (!strncmp("-", ctx->device_in, strlen("-"))) {
+		fd = dup(fileno(stdin));
+		close(fileno(stdin));
+		if (ctx->pcap == PCAP_OPS_MM)
+			ctx->pcap = PCAP_OPS_SG;
+	} else {
+		fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	}
+
+	ret = __pcap_io->pull_fhdr_pcap(fd, &ctx->magic, &ctx->link_type);
+	if (ret)
+		panic("Error reading pcap header!\n");
+
+	ctx->codec = pcap_codec_get(ctx->magic);
+
+	if (__pcap_io->prepare_access_pcap) {
+		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
+		if (ret)
+			panic("Error prepare reading pcap!\n");
+	}
+
+	fmemset(&fm, 0, sizeof(fm));
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+
+	dissector_init_all(ctx->print_mode);
+
+	out_len = round_up(1024 * 1024, PAGE_SIZE);
+	out = xmalloc_aligned(out_len, CO_CACHE_LINE_SIZE);
+
+	if (ctx->device_out) {
+		if (!strncmp("-", ctx->device_out, strlen("-"))) {
+			fdo = dup(fileno(stdout));
+			close(fileno(stdout));
+		} else {
+			fdo = open_or_die_m(ctx->device_out, O_RDWR | O_CREAT |
+					    O_TRUNC | O_LARGEFILE, DEFFILEMODE);
+		}
+
+		txf_init(&txf, fdo, ctx->txf_infer, ctx->link_type);
+	}
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	while (likely(sigint == 0)) {
+		do {
+			ret = __pcap_io->read_pcap(fd, &phdr, ctx->codec,
+						   out, out_len);
+			if (unlikely(ret < 0))
+				goto out;
+
+			if (unlikely(ctx->codec->get_length(&phdr) == 0)) {
+				trunced++;
+				continue;
+			}
+
+			if (unlikely(ctx->codec->get_length(&phdr) > out_len)) {
+				ctx->codec->set_length(&phdr, out_len);
+				trunced++;
+			}
+		} while (ctx->filter &&
+			 !bpf_run_filter(&bpf_ops, out,
+					 ctx->codec->get_length(&phdr)));
+
+		ctx->codec->to_tpacket(&phdr, &fm.tp_h);
+
+		ctx->tx_bytes += fm.tp_h.tp_len;
+		ctx->tx_packets++;
+
+		show_frame_hdr(&fm, ctx->print_mode);
+
+		dissector_entry_point(out, fm.tp_h.tp_snaplen,
+				      ctx->link_type, ctx->print_mode);
+
+		if (ctx->device_out)
+			txf_packet(&txf, out, fm.tp_h.tp_snaplen, fm.tp_h.tp_len);
+
+		if (frame_count_max != 0) {
+			if (ctx->tx_packets >= frame_count_max) {
+				sigint = 1;
+				break;
+			}
+		}
+	}
+
+	out:
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	if (ctx->device_out)
+		txf_destroy(&txf);
+
+	bpf_release(&bpf_ops);
+
+	dissector_cleanup_all();
+
+	if (__pcap_io->prepare_close_pcap)
+		__pcap_io->prepare_close_pcap(fd, PCAP_MODE_RD);
+
+	xfree(out);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+
+	if (strncmp("-", ctx->device_in, strlen("-")))
+		close(fd);
+	else
+		dup2(fd, fileno(stdin));
+
+	if (ctx->device_out) {
+		if (strncmp("-", ctx->device_out, strlen("-")))
+			close(fdo);
+		else
+			dup2(fdo, fileno(stdout));
+	}
+}
+
+/* Per worker record queue in bytes, filled by the pcap reader */
+#define RD_QUEUE_SIZE		(8 * 1024 * 1024)
+
+/* Size first, see struct rec_queue */
+struct rd_record {
+	uint32_t size;
+	struct frame_map fm;
+	uint8_t data[0];
+};
+
+struct rd_worker {
+	pthread_t trid;
+	int cpu;
+	struct ctx *ctx;
+	struct sock_fprog *bpf_ops;
+	unsigned long packets, bytes;
+	struct rec_queue queue;
+} __cacheline_aligned;
+
+static unsigned long rd_matched = 0;
+
+static void rd_worker_process(struct rd_worker *w, struct rd_record *r)
+{
+	struct ctx *ctx = w->ctx;
+
+	if (ctx->filter &&
+	    !bpf_run_filter(w->bpf_ops, r->data, r->fm.tp_h.tp_snaplen))
+		return;
+
+	if (frame_count_max != 0 &&
+	    __sync_add_and_fetch(&rd_matched, 1) > frame_count_max) {
+		sigint = 1;
+		return;
+	}
+
+	w->packets++;
+	w->bytes += r->fm.tp_h.tp_len;
+
+	show_frame_hdr(&r->fm, ctx->print_mode);
+
+	dissector_entry_point(r->data, r->fm.tp_h.tp_snaplen,
+			      ctx->link_type, ctx->print_mode);
+}
+
+static void *rd_worker_loop(void *arg)
+{
+	struct rd_worker *w = arg;
+	struct rd_record *r;
+
+	while (1) {
+		r = rec_queue_peek(&w->queue);
+		if (!r) {
+			if (!rec_queue_wait_more(&w->queue))
+				break;
+			continue;
+		}
+
+		rd_worker_process(w, r);
+		rec_queue_pop(&w->queue, r);
+	}
+
+	pthread_exit(NULL);
+}
+
+static void rd_worker_enqueue(struct rd_worker *w, pcap_pkthdr_t *phdr,
+			      const struct pcap_codec *codec, uint8_t *packet,
+			      size_t len)
+{
+	struct rd_record *r;
+
+	r = rec_queue_reserve(&w->queue, sizeof(*r) + len);
+	/* Workers never quit early, so there is always room eventually. */
+	bug_on(!r);
+
+	codec->to_tpacket(phdr, &r->fm.tp_h);
+	fmemcpy(r->data, packet, len);
+
+	rec_queue_commit(&w->queue, r, sizeof(*r) + len);
+}
+
+/*
+ * One reader thread walks the records and hands each packet to one of
+ * rd_threads workers by flow hash, so packets of a flow are filtered and
+ * dissected in order, while different flows are processed in parallel.
+ */
+static void read_pcap_parallel(struct ctx *ctx)
+{
+	__label__ out;
+	uint8_t *out;
+	int ret, fd, cpus;
+	unsigned int i;
+	unsigned long trunced = 0;
+	size_t out_len, len;
+	pcap_pkthdr_t phdr;
+	struct sock_fprog bpf_ops;
+	struct rd_worker *workers, *w;
+	struct timeval start, end, diff;
 
 	bug_on(!__pcap_io);
 
@@ -532,13 +1733,14 @@ static void read_pcap(struct ctx *ctx)
 	if (ret)
 		panic("Error reading pcap header!\n");
 
+	ctx->codec = pcap_codec_get(ctx->magic);
+
 	if (__pcap_io->prepare_access_pcap) {
 		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_RD, ctx->jumbo);
 		if (ret)
 			panic("Error prepare reading pcap!\n");
 	}
 
-	fmemset(&fm, 0, sizeof(fm));
 	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
 
 	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
@@ -550,66 +1752,70 @@ static void read_pcap(struct ctx *ctx)
 	out_len = round_up(1024 * 1024, PAGE_SIZE);
 	out = xmalloc_aligned(out_len, CO_CACHE_LINE_SIZE);
 
-	if (ctx->device_out) {
-		if (!strncmp("-", ctx->device_out, strlen("-"))) {
-			fdo = dup(fileno(stdout));
-			close(fileno(stdout));
-		} else {
-			fdo = open_or_die_m(ctx->device_out, O_RDWR | O_CREAT |
-					    O_TRUNC | O_LARGEFILE, DEFFILEMODE);
-		}
-	}
-
-	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
-
-	printf("Running! Hang up with ^C!\n\n");
-	fflush(stdout);
+	cpus = get_number_cpus_online();
+	workers = xzmalloc_aligned(ctx->rd_threads * sizeof(*workers),
+				   CO_CACHE_LINE_SIZE);
 
-	bug_on(gettimeofday(&start, NULL));
+	for (i = 0; i < ctx->rd_threads; ++i) {
+		cpu_set_t cpuset;
 
-	while (likely(sigint == 0)) {
-		do {
-			ret = __pcap_io->read_pcap(fd, &phdr, ctx->magic,
-						   out, out_len);
-			if (unlikely(ret < 0))
-				goto out;
+		w = &workers[i];
+		w->ctx = ctx;
+		w->bpf_ops = &bpf_ops;
+		/* Leave the first CPU to the reader where we can. */
+		w->cpu = (i + 1) % cpus;
+		rec_queue_init(&w->queue, RD_QUEUE_SIZE,
+			       sizeof(struct rd_record) + out_len);
 
-			if (unlikely(pcap_get_length(&phdr, ctx->magic) == 0)) {
-				trunced++;
-				continue;
-			}
+		ret = pthread_create(&w->trid, NULL, rd_worker_loop, w);
+		if (ret)
+			panic("Thread creation failed!\n");
 
-			if (unlikely(pcap_get_length(&phdr, ctx->magic) > out_len)) {
-				pcap_set_length(&phdr, ctx->magic, out_len);
-				trunced++;
-			}
-		} while (ctx->filter &&
-			 !bpf_run_filter(&bpf_ops, out,
-					 pcap_get_length(&phdr, ctx->magic)));
+		CPU_ZERO(&cpuset);
+		CPU_SET(w->cpu, &cpuset);
 
-		pcap_pkthdr_to_tpacket_hdr(&phdr, ctx->magic, &fm.tp_h, &sll);
+		ret = pthread_setaffinity_np(w->trid, sizeof(cpuset), &cpuset);
+		if (ret)
+			panic("Thread CPU migration failed!\n");
+	}
 
-		ctx->tx_bytes += fm.tp_h.tp_len;
-		ctx->tx_packets++;
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
-		show_frame_hdr(&fm, ctx->print_mode);
+	printf("Running with %u reader threads! Hang up with ^C!\n\n",
+	       ctx->rd_threads);
+	fflush(stdout);
 
-		dissector_entry_point(out, fm.tp_h.tp_snaplen,
-				      ctx->link_type, ctx->print_mode);
+	bug_on(gettimeofday(&start, NULL));
 
-		if (ctx->device_out)
-			translate_pcap_to_txf(fdo, out, fm.tp_h.tp_snaplen);
+	while (likely(sigint == 0)) {
+		ret = __pcap_io->read_pcap(fd, &phdr, ctx->codec, out, out_len);
+		if (unlikely(ret < 0))
+			goto out;
+
+		len = ctx->codec->get_length(&phdr);
+		if (unlikely(len == 0)) {
+			trunced++;
+			continue;
+		}
 
-		if (frame_count_max != 0) {
-			if (ctx->tx_packets >= frame_count_max) {
-				sigint = 1;
-				break;
-			}
+		if (unlikely(len > out_len)) {
+			ctx->codec->set_length(&phdr, out_len);
+			len = out_len;
+			trunced++;
 		}
+
+		w = &workers[flow_worker(out, len, ctx->link_type,
+					 ctx->rd_threads)];
+		rd_worker_enqueue(w, &phdr, ctx->codec, out, len);
 	}
 
 	out:
 
+	for (i = 0; i < ctx->rd_threads; ++i) {
+		rec_queue_close(&workers[i].queue);
+		pthread_join(workers[i].trid, NULL);
+	}
+
 	bug_on(gettimeofday(&end, NULL));
 	timersub(&end, &start, &diff);
 
@@ -624,6 +1830,19 @@ static void read_pcap(struct ctx *ctx)
 
 	fflush(stdout);
 	printf("\n");
+
+	for (i = 0; i < ctx->rd_threads; ++i) {
+		w = &workers[i];
+
+		printf("\r  RD%-3u CPU%-3d %12lu packets %14lu bytes\n",
+		       i, w->cpu, w->packets, w->bytes);
+
+		ctx->tx_packets += w->packets;
+		ctx->tx_bytes += w->bytes;
+
+		rec_queue_destroy(&w->queue);
+	}
+
 	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
 	printf("\r%12lu packets truncated in file\n", trunced);
 	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
@@ -634,12 +1853,7 @@ static void read_pcap(struct ctx *ctx)
 	else
 		dup2(fd, fileno(stdin));
 
-	if (ctx->device_out) {
-		if (strncmp("-", ctx->device_out, strlen("-")))
-			close(fdo);
-		else
-			dup2(fdo, fileno(stdout));
-	}
+	xfree(workers);
 }
 
 static void finish_multi_pcap_file(struct ctx *ctx, int fd)
@@ -677,6 +1891,8 @@ static int next_multi_pcap_file(struct ctx *ctx, int fd)
 	if (ret)
 		panic("Error writing pcap header!\n");
 
+	ctx->codec = pcap_codec_get(ctx->magic);
+
 	if (__pcap_io->prepare_access_pcap) {
 		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_WR, ctx->jumbo);
 		if (ret)
@@ -706,6 +1922,8 @@ static int begin_multi_pcap_file(struct ctx *ctx)
 	if (ret)
 		panic("Error writing pcap header!\n");
 
+	ctx->codec = pcap_codec_get(ctx->magic);
+
 	if (__pcap_io->prepare_access_pcap) {
 		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_WR, ctx->jumbo);
 		if (ret)
@@ -758,6 +1976,8 @@ static int begin_single_pcap_file(struct ctx *ctx)
 	if (ret)
 		panic("Error writing pcap header!\n");
 
+	ctx->codec = pcap_codec_get(ctx->magic);
+
 	if (__pcap_io->prepare_access_pcap) {
 		ret = __pcap_io->prepare_access_pcap(fd, PCAP_MODE_WR, ctx->jumbo);
 		if (ret)
@@ -767,6 +1987,210 @@ static int begin_single_pcap_file(struct ctx *ctx)
 	return fd;
 }
 
+static void merge_pcap(struct ctx *ctx)
+{
+	int fd, ret;
+	struct pcap_merge m;
+	struct pcap_merge_in *in;
+	struct sock_fprog bpf_ops;
+	struct timeval start, end, diff;
+	pcap_pkthdr_t phdr;
+
+	bug_on(!__pcap_io);
+
+	pcap_merge_init(&m, ctx->device_in);
+
+	/* Unless told otherwise, keep nanoseconds if any input has them. */
+	if (ctx->magic == 0)
+		ctx->magic = m.nsec ? NSEC_TCPDUMP_MAGIC : ORIGINAL_TCPDUMP_MAGIC;
+	ctx->link_type = m.link_type;
+
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+
+	fd = begin_single_pcap_file(ctx);
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Merging %u pcap files! Hang up with ^C!\n\n", m.nr);
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	while (likely(sigint == 0) && (in = pcap_merge_next(&m))) {
+		if (ctx->filter &&
+		    !bpf_run_filter(&bpf_ops, in->packet, in->tp_h.tp_snaplen))
+			continue;
+
+		ctx->codec->from_tpacket(&in->tp_h, &in->sll, &phdr);
+
+		ret = __pcap_io->write_pcap(fd, &phdr, ctx->codec, in->packet,
+					    in->tp_h.tp_snaplen);
+		if (unlikely(ret != pcap_get_total_length(&phdr, ctx->codec)))
+			panic("Write error to pcap!\n");
+
+		ctx->tx_packets++;
+		ctx->tx_bytes += in->tp_h.tp_len;
+
+		if (frame_count_max != 0) {
+			if (ctx->tx_packets >= frame_count_max) {
+				sigint = 1;
+				break;
+			}
+		}
+	}
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	finish_single_pcap_file(ctx, fd);
+
+	bpf_release(&bpf_ops);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12u files merged\n", m.nr);
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+
+	pcap_merge_destroy(&m);
+}
+
+static void slice_pcap(struct ctx *ctx)
+{
+	int fd, fdo;
+	bool match;
+	uint8_t *map;
+	size_t hdrlen, caplen;
+	off_t off, run_start, run_end;
+	unsigned long rec = 0, trunced = 0;
+	struct stat sb;
+	struct pcap_filehdr fhdr;
+	struct pcap_slice s;
+	struct sock_fprog bpf_ops;
+	struct timeval start, end, diff;
+	struct tpacket2_hdr tp_h;
+	pcap_pkthdr_t phdr;
+
+	pcap_slice_parse(&s, ctx->slice);
+
+	fd = open_or_die(ctx->device_in, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	if (fstat(fd, &sb) < 0)
+		panic("Cannot stat %s: %s!\n", ctx->device_in, strerror(errno));
+	if (sb.st_size < sizeof(fhdr))
+		panic("Error reading pcap header!\n");
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		panic("Cannot mmap %s: %s!\n", ctx->device_in, strerror(errno));
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	fmemcpy(&fhdr, map, sizeof(fhdr));
+	pcap_validate_header(&fhdr);
+
+	ctx->magic = fhdr.magic;
+	ctx->codec = pcap_codec_get(fhdr.magic);
+	ctx->link_type = fhdr.linktype;
+
+	fmemset(&bpf_ops, 0, sizeof(bpf_ops));
+
+	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	if (ctx->dump_bpf)
+		bpf_dump_all(&bpf_ops);
+
+	if (!strncmp("-", ctx->device_out, strlen("-"))) {
+		fdo = dup(fileno(stdout));
+		close(fileno(stdout));
+	} else {
+		fdo = open_or_die_m(ctx->device_out, O_WRONLY | O_CREAT |
+				    O_TRUNC | O_LARGEFILE, DEFFILEMODE);
+	}
+
+	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+
+	printf("Running! Hang up with ^C!\n\n");
+	fflush(stdout);
+
+	bug_on(gettimeofday(&start, NULL));
+
+	/* The file header is copied as is, as the start of the first run. */
+	run_start = 0;
+	run_end = off = sizeof(fhdr);
+
+	while (likely(sigint == 0)) {
+		hdrlen = ctx->codec->hdr_len;
+		if (off + hdrlen > sb.st_size)
+			break;
+
+		fmemcpy(&phdr, map + off, hdrlen);
+
+		caplen = ctx->codec->get_length(&phdr);
+		if (unlikely(off + hdrlen + caplen > sb.st_size)) {
+			trunced++;
+			break;
+		}
+
+		if (++rec > s.rec_to)
+			break;
+
+		ctx->codec->to_tpacket(&phdr, &tp_h);
+
+		match = pcap_slice_match(&s, rec, tp_h.tp_sec * NSEC_PER_SEC +
+					 tp_h.tp_nsec) &&
+			(!ctx->filter ||
+			 bpf_run_filter(&bpf_ops, map + off + hdrlen, caplen));
+
+		if (match) {
+			if (run_end != off) {
+				pcap_slice_append(&s, fd, fdo, map, run_start,
+						  run_end - run_start);
+				run_start = off;
+			}
+
+			run_end = off + hdrlen + caplen;
+
+			ctx->tx_packets++;
+			ctx->tx_bytes += tp_h.tp_len;
+		}
+
+		off += hdrlen + caplen;
+
+		if (frame_count_max != 0) {
+			if (ctx->tx_packets >= frame_count_max)
+				break;
+		}
+	}
+
+	pcap_slice_append(&s, fd, fdo, map, run_start, run_end - run_start);
+
+	bug_on(gettimeofday(&end, NULL));
+	timersub(&end, &start, &diff);
+
+	bpf_release(&bpf_ops);
+
+	munmap(map, sb.st_size);
+	close(fd);
+
+	fflush(stdout);
+	printf("\n");
+	printf("\r%12lu packets outgoing\n", ctx->tx_packets);
+	printf("\r%12lu packets truncated in file\n", trunced);
+	printf("\r%12lu bytes outgoing\n", ctx->tx_bytes);
+	printf("\r%12lu runs, %llu bytes copied in-kernel, %llu written\n",
+	       s.runs, (unsigned long long) s.copied,
+	       (unsigned long long) s.written);
+	printf("\r%12lu sec, %lu usec in total\n", diff.tv_sec, diff.tv_usec);
+
+	if (strncmp("-", ctx->device_out, strlen("-")))
+		close(fdo);
+	else
+		dup2(fdo, fileno(stdout));
+}
+
 static void print_pcap_file_stats(int sock, struct ctx *ctx, unsigned long skipped)
 {
 	unsigned long good, bad;
@@ -796,7 +2220,8 @@ static void recv_only_or_dump(struct ctx *ctx)
 	struct pollfd rx_poll;
 	struct frame_map *hdr;
 	struct sock_fprog bpf_ops;
-	struct timeval start, end, diff;
+	struct timeval start, end, diff, reset;
+	struct hh_sketch hh;
 	pcap_pkthdr_t phdr;
 
 	if (!device_up_and_running(ctx->device_in) && !ctx->rfraw)
@@ -823,6 +2248,7 @@ static void recv_only_or_dump(struct ctx *ctx)
 	enable_kernel_bpf_jit_compiler();
 
 	bpf_parse_rules(ctx->filter, &bpf_ops, ctx->link_type);
+	bpf_prepend_sampling(&bpf_ops, ctx->sample);
 	if (ctx->dump_bpf)
 		bpf_dump_all(&bpf_ops);
 	bpf_attach_to_sock(sock, &bpf_ops);
@@ -872,10 +2298,19 @@ static void recv_only_or_dump(struct ctx *ctx)
 		}
 	}
 
+	if (ctx->top_k) {
+		hh_sketch_init(&hh, ctx->top_key, ctx->top_k);
+
+		interval = ctx->dump_interval;
+		set_itimer_interval_value(&itimer, interval, 0);
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	}
+
 	printf("Running! Hang up with ^C!\n\n");
 	fflush(stdout);
 
 	bug_on(gettimeofday(&start, NULL));
+	reset = start;
 
 	while (likely(sigint == 0)) {
 		while (user_may_pull_from_rx(rx_ring.frames[it].iov_base)) {
@@ -895,19 +2330,26 @@ static void recv_only_or_dump(struct ctx *ctx)
 			}
 
 			if (dump_to_pcap(ctx)) {
-				tpacket_hdr_to_pcap_pkthdr(&hdr->tp_h, &hdr->s_ll, &phdr, ctx->magic);
+				ctx->codec->from_tpacket(&hdr->tp_h, &hdr->s_ll, &phdr);
 
-				ret = __pcap_io->write_pcap(fd, &phdr, ctx->magic, packet,
-							    pcap_get_length(&phdr, ctx->magic));
-				if (unlikely(ret != pcap_get_total_length(&phdr, ctx->magic)))
+				ret = __pcap_io->write_pcap(fd, &phdr, ctx->codec, packet,
+							    ctx->codec->get_length(&phdr));
+				if (unlikely(ret != pcap_get_total_length(&phdr, ctx->codec)))
 					panic("Write error to pcap!\n");
 			}
 
+			if (ctx->sample > 1 && ctx->print_mode != PRINT_NONE)
+				tprintf("~1:%lu ", ctx->sample);
+
 			show_frame_hdr(hdr, ctx->print_mode);
 
 			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
 					      ctx->link_type, ctx->print_mode);
 
+			if (ctx->top_k)
+				hh_sketch_update(&hh, packet, hdr->tp_h.tp_snaplen,
+						 hdr->tp_h.tp_len);
+
 			if (frame_count_max != 0) {
 				if (frame_count >= frame_count_max) {
 					sigint = 1;
@@ -944,6 +2386,16 @@ static void recv_only_or_dump(struct ctx *ctx)
 						print_pcap_file_stats(sock, ctx, skipped);
 				}
 			}
+
+			if (ctx->top_k && next_dump)
+				break;
+		}
+
+		if (ctx->top_k && next_dump) {
+			hh_sketch_dump(&hh, ctx->dump_interval);
+			hh_sketch_reset(&hh);
+			bug_on(gettimeofday(&reset, NULL));
+			next_dump = false;
 		}
 
 		poll(&rx_poll, 1, -1);
@@ -952,8 +2404,20 @@ static void recv_only_or_dump(struct ctx *ctx)
 	bug_on(gettimeofday(&end, NULL));
 	timersub(&end, &start, &diff);
 
+	if (ctx->top_k) {
+		fmemset(&itimer, 0, sizeof(itimer));
+		setitimer(ITIMER_REAL, &itimer, NULL);
+
+		/* Only what came in since the last reset is in the sketch */
+		timersub(&end, &reset, &diff);
+		hh_sketch_dump(&hh, diff.tv_sec);
+		hh_sketch_destroy(&hh);
+
+		timersub(&end, &start, &diff);
+	}
+
 	if (!(ctx->dump_dir && ctx->print_mode == PRINT_NONE)) {
-		sock_print_net_stats(sock, skipped);
+		sock_print_net_stats(sock, skipped, ctx->sample);
 
 		printf("\r%12lu  sec, %lu usec in total\n",
 		       diff.tv_sec, diff.tv_usec);
@@ -996,18 +2460,43 @@ static void help(void)
 	     "  -J|--jumbo-support             Support for 64KB Super Jumbo Frames (def: 2048B)\n"
 	     "  -R|--rfraw                     Capture or inject raw 802.11 frames\n"
 	     "  -n|--num <0|uint>              Number of packets until exit (def: 0)\n"
+	     "  -a|--sample <uint>             In-kernel 1-in-N packet sampling (netdev only)\n"
+	     "  -K|--top <key>[:<k>]           Print top-k talkers every -F interval (def: 10, 1s),\n"
+	     "                                 key: src|dst|flow|net24 (netdev only)\n"
 	     "  -P|--prefix <name>             Prefix for pcaps stored in directory\n"
 	     "  -T|--magic <pcap-magic>        Pcap magic number/pcap format to store, see -D\n"
 	     "  -D|--dump-pcap-types           Dump pcap types and magic numbers and quit\n"
 	     "  -B|--dump-bpf                  Dump generated BPF assembly\n"
+	     "  -E|--extract <all|time:<from>-<to>|count:<from>-<to>>[,...]\n"
+	     "                                 Copy matching records of a pcap (also -f) into\n"
+	     "                                 a new pcap, ranges are inclusive, time in unix secs\n"
+	     "  -O|--merge                     Merge pcaps of --in <file|dir>[,...] by time into\n"
+	     "                                 one pcap, dirs stand for all *.pcap files in them\n"
+	     "  -I|--infer                     Emit one trafgen template per flow with dinc(),\n"
+	     "                                 drnd() and checksum elements (pcap->cfg)\n"
 	     "  -r|--rand                      Randomize packet forwarding order (dev->dev)\n"
+	     "  -z|--shared-ring               Forward with RX and TX ring on one socket (dev->dev)\n"
+	     "  -x|--bridge <num>              Bridge in both directions with num threads each\n"
+	     "  -y|--filter-rev <bpf-file|expr>\n"
+	     "                                 Filter for the out->in direction of --bridge\n"
+	     "  -p|--type-rev <type>           Packet type for the out->in direction of --bridge\n"
+	     "  -w|--rewrite <rule-file>       Rewrite frames in place before TX (pcap/dev->dev),\n"
+	     "                                 rules: set|inc <field> <value> [if <bpf>]\n"
+	     "  -Y|--replay-timing <speed|max> Replay pcap with original gaps scaled by speed\n"
+	     "  -W|--tx-threads <num>[:flow]   Replay pcap from num threads (dev out), round\n"
+	     "                                 robin or per flow to keep flow order\n"
+	     "  -j|--read-threads <num>        Filter and dissect pcap in num threads, packets\n"
+	     "                                 of a flow stay in order (pcap, no output)\n"
+	     "  -L|--loop <num>[:ip|:port]     Preload pcap and replay it num times (0 for\n"
+	     "                                 ever), optionally add loop nr to src ip/port\n"
 	     "  -M|--no-promisc                No promiscuous mode for netdev\n"
 	     "  -A|--no-sock-mem               Don't tune core socket memory\n"
 	     "  -m|--mmap                      Mmap(2) pcap file i.e., for replaying pcaps\n"
 	     "  -G|--sg                        Scatter/gather pcap file I/O\n"
+	     "  -Z|--read-ahead                Read pcap ahead in a background thread\n"
 	     "  -c|--clrw                      Use slower read(2)/write(2) I/O\n"
 	     "  -S|--ring-size <size>          Specify ring size to: <num>KiB/MiB/GiB\n"
-	     "  -k|--kernel-pull <uint>        Kernel pull from user interval in us (def: 10us)\n"
+	     "  -k|--kernel-pull <uint>        Kernel pull at the latest after us (def: 10us/64 frames)\n"
 	     "  -b|--bind-cpu <cpu>            Bind to specific CPU\n"
 	     "  -u|--user <userid>             Drop privileges and change to userid\n"
 	     "  -g|--group <groupid>           Drop privileges and change to groupid\n"
@@ -1025,11 +2514,21 @@ static void help(void)
 	     "  netsniff-ng --in eth0 --out dump.pcap -s -T 0xa1b2c3d4 --b 0 tcp or udp\n"
 	     "  netsniff-ng --in wlan0 --rfraw --out dump.pcap --silent --bind-cpu 0\n"
 	     "  netsniff-ng --in dump.pcap --mmap --out eth0 -k1000 --silent --bind-cpu 0\n"
+	     "  netsniff-ng --in dump.pcap --out eth0 --replay-timing 10x --silent\n"
+	     "  netsniff-ng --in dump.pcap --out eth0 --tx-threads 4:flow --silent\n"
+	     "  netsniff-ng --in dump.pcap --out eth0 --loop 0:port --silent\n"
+	     "  netsniff-ng --in eth0 --out eth1 --bridge 4 --filter-rev arp.bpf\n"
 	     "  netsniff-ng --in dump.pcap --out dump.cfg --silent --bind-cpu 0\n"
+	     "  netsniff-ng --in dump.pcap --out dump.cfg --silent --infer\n"
+	     "  netsniff-ng --in /opt/probe/,extra.pcap --out all.pcap --merge -s\n"
+	     "  netsniff-ng --in dump.pcap --out web.pcap --extract count:1-1000000 tcp port 80\n"
+	     "  netsniff-ng --in dump.pcap --read-threads 4 --filter http.bpf --ascii\n"
 	     "  netsniff-ng --in eth0 --out eth1 --silent --bind-cpu 0 --type host\n"
 	     "  netsniff-ng --in eth1 --out /opt/probe/ -s -m -J --interval 100MiB -b 0\n"
 	     "  netsniff-ng --in vlan0 --out dump.pcap -c -u `id -u bob` -g `id -g bob`\n"
-	     "  netsniff-ng --in any --filter http.bpf --jumbo-support --ascii -V\n\n"
+	     "  netsniff-ng --in any --filter http.bpf --jumbo-support --ascii -V\n"
+	     "  netsniff-ng --in eth0 --out dump.pcap --sample 1000 -s tcp\n"
+	     "  netsniff-ng --in eth0 --top flow:20 --interval 5s\n\n"
 	     "Note:\n"
 	     "  For introducing bit errors, delays with random variation and more\n"
 	     "  while replaying pcaps, make use of tc(8) with its disciplines (e.g. netem).\n\n"
@@ -1044,6 +2543,22 @@ static void help(void)
 	die();
 }
 
+static int parse_packet_type(const char *type)
+{
+	if (!strncmp(type, "host", strlen("host")))
+		return PACKET_HOST;
+	else if (!strncmp(type, "broadcast", strlen("broadcast")))
+		return PACKET_BROADCAST;
+	else if (!strncmp(type, "multicast", strlen("multicast")))
+		return PACKET_MULTICAST;
+	else if (!strncmp(type, "others", strlen("others")))
+		return PACKET_OTHERHOST;
+	else if (!strncmp(type, "outgoing", strlen("outgoing")))
+		return PACKET_OUTGOING;
+	else
+		return -1;
+}
+
 static void version(void)
 {
 	printf("\nnetsniff-ng %s, the packet sniffing beast\n", VERSION_STRING);
@@ -1062,14 +2577,15 @@ static void version(void)
 int main(int argc, char **argv)
 {
 	char *ptr;
-	int c, i, j, cpu_tmp, opt_index, ops_touched = 0, vals[4] = {0};
-	bool prio_high = false, setsockmem = true;
+	int c, i, j, cpu_tmp, opt_index, ops_touched = 0, magic_touched = 0, vals[4] = {0};
+	bool prio_high = false, setsockmem = true, interval_set = false;
 	void (*main_loop)(struct ctx *ctx) = NULL;
 	struct ctx ctx = {
 		.link_type = LINKTYPE_EN10MB,
 		.print_mode = PRINT_NORM,
 		.cpu = -1,
 		.packet_type = -1,
+		.packet_type_rev = -1,
 		.promiscuous = true,
 		.randomize = false,
 		.pcap = PCAP_OPS_SG,
@@ -1102,12 +2618,41 @@ int main(int argc, char **argv)
 		case 'r':
 			ctx.randomize = true;
 			break;
+		case 'z':
+			ctx.shared_ring = true;
+			break;
+		case 'x':
+			ctx.bridge_queues = strtoul(optarg, NULL, 0);
+			if (ctx.bridge_queues == 0 ||
+			    ctx.bridge_queues > BRIDGE_QUEUES_MAX)
+				panic("Bridge queues must be within 1 and %u!\n",
+				      BRIDGE_QUEUES_MAX);
+			break;
+		case 'y':
+			ctx.filter_rev = xstrdup(optarg);
+			break;
+		case 'w':
+			ctx.rewrite = xstrdup(optarg);
+			break;
+		case 'I':
+			ctx.txf_infer = true;
+			break;
+		case 'O':
+			ctx.merge = true;
+			break;
+		case 'E':
+			ctx.slice = xstrdup(optarg);
+			break;
+		case 'p':
+			ctx.packet_type_rev = parse_packet_type(optarg);
+			break;
 		case 'J':
 			ctx.jumbo = true;
 			break;
 		case 'T':
 			ctx.magic = (uint32_t) strtoul(optarg, NULL, 0);
 			pcap_check_magic(ctx.magic);
+			magic_touched = 1;
 			break;
 		case 'f':
 			ctx.filter = xstrdup(optarg);
@@ -1127,18 +2672,7 @@ int main(int argc, char **argv)
 			ctx.enforce = true;
 			break;
 		case 't':
-			if (!strncmp(optarg, "host", strlen("host")))
-				ctx.packet_type = PACKET_HOST;
-			else if (!strncmp(optarg, "broadcast", strlen("broadcast")))
-				ctx.packet_type = PACKET_BROADCAST;
-			else if (!strncmp(optarg, "multicast", strlen("multicast")))
-				ctx.packet_type = PACKET_MULTICAST;
-			else if (!strncmp(optarg, "others", strlen("others")))
-				ctx.packet_type = PACKET_OTHERHOST;
-			else if (!strncmp(optarg, "outgoing", strlen("outgoing")))
-				ctx.packet_type = PACKET_OUTGOING;
-			else
-				ctx.packet_type = -1;
+			ctx.packet_type = parse_packet_type(optarg);
 			break;
 		case 'S':
 			ptr = optarg;
@@ -1184,6 +2718,10 @@ int main(int argc, char **argv)
 			ctx.pcap = PCAP_OPS_SG;
 			ops_touched = 1;
 			break;
+		case 'Z':
+			ctx.pcap = PCAP_OPS_RA;
+			ops_touched = 1;
+			break;
 		case 'Q':
 			ctx.cpu = -2;
 			break;
@@ -1209,6 +2747,71 @@ int main(int argc, char **argv)
 		case 'n':
 			frame_count_max = strtol(optarg, NULL, 0);
 			break;
+		case 'a':
+			ctx.sample = strtoul(optarg, NULL, 0);
+			/* Goes into the sampler as a 32 bit BPF constant */
+			if (ctx.sample == 0 || ctx.sample > UINT32_MAX)
+				panic("Sampling rate must be within 1 and %u!\n",
+				      UINT32_MAX);
+			break;
+		case 'L': {
+			char *incr = strchr(optarg, ':');
+
+			ctx.loop = true;
+			ctx.loops = strtoul(optarg, NULL, 0);
+
+			ctx.loop_incr = ARENA_INCR_NONE;
+			if (incr) {
+				if (!strncmp(incr + 1, "ip", strlen("ip")))
+					ctx.loop_incr = ARENA_INCR_IP;
+				else if (!strncmp(incr + 1, "port", strlen("port")))
+					ctx.loop_incr = ARENA_INCR_PORT;
+				else
+					panic("Unknown loop increment %s!\n", incr + 1);
+			}
+			break; }
+		case 'W': {
+			char *split = strchr(optarg, ':');
+
+			ctx.tx_threads = strtoul(optarg, NULL, 0);
+			if (ctx.tx_threads == 0)
+				panic("Number of TX threads must be > 0!\n");
+
+			ctx.tx_split = TX_SPLIT_RR;
+			if (split) {
+				if (!strncmp(split + 1, "flow", strlen("flow")))
+					ctx.tx_split = TX_SPLIT_FLOW;
+				else if (strncmp(split + 1, "rr", strlen("rr")))
+					panic("Unknown TX split %s!\n", split + 1);
+			}
+			break; }
+		case 'j':
+			ctx.rd_threads = strtoul(optarg, NULL, 0);
+			if (ctx.rd_threads == 0)
+				panic("Number of reader threads must be > 0!\n");
+			break;
+		case 'Y':
+			if (!strcmp(optarg, "max")) {
+				ctx.replay_timing = false;
+				break;
+			}
+
+			ctx.replay_speed = strtod(optarg, &ptr);
+			if (ptr == optarg || *ptr || !(ctx.replay_speed > 0))
+				panic("Replay speed must be > 0 or max!\n");
+			ctx.replay_timing = true;
+			break;
+		case 'K':
+			if (hh_parse_key_type(optarg, &ctx.top_key))
+				panic("Unknown top talker key %s!\n", optarg);
+
+			ptr = strchr(optarg, ':');
+			ctx.top_k = ptr ? strtoul(ptr + 1, NULL, 0) :
+					  HH_TOPK_DEFAULT;
+			if (ctx.top_k == 0 || ctx.top_k > HH_TOPK_MAX)
+				panic("Top-k must be within 1 and %u!\n",
+				      HH_TOPK_MAX);
+			break;
 		case 'F':
 			ptr = optarg;
 			ctx.dump_interval = 0;
@@ -1246,6 +2849,7 @@ int main(int argc, char **argv)
 
 			*ptr = 0;
 			ctx.dump_interval *= strtol(optarg, NULL, 0);
+			interval_set = true;
 			break;
 		case 'V':
 			ctx.verbose = 1;
@@ -1283,6 +2887,17 @@ int main(int argc, char **argv)
 			case 'T':
 			case 'u':
 			case 'g':
+			case 'a':
+			case 'K':
+			case 'Y':
+			case 'W':
+			case 'j':
+			case 'E':
+			case 'L':
+			case 'x':
+			case 'y':
+			case 'p':
+			case 'w':
 			case 'e':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
@@ -1332,7 +2947,6 @@ int main(int argc, char **argv)
 			ctx.dump = 0;
 			main_loop = recv_only_or_dump;
 		} else if (device_mtu(ctx.device_out)) {
-			register_signal_f(SIGALRM, timer_elapsed, SA_SIGINFO);
 			main_loop = receive_to_xmit;
 		} else {
 			ctx.dump = 1;
@@ -1343,7 +2957,6 @@ int main(int argc, char **argv)
 		}
 	} else {
 		if (ctx.device_out && device_mtu(ctx.device_out)) {
-			register_signal_f(SIGALRM, timer_elapsed, SA_SIGINFO);
 			main_loop = pcap_to_xmit;
 			if (!ops_touched)
 				ctx.pcap = PCAP_OPS_MM;
@@ -1356,6 +2969,98 @@ int main(int argc, char **argv)
 
 	bug_on(!main_loop);
 
+	if (ctx.sample > 1 && main_loop != recv_only_or_dump)
+		panic("Sampling is only supported when capturing from a netdev!\n");
+
+	if (ctx.bridge_queues) {
+		if (main_loop != receive_to_xmit || ctx.shared_ring ||
+		    ctx.randomize)
+			panic("Bridge mode needs two netdevs and no --shared-ring or --rand!\n");
+
+		ctx.print_mode = PRINT_NONE;
+		main_loop = bridge_xmit;
+	} else if (ctx.filter_rev || ctx.packet_type_rev != -1) {
+		panic("--filter-rev and --type-rev need --bridge!\n");
+	}
+
+	if (ctx.rewrite && main_loop != pcap_to_xmit &&
+	    main_loop != receive_to_xmit)
+		panic("Rewrite rules are only supported for pcap/netdev to netdev!\n");
+
+	if (ctx.txf_infer && (main_loop != read_pcap || !ctx.device_out))
+		panic("Template inference is only supported for pcap to trafgen config!\n");
+
+	if (ctx.shared_ring && main_loop != receive_to_xmit)
+		panic("Shared RX/TX ring is only supported for netdev to netdev!\n");
+
+	if (ctx.replay_timing && main_loop != pcap_to_xmit)
+		panic("Replay timing is only supported for pcap to netdev!\n");
+
+	if (ctx.loop) {
+		if (main_loop != pcap_to_xmit || ctx.rfraw)
+			panic("Looped replay is only supported for pcap to netdev!\n");
+		if (ctx.replay_timing || ctx.tx_threads > 1)
+			panic("Looped replay cannot be combined with replay timing "
+			      "or TX threads!\n");
+
+		main_loop = pcap_loop_to_xmit;
+	}
+
+	if (ctx.tx_threads > 1) {
+		if (main_loop != pcap_to_xmit || ctx.rfraw)
+			panic("TX threads are only supported for pcap to netdev!\n");
+		if (ctx.replay_timing)
+			panic("TX threads cannot be combined with replay timing!\n");
+
+		main_loop = pcap_to_xmit_parallel;
+	}
+
+	if (ctx.slice) {
+		if (main_loop != read_pcap || !ctx.device_out ||
+		    !strncmp("-", ctx.device_in, strlen("-")))
+			panic("Extraction needs a pcap file as input and a pcap output!\n");
+		if (ctx.merge || ctx.txf_infer || ctx.rd_threads > 1)
+			panic("Extraction cannot be combined with --merge, --infer "
+			      "or --read-threads!\n");
+
+		main_loop = slice_pcap;
+	}
+
+	if (ctx.merge) {
+		if (main_loop != read_pcap || !ctx.device_out ||
+		    !strncmp("-", ctx.device_in, strlen("-")))
+			panic("Merging needs pcap files or directories and a pcap output!\n");
+		if (ctx.txf_infer || ctx.rd_threads > 1)
+			panic("Merging cannot be combined with --infer or --read-threads!\n");
+
+		/* Picked from the inputs in merge_pcap() */
+		if (!magic_touched)
+			ctx.magic = 0;
+		main_loop = merge_pcap;
+	}
+
+	if (ctx.rd_threads > 1) {
+		if (main_loop != read_pcap || ctx.device_out)
+			panic("Reader threads are only supported for pcap without output!\n");
+
+		main_loop = read_pcap_parallel;
+	}
+
+	if (ctx.pcap == PCAP_OPS_RA && (ctx.dump || main_loop == merge_pcap))
+		panic("Read-ahead I/O only works for reading pcaps!\n");
+
+	if (ctx.top_k) {
+		if (main_loop != recv_only_or_dump || ctx.dump)
+			panic("Top talkers need a netdev input and no output!\n");
+		if (ctx.dump_mode != DUMP_INTERVAL_TIME)
+			panic("Top talkers need a time interval!\n");
+		if (!interval_set)
+			ctx.dump_interval = 1;
+
+		ctx.print_mode = PRINT_NONE;
+		register_signal_f(SIGALRM, timer_next_dump, SA_SIGINFO);
+	}
+
 	init_geoip(0);
 	if (setsockmem)
 		set_system_socket_memory(vals, array_size(vals));
@@ -1374,6 +3079,9 @@ int main(int argc, char **argv)
 	free(ctx.device_out);
 	free(ctx.device_trans);
 	free(ctx.prefix);
+	free(ctx.filter_rev);
+	free(ctx.rewrite);
+	free(ctx.slice);
 
 	return 0;
 }
@@ -0,0 +1,131 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "pcap_arena.h"
+#include "pcap_io.h"
+#include "pkt_off.h"
+#include "xmalloc.h"
+#include "built_in.h"
+#include "die.h"
+
+#define ARENA_HUGEPAGE_SIZE	(2UL << 20)
+
+#ifndef MADV_HUGEPAGE
+# define MADV_HUGEPAGE		14
+#endif
+
+void pcap_arena_init(struct pcap_arena *a, size_t size, uint32_t link_type)
+{
+	fmemset(a, 0, sizeof(*a));
+
+	a->link_type = link_type;
+	a->mem_len = (size + ARENA_HUGEPAGE_SIZE - 1) & ~(ARENA_HUGEPAGE_SIZE - 1);
+
+	a->mem = mmap(NULL, a->mem_len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (a->mem != MAP_FAILED) {
+		a->huge = true;
+		return;
+	}
+
+	/* No reserved hugepages, transparent ones are the next best thing. */
+	a->mem = mmap(NULL, a->mem_len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (a->mem == MAP_FAILED)
+		panic("Cannot allocate %zu bytes for the pcap arena!\n",
+		      a->mem_len);
+
+	madvise(a->mem, a->mem_len, MADV_HUGEPAGE);
+}
+
+uint8_t *pcap_arena_reserve(struct pcap_arena *a, size_t len)
+{
+	if (a->used + len > a->mem_len)
+		return NULL;
+
+	return a->mem + a->used;
+}
+
+void pcap_arena_commit(struct pcap_arena *a, uint32_t snaplen, uint32_t len)
+{
+	struct pcap_desc *d;
+
+	if (a->nr == a->max) {
+		a->max = a->max ? a->max * 2 : 1024;
+		a->descs = xrealloc(a->descs, a->max, sizeof(*a->descs));
+	}
+
+	d = &a->descs[a->nr++];
+	fmemset(d, 0, sizeof(*d));
+
+	d->data = a->mem + a->used;
+	d->snaplen = snaplen;
+	d->len = len;
+
+	pkt_off_parse(&d->off, d->data, snaplen, a->link_type);
+
+	a->used += snaplen;
+}
+
+/*
+ * Makes flows of loop n unique on the copy in the TX frame by adding n
+ * to the source address or the source port. Checksums are patched
+ * incrementally, the arena itself stays untouched.
+ */
+void pcap_arena_rewrite(const struct pcap_desc *d, uint8_t *frame,
+			enum pcap_arena_incr incr, uint32_t loop)
+{
+	uint8_t *ptr;
+	uint32_t addr_old, addr_new;
+	uint16_t port_old, port_new;
+	const struct pkt_off *o = &d->off;
+
+	if (loop == 0 || o->family == 0)
+		return;
+
+	switch (incr) {
+	case ARENA_INCR_IP:
+		/* IPv4 source, or the lower 32 bit of the IPv6 source */
+		ptr = frame + o->l3_off + (o->family == AF_INET ? 12 : 20);
+
+		fmemcpy(&addr_old, ptr, sizeof(addr_old));
+		addr_new = htonl(ntohl(addr_old) + loop);
+		fmemcpy(ptr, &addr_new, sizeof(addr_new));
+
+		pkt_off_ip_csum(o, frame, &addr_old, &addr_new, sizeof(addr_old));
+		pkt_off_l4_csum(o, frame, &addr_old, &addr_new, sizeof(addr_old));
+		break;
+	case ARENA_INCR_PORT:
+		if (!o->l4_off)
+			return;
+
+		ptr = frame + o->l4_off;
+
+		fmemcpy(&port_old, ptr, sizeof(port_old));
+		port_new = htons(ntohs(port_old) + loop);
+		fmemcpy(ptr, &port_new, sizeof(port_new));
+
+		pkt_off_l4_csum(o, frame, &port_old, &port_new, sizeof(port_old));
+		break;
+	case ARENA_INCR_NONE:
+		break;
+	}
+}
+
+void pcap_arena_destroy(struct pcap_arena *a)
+{
+	munmap(a->mem, a->mem_len);
+
+	if (a->descs)
+		xfree(a->descs);
+}
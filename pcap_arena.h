@@ -0,0 +1,53 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_ARENA_H
+#define PCAP_ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "pkt_off.h"
+
+/*
+ * A pcap trace preloaded into one (if possible hugepage backed) memory
+ * region, so that it can be replayed over and over again without file
+ * I/O. Each packet is described by a small descriptor that already holds
+ * the tpacket lengths and the offsets needed for per-loop rewrites.
+ */
+
+enum pcap_arena_incr {
+	ARENA_INCR_NONE,
+	ARENA_INCR_IP,
+	ARENA_INCR_PORT,
+};
+
+struct pcap_desc {
+	uint8_t *data;
+	uint32_t snaplen, len;
+	struct pkt_off off;
+};
+
+struct pcap_arena {
+	uint8_t *mem;
+	size_t mem_len, used;
+	bool huge;
+	struct pcap_desc *descs;
+	size_t nr, max;
+	uint32_t link_type;
+};
+
+extern void pcap_arena_init(struct pcap_arena *a, size_t size,
+			    uint32_t link_type);
+extern uint8_t *pcap_arena_reserve(struct pcap_arena *a, size_t len);
+extern void pcap_arena_commit(struct pcap_arena *a, uint32_t snaplen,
+			      uint32_t len);
+extern void pcap_arena_rewrite(const struct pcap_desc *d, uint8_t *frame,
+			       enum pcap_arena_incr incr, uint32_t loop);
+extern void pcap_arena_destroy(struct pcap_arena *a);
+
+#endif /* PCAP_ARENA_H */
@@ -107,6 +107,7 @@ enum pcap_ops_groups {
 	PCAP_OPS_RW = 0,
 	PCAP_OPS_SG,
 	PCAP_OPS_MM,
+	PCAP_OPS_RA,
 };
 
 enum pcap_mode {
@@ -114,13 +115,17 @@ enum pcap_mode {
 	PCAP_MODE_WR,
 };
 
+struct pcap_codec;
+
 struct pcap_file_ops {
 	int (*pull_fhdr_pcap)(int fd, uint32_t *magic, uint32_t *linktype);
 	int (*push_fhdr_pcap)(int fd, uint32_t magic, uint32_t linktype);
 	int (*prepare_access_pcap)(int fd, enum pcap_mode mode, bool jumbo);
-	ssize_t (*write_pcap)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+	ssize_t (*write_pcap)(int fd, pcap_pkthdr_t *phdr,
+			      const struct pcap_codec *codec,
 			      const uint8_t *packet, size_t len);
-	ssize_t (*read_pcap)(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+	ssize_t (*read_pcap)(int fd, pcap_pkthdr_t *phdr,
+			     const struct pcap_codec *codec,
 			     uint8_t *packet, size_t len);
 	void (*prepare_close_pcap)(int fd, enum pcap_mode mode);
 	void (*fsync_pcap)(int fd);
@@ -129,6 +134,7 @@ struct pcap_file_ops {
 extern const struct pcap_file_ops pcap_rw_ops;
 extern const struct pcap_file_ops pcap_sg_ops;
 extern const struct pcap_file_ops pcap_mm_ops;
+extern const struct pcap_file_ops pcap_ra_ops;
 
 static inline void pcap_check_magic(uint32_t magic)
 {
@@ -165,243 +171,151 @@ static inline bool pcap_magic_is_swapped(uint32_t magic)
 	return swapped;
 }
 
-static inline u32 pcap_get_length(pcap_pkthdr_t *phdr, enum pcap_type type)
-{
-	switch (type) {
-#define CASE_RET_CAPLEN(what, member, swap) \
-	case (what): \
-		return (swap ? ___constant_swab32(phdr->member.caplen) : \
-		        phdr->member.caplen)
-
-	CASE_RET_CAPLEN(DEFAULT, ppo, 0);
-	CASE_RET_CAPLEN(NSEC, ppn, 0);
-	CASE_RET_CAPLEN(KUZNETZOV, ppk, 0);
-	CASE_RET_CAPLEN(BORKMANN, ppb, 0);
-
-	CASE_RET_CAPLEN(DEFAULT_SWAPPED, ppo, 1);
-	CASE_RET_CAPLEN(NSEC_SWAPPED, ppn, 1);
-	CASE_RET_CAPLEN(KUZNETZOV_SWAPPED, ppk, 1);
-	CASE_RET_CAPLEN(BORKMANN_SWAPPED, ppb, 1);
+/*
+ * Per-magic record codecs. Header size, byte order and field layout are
+ * fixed per file, so a codec is picked once with pcap_codec_get() and
+ * the per-packet path neither switches over the magic nor tests for
+ * byte swapping: the functions below are generated per magic with the
+ * swap known at compile time.
+ */
+struct pcap_codec {
+	enum pcap_type type;
+	u32 hdr_len;
+	u32 (*get_length)(const pcap_pkthdr_t *phdr);
+	void (*set_length)(pcap_pkthdr_t *phdr, u32 len);
+	void (*to_tpacket)(const pcap_pkthdr_t *phdr, struct tpacket2_hdr *thdr);
+	void (*to_sll)(const pcap_pkthdr_t *phdr, struct sockaddr_ll *sll);
+	void (*from_tpacket)(const struct tpacket2_hdr *thdr,
+			     const struct sockaddr_ll *sll, pcap_pkthdr_t *phdr);
+};
 
-	default:
-		bug();
+#define __pcap_swab16(swap, x)	((swap) ? ___constant_swab16(x) : (x))
+#define __pcap_swab32(swap, x)	((swap) ? ___constant_swab32(x) : (x))
+
+/* Link layer fields only Kuznetzov and netsniff-ng headers carry */
+#define __pcap_ll_none(member, swap)
+
+#define __pcap_ll_kuz(member, swap)						\
+	static inline void __pcap_ll_to_##member##_##swap(const struct sockaddr_ll *sll,\
+							 pcap_pkthdr_t *phdr)	\
+	{									\
+		phdr->member.ifindex = __pcap_swab32(swap, (u32) sll->sll_ifindex);\
+		phdr->member.protocol = __pcap_swab16(swap, sll->sll_protocol);	\
+		phdr->member.pkttype = sll->sll_pkttype;			\
+	}									\
+	static inline void __pcap_ll_from_##member##_##swap(const pcap_pkthdr_t *phdr,\
+							   struct sockaddr_ll *sll)\
+	{									\
+		sll->sll_ifindex = __pcap_swab32(swap, (u32) phdr->member.ifindex);\
+		sll->sll_protocol = __pcap_swab16(swap, phdr->member.protocol);	\
+		sll->sll_pkttype = phdr->member.pkttype;			\
 	}
-}
 
-static inline void pcap_set_length(pcap_pkthdr_t *phdr, enum pcap_type type, u32 len)
-{
-	switch (type) {
-#define CASE_SET_CAPLEN(what, member, swap) \
-	case (what): \
-		phdr->member.caplen = (swap ? ___constant_swab32(len) : len); \
-		break
-
-	CASE_SET_CAPLEN(DEFAULT, ppo, 0);
-	CASE_SET_CAPLEN(NSEC, ppn, 0);
-	CASE_SET_CAPLEN(KUZNETZOV, ppk, 0);
-	CASE_SET_CAPLEN(BORKMANN, ppb, 0);
-
-	CASE_SET_CAPLEN(DEFAULT_SWAPPED, ppo, 1);
-	CASE_SET_CAPLEN(NSEC_SWAPPED, ppn, 1);
-	CASE_SET_CAPLEN(KUZNETZOV_SWAPPED, ppk, 1);
-	CASE_SET_CAPLEN(BORKMANN_SWAPPED, ppb, 1);
-
-	default:
-		bug();
+#define __pcap_ll_bkm(member, swap)						\
+	static inline void __pcap_ll_to_##member##_##swap(const struct sockaddr_ll *sll,\
+							 pcap_pkthdr_t *phdr)	\
+	{									\
+		phdr->member.ifindex = __pcap_swab32(swap, (u32) sll->sll_ifindex);\
+		phdr->member.protocol = __pcap_swab16(swap, sll->sll_protocol);	\
+		phdr->member.hatype = sll->sll_hatype;				\
+		phdr->member.pkttype = sll->sll_pkttype;			\
+	}									\
+	static inline void __pcap_ll_from_##member##_##swap(const pcap_pkthdr_t *phdr,\
+							   struct sockaddr_ll *sll)\
+	{									\
+		sll->sll_ifindex = __pcap_swab32(swap, phdr->member.ifindex);	\
+		sll->sll_protocol = __pcap_swab16(swap, phdr->member.protocol);	\
+		sll->sll_hatype = phdr->member.hatype;				\
+		sll->sll_pkttype = phdr->member.pkttype;			\
 	}
-}
-
-static inline u32 pcap_get_hdr_length(pcap_pkthdr_t *phdr, enum pcap_type type)
-{
-	switch (type) {
-#define CASE_RET_HDRLEN(what, member) \
-	case (what): \
-		return sizeof(phdr->member)
-
-	CASE_RET_HDRLEN(DEFAULT, ppo);
-	CASE_RET_HDRLEN(NSEC, ppn);
-	CASE_RET_HDRLEN(KUZNETZOV, ppk);
-	CASE_RET_HDRLEN(BORKMANN, ppb);
 
-	CASE_RET_HDRLEN(DEFAULT_SWAPPED, ppo);
-	CASE_RET_HDRLEN(NSEC_SWAPPED, ppn);
-	CASE_RET_HDRLEN(KUZNETZOV_SWAPPED, ppk);
-	CASE_RET_HDRLEN(BORKMANN_SWAPPED, ppb);
-
-	default:
-		bug();
+#define __pcap_ll_call_none(dir, member, swap, a, b)
+#define __pcap_ll_call_kuz(dir, member, swap, a, b)				\
+	__pcap_ll_##dir##_##member##_##swap(a, b)
+#define __pcap_ll_call_bkm(dir, member, swap, a, b)				\
+	__pcap_ll_##dir##_##member##_##swap(a, b)
+
+/* tsfield/tsdiv: tv_usec/1000 for us resolution, tv_nsec/1 for ns */
+#define PCAP_CODEC_DEFINE(name, what, member, swap, tsfield, tsdiv, ll)	\
+	__pcap_ll_##ll(member, swap)						\
+										\
+	static inline u32 __pcap_##name##_get_length(const pcap_pkthdr_t *phdr)\
+	{									\
+		return __pcap_swab32(swap, phdr->member.caplen);		\
+	}									\
+										\
+	static inline void __pcap_##name##_set_length(pcap_pkthdr_t *phdr, u32 len)\
+	{									\
+		phdr->member.caplen = __pcap_swab32(swap, len);			\
+	}									\
+										\
+	static inline void __pcap_##name##_to_tpacket(const pcap_pkthdr_t *phdr,\
+						      struct tpacket2_hdr *thdr)\
+	{									\
+		thdr->tp_sec = __pcap_swab32(swap, phdr->member.ts.tv_sec);	\
+		thdr->tp_nsec = __pcap_swab32(swap, phdr->member.ts.tsfield) * tsdiv;\
+		thdr->tp_snaplen = __pcap_swab32(swap, phdr->member.caplen);	\
+		thdr->tp_len = __pcap_swab32(swap, phdr->member.len);		\
+	}									\
+										\
+	static inline void __pcap_##name##_to_sll(const pcap_pkthdr_t *phdr,	\
+						  struct sockaddr_ll *sll)	\
+	{									\
+		fmemset(sll, 0, sizeof(*sll));					\
+		__pcap_ll_call_##ll(from, member, swap, phdr, sll);		\
+	}									\
+										\
+	static inline void __pcap_##name##_from_tpacket(const struct tpacket2_hdr *thdr,\
+							const struct sockaddr_ll *sll,\
+							pcap_pkthdr_t *phdr)	\
+	{									\
+		phdr->member.ts.tv_sec = __pcap_swab32(swap, thdr->tp_sec);	\
+		phdr->member.ts.tsfield = __pcap_swab32(swap, thdr->tp_nsec / tsdiv);\
+		phdr->member.caplen = __pcap_swab32(swap, thdr->tp_snaplen);	\
+		phdr->member.len = __pcap_swab32(swap, thdr->tp_len);		\
+		__pcap_ll_call_##ll(to, member, swap, sll, phdr);		\
+	}									\
+										\
+	static const struct pcap_codec pcap_codec_##name __maybe_unused = {	\
+		.type		=	what,					\
+		.hdr_len	=	sizeof(((pcap_pkthdr_t *) 0)->member),	\
+		.get_length	=	__pcap_##name##_get_length,		\
+		.set_length	=	__pcap_##name##_set_length,		\
+		.to_tpacket	=	__pcap_##name##_to_tpacket,		\
+		.to_sll		=	__pcap_##name##_to_sll,			\
+		.from_tpacket	=	__pcap_##name##_from_tpacket,		\
 	}
-}
 
-static inline u32 pcap_get_total_length(pcap_pkthdr_t *phdr, enum pcap_type type)
-{
-	switch (type) {
-#define CASE_RET_TOTLEN(what, member, swap) \
-	case (what): \
-		return ((swap ? ___constant_swab32(phdr->member.caplen) : \
-			 phdr->member.caplen) + sizeof(phdr->member))
-
-	CASE_RET_TOTLEN(DEFAULT, ppo, 0);
-	CASE_RET_TOTLEN(NSEC, ppn, 0);
-	CASE_RET_TOTLEN(KUZNETZOV, ppk, 0);
-	CASE_RET_TOTLEN(BORKMANN, ppb, 0);
-
-	CASE_RET_TOTLEN(DEFAULT_SWAPPED, ppo, 1);
-	CASE_RET_TOTLEN(NSEC_SWAPPED, ppn, 1);
-	CASE_RET_TOTLEN(KUZNETZOV_SWAPPED, ppk, 1);
-	CASE_RET_TOTLEN(BORKMANN_SWAPPED, ppb, 1);
+PCAP_CODEC_DEFINE(default, DEFAULT, ppo, 0, tv_usec, 1000, none);
+PCAP_CODEC_DEFINE(nsec, NSEC, ppn, 0, tv_nsec, 1, none);
+PCAP_CODEC_DEFINE(kuznetzov, KUZNETZOV, ppk, 0, tv_usec, 1000, kuz);
+PCAP_CODEC_DEFINE(borkmann, BORKMANN, ppb, 0, tv_nsec, 1, bkm);
 
-	default:
-		bug();
-	}
-}
+PCAP_CODEC_DEFINE(default_swapped, DEFAULT_SWAPPED, ppo, 1, tv_usec, 1000, none);
+PCAP_CODEC_DEFINE(nsec_swapped, NSEC_SWAPPED, ppn, 1, tv_nsec, 1, none);
+PCAP_CODEC_DEFINE(kuznetzov_swapped, KUZNETZOV_SWAPPED, ppk, 1, tv_usec, 1000, kuz);
+PCAP_CODEC_DEFINE(borkmann_swapped, BORKMANN_SWAPPED, ppb, 1, tv_nsec, 1, bkm);
 
-static inline void tpacket_hdr_to_pcap_pkthdr(struct tpacket2_hdr *thdr,
-					      struct sockaddr_ll *sll,
-					      pcap_pkthdr_t *phdr,
-					      enum pcap_type type)
+static inline const struct pcap_codec *pcap_codec_get(uint32_t magic)
 {
-	switch (type) {
-	case DEFAULT:
-		phdr->ppo.ts.tv_sec = thdr->tp_sec;
-		phdr->ppo.ts.tv_usec = thdr->tp_nsec / 1000;
-		phdr->ppo.caplen = thdr->tp_snaplen;
-		phdr->ppo.len = thdr->tp_len;
-		break;
-
-	case DEFAULT_SWAPPED:
-		phdr->ppo.ts.tv_sec = ___constant_swab32(thdr->tp_sec);
-		phdr->ppo.ts.tv_usec = ___constant_swab32(thdr->tp_nsec / 1000);
-		phdr->ppo.caplen = ___constant_swab32(thdr->tp_snaplen);
-		phdr->ppo.len = ___constant_swab32(thdr->tp_len);
-		break;
-
-	case NSEC:
-		phdr->ppn.ts.tv_sec = thdr->tp_sec;
-		phdr->ppn.ts.tv_nsec = thdr->tp_nsec;
-		phdr->ppn.caplen = thdr->tp_snaplen;
-		phdr->ppn.len = thdr->tp_len;
-		break;
-
-	case NSEC_SWAPPED:
-		phdr->ppn.ts.tv_sec = ___constant_swab32(thdr->tp_sec);
-		phdr->ppn.ts.tv_nsec = ___constant_swab32(thdr->tp_nsec);
-		phdr->ppn.caplen = ___constant_swab32(thdr->tp_snaplen);
-		phdr->ppn.len = ___constant_swab32(thdr->tp_len);
-		break;
-
-	case KUZNETZOV:
-		phdr->ppk.ts.tv_sec = thdr->tp_sec;
-		phdr->ppk.ts.tv_usec = thdr->tp_nsec / 1000;
-		phdr->ppk.caplen = thdr->tp_snaplen;
-		phdr->ppk.len = thdr->tp_len;
-		phdr->ppk.ifindex = sll->sll_ifindex;
-		phdr->ppk.protocol = sll->sll_protocol;
-		phdr->ppk.pkttype = sll->sll_pkttype;
-		break;
-
-	case KUZNETZOV_SWAPPED:
-		phdr->ppk.ts.tv_sec = ___constant_swab32(thdr->tp_sec);
-		phdr->ppk.ts.tv_usec = ___constant_swab32(thdr->tp_nsec / 1000);
-		phdr->ppk.caplen = ___constant_swab32(thdr->tp_snaplen);
-		phdr->ppk.len = ___constant_swab32(thdr->tp_len);
-		phdr->ppk.ifindex = ___constant_swab32((u32) sll->sll_ifindex);
-		phdr->ppk.protocol = ___constant_swab16(sll->sll_protocol);
-		phdr->ppk.pkttype = sll->sll_pkttype;
-		break;
-
-	case BORKMANN:
-		phdr->ppb.ts.tv_sec = thdr->tp_sec;
-		phdr->ppb.ts.tv_nsec = thdr->tp_nsec;
-		phdr->ppb.caplen = thdr->tp_snaplen;
-		phdr->ppb.len = thdr->tp_len;
-		phdr->ppb.ifindex = (u32) sll->sll_ifindex;
-		phdr->ppb.protocol = sll->sll_protocol;
-		phdr->ppb.hatype = sll->sll_hatype;
-		phdr->ppb.pkttype = sll->sll_pkttype;
-		break;
-
-	case BORKMANN_SWAPPED:
-		phdr->ppb.ts.tv_sec = ___constant_swab32(thdr->tp_sec);
-		phdr->ppb.ts.tv_nsec = ___constant_swab32(thdr->tp_nsec);
-		phdr->ppb.caplen = ___constant_swab32(thdr->tp_snaplen);
-		phdr->ppb.len = ___constant_swab32(thdr->tp_len);
-		phdr->ppb.ifindex = ___constant_swab32((u32) sll->sll_ifindex);
-		phdr->ppb.protocol = ___constant_swab16(sll->sll_protocol);
-		phdr->ppb.hatype = sll->sll_hatype;
-		phdr->ppb.pkttype = sll->sll_pkttype;
-		break;
-
+	switch (magic) {
+	case DEFAULT:		return &pcap_codec_default;
+	case NSEC:		return &pcap_codec_nsec;
+	case KUZNETZOV:		return &pcap_codec_kuznetzov;
+	case BORKMANN:		return &pcap_codec_borkmann;
+	case DEFAULT_SWAPPED:	return &pcap_codec_default_swapped;
+	case NSEC_SWAPPED:	return &pcap_codec_nsec_swapped;
+	case KUZNETZOV_SWAPPED:	return &pcap_codec_kuznetzov_swapped;
+	case BORKMANN_SWAPPED:	return &pcap_codec_borkmann_swapped;
 	default:
 		bug();
 	}
 }
 
-static inline void pcap_pkthdr_to_tpacket_hdr(pcap_pkthdr_t *phdr,
-					      enum pcap_type type,
-					      struct tpacket2_hdr *thdr,
-					      struct sockaddr_ll *sll)
+static inline u32 pcap_get_total_length(const pcap_pkthdr_t *phdr,
+					const struct pcap_codec *codec)
 {
-	switch (type) {
-	case DEFAULT:
-		thdr->tp_sec = phdr->ppo.ts.tv_sec;
-		thdr->tp_nsec = phdr->ppo.ts.tv_usec * 1000;
-		thdr->tp_snaplen = phdr->ppo.caplen;
-		thdr->tp_len = phdr->ppo.len;
-		break;
-
-	case DEFAULT_SWAPPED:
-		thdr->tp_sec = ___constant_swab32(phdr->ppo.ts.tv_sec);
-		thdr->tp_nsec = ___constant_swab32(phdr->ppo.ts.tv_usec) * 1000;
-		thdr->tp_snaplen = ___constant_swab32(phdr->ppo.caplen);
-		thdr->tp_len = ___constant_swab32(phdr->ppo.len);
-		break;
-
-	case NSEC:
-		thdr->tp_sec = phdr->ppn.ts.tv_sec;
-		thdr->tp_nsec = phdr->ppn.ts.tv_nsec;
-		thdr->tp_snaplen = phdr->ppn.caplen;
-		thdr->tp_len = phdr->ppn.len;
-		break;
-
-	case NSEC_SWAPPED:
-		thdr->tp_sec = ___constant_swab32(phdr->ppn.ts.tv_sec);
-		thdr->tp_nsec = ___constant_swab32(phdr->ppn.ts.tv_nsec);
-		thdr->tp_snaplen = ___constant_swab32(phdr->ppn.caplen);
-		thdr->tp_len = ___constant_swab32(phdr->ppn.len);
-		break;
-
-	case KUZNETZOV:
-		thdr->tp_sec = phdr->ppk.ts.tv_sec;
-		thdr->tp_nsec = phdr->ppk.ts.tv_usec * 1000;
-		thdr->tp_snaplen = phdr->ppk.caplen;
-		thdr->tp_len = phdr->ppk.len;
-		break;
-
-	case KUZNETZOV_SWAPPED:
-		thdr->tp_sec = ___constant_swab32(phdr->ppk.ts.tv_sec);
-		thdr->tp_nsec = ___constant_swab32(phdr->ppk.ts.tv_usec) * 1000;
-		thdr->tp_snaplen = ___constant_swab32(phdr->ppk.caplen);
-		thdr->tp_len = ___constant_swab32(phdr->ppk.len);
-		break;
-
-	case BORKMANN:
-		thdr->tp_sec = phdr->ppb.ts.tv_sec;
-		thdr->tp_nsec = phdr->ppb.ts.tv_nsec;
-		thdr->tp_snaplen = phdr->ppb.caplen;
-		thdr->tp_len = phdr->ppb.len;
-		break;
-
-	case BORKMANN_SWAPPED:
-		thdr->tp_sec = ___constant_swab32(phdr->ppb.ts.tv_sec);
-		thdr->tp_nsec = ___constant_swab32(phdr->ppb.ts.tv_nsec);
-		thdr->tp_snaplen = ___constant_swab32(phdr->ppb.caplen);
-		thdr->tp_len = ___constant_swab32(phdr->ppb.len);
-		break;
-
-	default:
-		bug();
-	}
+	return codec->hdr_len + codec->get_length(phdr);
 }
 
 #define FEATURE_UNKNOWN		(0 << 0)
@@ -494,12 +408,14 @@ static const char *pcap_ops_group_to_str[] __maybe_unused = {
 	[PCAP_OPS_RW] = "rw",
 	[PCAP_OPS_SG] = "sg",
 	[PCAP_OPS_MM] = "mm",
+	[PCAP_OPS_RA] = "ra",
 };
 
 static const struct pcap_file_ops *pcap_ops[] __maybe_unused = {
 	[PCAP_OPS_RW]		=	&pcap_rw_ops,
 	[PCAP_OPS_SG]		=	&pcap_sg_ops,
 	[PCAP_OPS_MM]		=	&pcap_mm_ops,
+	[PCAP_OPS_RA]		=	&pcap_ra_ops,
 };
 
 static inline void pcap_prepare_header(struct pcap_filehdr *hdr, uint32_t magic,
@@ -0,0 +1,287 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pcap_merge.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "xio.h"
+#include "xtime.h"
+#include "built_in.h"
+#include "die.h"
+
+static void __pcap_merge_add(struct pcap_merge *m, const char *name)
+{
+	struct pcap_merge_in *in;
+
+	m->in = xrealloc(m->in, m->nr + 1, sizeof(*m->in));
+	in = &m->in[m->nr++];
+
+	fmemset(in, 0, sizeof(*in));
+	in->name = xstrdup(name);
+}
+
+static int __pcap_merge_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* All *.pcap files of a directory, in name (i.e. capture) order */
+static void __pcap_merge_add_dir(struct pcap_merge *m, const char *dir)
+{
+	DIR *d;
+	struct dirent *e;
+	char path[PATH_MAX], **names = NULL;
+	size_t i, nr = 0, len;
+
+	d = opendir(dir);
+	if (!d)
+		panic("Cannot open directory %s: %s!\n", dir, strerror(errno));
+
+	while ((e = readdir(d))) {
+		len = strlen(e->d_name);
+		if (e->d_name[0] == '.' || len < strlen(".pcap") ||
+		    strcmp(e->d_name + len - strlen(".pcap"), ".pcap"))
+			continue;
+
+		names = xrealloc(names, nr + 1, sizeof(*names));
+		names[nr++] = xstrdup(e->d_name);
+	}
+
+	closedir(d);
+
+	qsort(names, nr, sizeof(*names), __pcap_merge_name_cmp);
+
+	for (i = 0; i < nr; ++i) {
+		slprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		__pcap_merge_add(m, path);
+		xfree(names[i]);
+	}
+
+	if (names)
+		xfree(names);
+}
+
+/* Makes at least need bytes available at in->off, returns -1 on EOF */
+static int __pcap_merge_fill(struct pcap_merge_in *in, size_t need)
+{
+	ssize_t ret;
+
+	if (in->len - in->off >= need)
+		return 0;
+	if (in->eof)
+		return -1;
+
+	memmove(in->buff, in->buff + in->off, in->len - in->off);
+	in->len -= in->off;
+	in->off = 0;
+
+	while (in->len < PCAP_MERGE_BUFF_SIZE) {
+		ret = read(in->fd, in->buff + in->len,
+			   PCAP_MERGE_BUFF_SIZE - in->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("Cannot read %s: %s!\n", in->name, strerror(errno));
+		}
+		if (ret == 0) {
+			in->eof = true;
+			break;
+		}
+
+		in->len += ret;
+	}
+
+	return in->len >= need ? 0 : -1;
+}
+
+/* Moves on to the next record, returns -1 at the end of the file */
+static int __pcap_merge_advance(struct pcap_merge_in *in)
+{
+	size_t hdrlen, caplen;
+
+	in->off += in->rec_len;
+	in->rec_len = 0;
+
+	hdrlen = in->codec->hdr_len;
+	if (__pcap_merge_fill(in, hdrlen) < 0)
+		return -1;
+
+	fmemcpy(&in->phdr, in->buff + in->off, hdrlen);
+
+	caplen = in->codec->get_length(&in->phdr);
+	if (hdrlen + caplen > PCAP_MERGE_BUFF_SIZE)
+		panic("%s: record of %zu bytes, file corrupt?\n", in->name,
+		      caplen);
+
+	/* A truncated last record ends the file. */
+	if (__pcap_merge_fill(in, hdrlen + caplen) < 0)
+		return -1;
+
+	in->rec_len = hdrlen + caplen;
+	in->packet = in->buff + in->off + hdrlen;
+
+	in->codec->to_tpacket(&in->phdr, &in->tp_h);
+	in->codec->to_sll(&in->phdr, &in->sll);
+
+	in->ts = in->tp_h.tp_sec * NSEC_PER_SEC + in->tp_h.tp_nsec;
+	in->packets++;
+
+	return 0;
+}
+
+static void __pcap_merge_open(struct pcap_merge *m, struct pcap_merge_in *in)
+{
+	struct pcap_filehdr hdr;
+
+	in->fd = open_or_die(in->name, O_RDONLY | O_LARGEFILE | O_NOATIME);
+	in->buff = xmalloc_aligned(PCAP_MERGE_BUFF_SIZE, CO_CACHE_LINE_SIZE);
+
+	posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (__pcap_merge_fill(in, sizeof(hdr)) < 0)
+		panic("%s: error reading pcap header!\n", in->name);
+
+	fmemcpy(&hdr, in->buff, sizeof(hdr));
+	pcap_validate_header(&hdr);
+
+	in->off = sizeof(hdr);
+	in->magic = hdr.magic;
+	in->codec = pcap_codec_get(hdr.magic);
+	in->link_type = pcap_magic_is_swapped(hdr.magic) ?
+			___constant_swab32(hdr.linktype) : hdr.linktype;
+
+	if (m->link_type == 0)
+		m->link_type = in->link_type;
+	else if (m->link_type != in->link_type)
+		panic("%s: link type %u differs from %u of other inputs!\n",
+		      in->name, in->link_type, m->link_type);
+
+	if (in->magic == NSEC || in->magic == NSEC_SWAPPED ||
+	    in->magic == BORKMANN || in->magic == BORKMANN_SWAPPED)
+		m->nsec = true;
+}
+
+static inline bool __pcap_merge_less(struct pcap_merge *m, uint32_t a,
+				     uint32_t b)
+{
+	struct pcap_merge_in *ia = &m->in[m->heap[a]], *ib = &m->in[m->heap[b]];
+
+	if (ia->ts == ib->ts)
+		return m->heap[a] < m->heap[b];
+
+	return ia->ts < ib->ts;
+}
+
+static inline void __pcap_merge_swap(struct pcap_merge *m, uint32_t a,
+				     uint32_t b)
+{
+	uint32_t tmp = m->heap[a];
+
+	m->heap[a] = m->heap[b];
+	m->heap[b] = tmp;
+}
+
+static void __pcap_merge_sift_down(struct pcap_merge *m, uint32_t pos)
+{
+	while (1) {
+		uint32_t l = 2 * pos + 1, r = l + 1, min = pos;
+
+		if (l < m->heap_nr && __pcap_merge_less(m, l, min))
+			min = l;
+		if (r < m->heap_nr && __pcap_merge_less(m, r, min))
+			min = r;
+		if (min == pos)
+			break;
+
+		__pcap_merge_swap(m, pos, min);
+		pos = min;
+	}
+}
+
+/*
+ * Inputs are a comma separated list of pcap files and directories,
+ * the latter standing for all *.pcap files in them (e.g. the output
+ * of a capture in directory mode).
+ */
+void pcap_merge_init(struct pcap_merge *m, const char *inputs)
+{
+	char *list, *tok, *save = NULL;
+	struct stat sb;
+	uint32_t i;
+
+	fmemset(m, 0, sizeof(*m));
+
+	list = xstrdup(inputs);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (stat(tok, &sb) < 0)
+			panic("Cannot stat %s: %s!\n", tok, strerror(errno));
+
+		if (S_ISDIR(sb.st_mode))
+			__pcap_merge_add_dir(m, tok);
+		else
+			__pcap_merge_add(m, tok);
+	}
+	xfree(list);
+
+	if (m->nr == 0)
+		panic("No pcap files to merge in %s!\n", inputs);
+
+	m->heap = xmalloc(m->nr * sizeof(*m->heap));
+
+	for (i = 0; i < m->nr; ++i) {
+		__pcap_merge_open(m, &m->in[i]);
+
+		if (__pcap_merge_advance(&m->in[i]) == 0)
+			m->heap[m->heap_nr++] = i;
+	}
+
+	for (i = m->heap_nr / 2; i-- > 0;)
+		__pcap_merge_sift_down(m, i);
+}
+
+/*
+ * Returns the input holding the oldest record of all, which is valid
+ * until the next call, or NULL once every input is drained.
+ */
+struct pcap_merge_in *pcap_merge_next(struct pcap_merge *m)
+{
+	if (m->started && m->heap_nr > 0) {
+		if (__pcap_merge_advance(&m->in[m->heap[0]]) < 0)
+			m->heap[0] = m->heap[--m->heap_nr];
+
+		__pcap_merge_sift_down(m, 0);
+	}
+
+	m->started = true;
+
+	return m->heap_nr > 0 ? &m->in[m->heap[0]] : NULL;
+}
+
+void pcap_merge_destroy(struct pcap_merge *m)
+{
+	uint32_t i;
+
+	for (i = 0; i < m->nr; ++i) {
+		close(m->in[i].fd);
+		xfree(m->in[i].buff);
+		xfree(m->in[i].name);
+	}
+
+	xfree(m->in);
+	xfree(m->heap);
+}
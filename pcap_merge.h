@@ -0,0 +1,56 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_MERGE_H
+#define PCAP_MERGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/if_packet.h>
+
+#include "pcap_io.h"
+
+/*
+ * Streaming k-way merge of pcap files by timestamp. The pcap_file_ops
+ * backends keep their buffers or mappings in per-process state and can
+ * only serve one file at a time, so every input gets its own read-ahead
+ * buffer here and records are handed out in place. Timestamps of all
+ * magics are normalized to nanoseconds, ties keep input order.
+ */
+
+#define PCAP_MERGE_BUFF_SIZE	(4 * 1024 * 1024)
+
+struct pcap_merge_in {
+	int fd;
+	char *name;
+	uint32_t magic, link_type;
+	const struct pcap_codec *codec;
+	uint8_t *buff;
+	size_t len, off, rec_len;
+	bool eof;
+	/* Current record */
+	pcap_pkthdr_t phdr;
+	struct tpacket2_hdr tp_h;
+	struct sockaddr_ll sll;
+	uint8_t *packet;
+	uint64_t ts;
+	unsigned long packets;
+};
+
+struct pcap_merge {
+	struct pcap_merge_in *in;
+	uint32_t nr, heap_nr, *heap;
+	uint32_t link_type;
+	/* Some input carries nanosecond timestamps */
+	bool nsec;
+	bool started;
+};
+
+extern void pcap_merge_init(struct pcap_merge *m, const char *inputs);
+extern struct pcap_merge_in *pcap_merge_next(struct pcap_merge *m);
+extern void pcap_merge_destroy(struct pcap_merge *m);
+
+#endif /* PCAP_MERGE_H */
@@ -48,10 +48,11 @@ static void __pcap_mmap_write_need_remap(int fd)
 	ptr_va_curr = ptr_va_start + offset;
 }
 
-static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr,
+			     const struct pcap_codec *codec,
 			     const uint8_t *packet, size_t len)
 {
-	size_t hdrsize = pcap_get_hdr_length(phdr, type);
+	size_t hdrsize = codec->hdr_len;
 
 	if ((off_t) (ptr_va_curr - ptr_va_start) + hdrsize + len > map_size)
 		__pcap_mmap_write_need_remap(fd);
@@ -64,17 +65,18 @@ static ssize_t pcap_mm_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 	return hdrsize + len;
 }
 
-static ssize_t pcap_mm_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_mm_read(int fd, pcap_pkthdr_t *phdr,
+			    const struct pcap_codec *codec,
 			    uint8_t *packet, size_t len)
 {
-	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+	size_t hdrsize = codec->hdr_len, hdrlen;
 
 	if (unlikely((off_t) (ptr_va_curr + hdrsize - ptr_va_start) > map_size))
 		return -EIO;
 
 	fmemcpy(&phdr->raw, ptr_va_curr, hdrsize);
 	ptr_va_curr += hdrsize;
-	hdrlen = pcap_get_length(phdr, type);
+	hdrlen = codec->get_length(phdr);
 
 	if (unlikely((off_t) (ptr_va_curr + hdrlen - ptr_va_start) > map_size))
 		return -EIO;
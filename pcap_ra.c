@@ -0,0 +1,236 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pcap_io.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "xutils.h"
+#include "built_in.h"
+#include "die.h"
+
+/*
+ * Read-only backend with asynchronous read-ahead: a helper thread keeps
+ * up to PCAP_RA_CHUNKS chunks of the file filled ahead of the consumer,
+ * so the next chunk is usually in memory by the time the current one
+ * is drained, and disk or network file system latency is overlapped
+ * with replay or dissection instead of being added to it. Records may
+ * span chunk boundaries.
+ */
+
+#define PCAP_RA_CHUNK_SIZE	(4 * 1024 * 1024)
+#define PCAP_RA_CHUNKS		3
+
+struct pcap_ra_chunk {
+	uint8_t *data;
+	size_t len;
+	/* errno of the read that ended the file, if it failed */
+	int err;
+	bool full, eof;
+};
+
+static struct pcap_ra_chunk chunks[PCAP_RA_CHUNKS];
+static unsigned int ra_cur;
+static size_t ra_off;
+static bool ra_have, ra_stop;
+static pthread_t ra_thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+
+static void __pcap_ra_unlock(void *arg)
+{
+	pthread_mutex_unlock(&ra_lock);
+}
+
+/*
+ * Waits until the reader drained c, returns true if we are to stop. Kept
+ * apart from the fill loop, as pthread_cleanup_push() may use setjmp.
+ */
+static bool __pcap_ra_wait_drained(struct pcap_ra_chunk *c)
+{
+	bool stop;
+
+	pthread_mutex_lock(&ra_lock);
+	pthread_cleanup_push(__pcap_ra_unlock, NULL);
+	while (c->full && !ra_stop)
+		pthread_cond_wait(&ra_cond, &ra_lock);
+	stop = ra_stop;
+	pthread_cleanup_pop(1);
+
+	return stop;
+}
+
+static void *pcap_ra_fill(void *arg)
+{
+	int fd = (long) arg;
+	unsigned int i = 0;
+	ssize_t ret;
+
+	while (1) {
+		struct pcap_ra_chunk *c = &chunks[i];
+
+		if (__pcap_ra_wait_drained(c))
+			break;
+
+		c->len = 0;
+		c->err = 0;
+		c->eof = false;
+
+		while (c->len < PCAP_RA_CHUNK_SIZE) {
+			ret = read(fd, c->data + c->len, PCAP_RA_CHUNK_SIZE - c->len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				/* The reader gets the error once it drained the chunk. */
+				c->err = ret < 0 ? errno : 0;
+				c->eof = true;
+				break;
+			}
+
+			c->len += ret;
+		}
+
+		pthread_mutex_lock(&ra_lock);
+		c->full = true;
+		pthread_cond_broadcast(&ra_cond);
+		pthread_mutex_unlock(&ra_lock);
+
+		if (c->eof)
+			break;
+
+		i = (i + 1) % PCAP_RA_CHUNKS;
+	}
+
+	pthread_exit(NULL);
+}
+
+static int __pcap_ra_get(uint8_t *dst, size_t len)
+{
+	while (len > 0) {
+		struct pcap_ra_chunk *c = &chunks[ra_cur];
+		size_t n;
+
+		if (unlikely(!ra_have)) {
+			pthread_mutex_lock(&ra_lock);
+			while (!c->full)
+				pthread_cond_wait(&ra_cond, &ra_lock);
+			pthread_mutex_unlock(&ra_lock);
+
+			ra_have = true;
+		}
+
+		n = min(len, c->len - ra_off);
+		fmemcpy(dst, c->data + ra_off, n);
+
+		ra_off += n;
+		dst += n;
+		len -= n;
+
+		if (ra_off == c->len) {
+			if (c->eof && c->err)
+				return -c->err;
+			if (c->eof)
+				return len ? -EIO : 0;
+
+			pthread_mutex_lock(&ra_lock);
+			c->full = false;
+			pthread_cond_broadcast(&ra_cond);
+			pthread_mutex_unlock(&ra_lock);
+
+			ra_cur = (ra_cur + 1) % PCAP_RA_CHUNKS;
+			ra_off = 0;
+			ra_have = false;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t pcap_ra_read(int fd, pcap_pkthdr_t *phdr,
+			    const struct pcap_codec *codec,
+			    uint8_t *packet, size_t len)
+{
+	size_t hdrsize = codec->hdr_len, hdrlen;
+	int ret;
+
+	ret = __pcap_ra_get(&phdr->raw, hdrsize);
+	if (unlikely(ret < 0))
+		return ret;
+
+	hdrlen = codec->get_length(phdr);
+	if (unlikely(hdrlen == 0 || hdrlen > len))
+		return -EINVAL;
+
+	ret = __pcap_ra_get(packet, hdrlen);
+	if (unlikely(ret < 0))
+		return ret;
+
+	return hdrsize + hdrlen;
+}
+
+static int pcap_ra_prepare_access(int fd, enum pcap_mode mode, bool jumbo)
+{
+	int i, ret;
+
+	if (mode != PCAP_MODE_RD)
+		return -EINVAL;
+
+	for (i = 0; i < PCAP_RA_CHUNKS; ++i) {
+		chunks[i].data = xmalloc_aligned(PCAP_RA_CHUNK_SIZE,
+						 CO_CACHE_LINE_SIZE);
+		chunks[i].len = 0;
+		chunks[i].err = 0;
+		chunks[i].full = chunks[i].eof = false;
+	}
+
+	ra_cur = 0;
+	ra_off = 0;
+	ra_have = ra_stop = false;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	set_ioprio_rt();
+
+	ret = pthread_create(&ra_thread, NULL, pcap_ra_fill, (void *) (long) fd);
+	if (ret)
+		return -ret;
+
+	return 0;
+}
+
+static void pcap_ra_prepare_close(int fd, enum pcap_mode mode)
+{
+	int i;
+
+	pthread_mutex_lock(&ra_lock);
+	ra_stop = true;
+	pthread_cond_broadcast(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+
+	/* It might sit in a read(2) from a pipe that never ends. */
+	pthread_cancel(ra_thread);
+	pthread_join(ra_thread, NULL);
+
+	for (i = 0; i < PCAP_RA_CHUNKS; ++i)
+		xfree(chunks[i].data);
+}
+
+static void pcap_ra_fsync(int fd)
+{
+}
+
+const struct pcap_file_ops pcap_ra_ops = {
+	.pull_fhdr_pcap = pcap_generic_pull_fhdr,
+	.push_fhdr_pcap = pcap_generic_push_fhdr,
+	.prepare_access_pcap = pcap_ra_prepare_access,
+	.prepare_close_pcap = pcap_ra_prepare_close,
+	.read_pcap = pcap_ra_read,
+	.fsync_pcap = pcap_ra_fsync,
+};
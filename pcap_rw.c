@@ -17,16 +17,17 @@
 #include "xio.h"
 #include "die.h"
 
-static ssize_t pcap_rw_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_rw_write(int fd, pcap_pkthdr_t *phdr,
+			     const struct pcap_codec *codec,
 			     const uint8_t *packet, size_t len)
 {
-	ssize_t ret, hdrsize = pcap_get_hdr_length(phdr, type), hdrlen = 0;
+	ssize_t ret, hdrsize = codec->hdr_len, hdrlen = 0;
 
 	ret = write_or_die(fd, &phdr->raw, hdrsize);
 	if (unlikely(ret != hdrsize))
 		panic("Failed to write pkt header!\n");
 
-	hdrlen = pcap_get_length(phdr, type);
+	hdrlen = codec->get_length(phdr);
 	if (unlikely(hdrlen != len))
 		return -EINVAL;
 
@@ -37,16 +38,17 @@ static ssize_t pcap_rw_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 	return hdrsize + hdrlen;
 }
 
-static ssize_t pcap_rw_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_rw_read(int fd, pcap_pkthdr_t *phdr,
+			    const struct pcap_codec *codec,
 			    uint8_t *packet, size_t len)
 {
-	ssize_t ret, hdrsize = pcap_get_hdr_length(phdr, type), hdrlen = 0;
+	ssize_t ret, hdrsize = codec->hdr_len, hdrlen = 0;
 
 	ret = read_or_die(fd, &phdr->raw, hdrsize);
 	if (unlikely(ret != hdrsize))
 		return -EIO;
 
-	hdrlen = pcap_get_length(phdr, type);
+	hdrlen = codec->get_length(phdr);
 	if (unlikely(hdrlen == 0 || hdrlen > len))
                 return -EINVAL;
 
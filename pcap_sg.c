@@ -20,10 +20,11 @@
 static struct iovec iov[1024] __cacheline_aligned;
 static off_t iov_off_rd = 0, iov_slot = 0;
 
-static ssize_t pcap_sg_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_sg_write(int fd, pcap_pkthdr_t *phdr,
+			     const struct pcap_codec *codec,
 			     const uint8_t *packet, size_t len)
 {
-	ssize_t ret, hdrsize = pcap_get_hdr_length(phdr, type);
+	ssize_t ret, hdrsize = codec->hdr_len;
 
 	if (unlikely(iov_slot == array_size(iov))) {
 		ret = writev(fd, iov, array_size(iov));
@@ -43,7 +44,7 @@ static ssize_t pcap_sg_write(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
 	return ret;
 }
 
-static ssize_t __pcap_sg_inter_iov_hdr_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t __pcap_sg_inter_iov_hdr_read(int fd, pcap_pkthdr_t *phdr,
 					    uint8_t *packet, size_t len, size_t hdrsize)
 {
 	int ret;
@@ -104,23 +105,24 @@ static ssize_t __pcap_sg_inter_iov_data_read(int fd, uint8_t *packet, size_t len
 	return hdrlen;
 }
 
-static ssize_t pcap_sg_read(int fd, pcap_pkthdr_t *phdr, enum pcap_type type,
+static ssize_t pcap_sg_read(int fd, pcap_pkthdr_t *phdr,
+			    const struct pcap_codec *codec,
 			    uint8_t *packet, size_t len)
 {
 	ssize_t ret = 0;
-	size_t hdrsize = pcap_get_hdr_length(phdr, type), hdrlen;
+	size_t hdrsize = codec->hdr_len, hdrlen;
 
 	if (likely(iov[iov_slot].iov_len - iov_off_rd >= hdrsize)) {
 		fmemcpy(&phdr->raw, iov[iov_slot].iov_base + iov_off_rd, hdrsize);
 		iov_off_rd += hdrsize;
 	} else {
-		ret = __pcap_sg_inter_iov_hdr_read(fd, phdr, type, packet,
+		ret = __pcap_sg_inter_iov_hdr_read(fd, phdr, packet,
 						   len, hdrsize);
 		if (unlikely(ret < 0))
 			return ret;
 	}
 
-	hdrlen = pcap_get_length(phdr, type);
+	hdrlen = codec->get_length(phdr);
 	if (unlikely(hdrlen == 0 || hdrlen > len))
 		return -EINVAL;
 
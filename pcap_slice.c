@@ -0,0 +1,164 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "pcap_slice.h"
+#include "xmalloc.h"
+#include "xio.h"
+#include "xtime.h"
+#include "built_in.h"
+#include "die.h"
+
+static ssize_t __copy_file_range(int fdi, loff_t *off_in, int fdo,
+				 loff_t *off_out, size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, fdi, off_in, fdo, off_out, len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Seconds and fraction are parsed apart, a double has no ns precision. */
+static uint64_t __pcap_slice_parse_ts(const char *str)
+{
+	const char *p = str;
+	uint64_t secs = 0, nsecs = 0, scale = NSEC_PER_SEC;
+
+	if (!isdigit(*p) && !(*p == '.' && isdigit(p[1])))
+		panic("Slice time %s must be a number >= 0!\n", str);
+
+	for (; isdigit(*p); ++p) {
+		if (secs > (UINT64_MAX / NSEC_PER_SEC - (*p - '0')) / 10)
+			panic("Slice time %s is out of range!\n", str);
+		secs = secs * 10 + (*p - '0');
+	}
+
+	if (*p == '.') {
+		/* Digits beyond ns resolution are cut off. */
+		for (++p; isdigit(*p); ++p) {
+			scale /= 10;
+			nsecs += (*p - '0') * scale;
+		}
+	}
+
+	if (*p)
+		panic("Slice time %s has trailing garbage!\n", str);
+	if (nsecs > UINT64_MAX - secs * NSEC_PER_SEC)
+		panic("Slice time %s is out of range!\n", str);
+
+	return secs * NSEC_PER_SEC + nsecs;
+}
+
+static unsigned long __pcap_slice_parse_count(const char *str)
+{
+	char *end;
+	unsigned long val;
+
+	if (!isdigit(*str))
+		panic("Slice count %s must be a number!\n", str);
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno == ERANGE)
+		panic("Slice count %s is out of range!\n", str);
+	if (*end)
+		panic("Slice count %s has trailing garbage!\n", str);
+
+	return val;
+}
+
+/*
+ * A spec is "all" or a comma separated list of time:<from>-<to> (unix
+ * time in seconds, fractions allowed) and count:<from>-<to> (records
+ * counted from 1). Either bound of a range may be left out.
+ */
+void pcap_slice_parse(struct pcap_slice *s, const char *spec)
+{
+	char *list, *tok, *save = NULL, *sep;
+
+	fmemset(s, 0, sizeof(*s));
+
+	s->ts_to = ~0ULL;
+	s->rec_from = 1;
+	s->rec_to = ~0UL;
+
+	list = xstrdup(spec);
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "all"))
+			continue;
+
+		sep = strchr(tok, '-');
+		if (!sep)
+			panic("Slice range %s has no '-'!\n", tok);
+		*sep++ = 0;
+
+		if (!strncmp(tok, "time:", strlen("time:"))) {
+			tok += strlen("time:");
+			if (*tok)
+				s->ts_from = __pcap_slice_parse_ts(tok);
+			if (*sep)
+				s->ts_to = __pcap_slice_parse_ts(sep);
+		} else if (!strncmp(tok, "count:", strlen("count:"))) {
+			tok += strlen("count:");
+			if (*tok)
+				s->rec_from = __pcap_slice_parse_count(tok);
+			if (*sep)
+				s->rec_to = __pcap_slice_parse_count(sep);
+		} else {
+			panic("Unknown slice %s, use time: or count:!\n", tok);
+		}
+	}
+	xfree(list);
+
+	if (s->ts_from > s->ts_to || s->rec_from > s->rec_to ||
+	    s->rec_from == 0)
+		panic("Empty slice %s!\n", spec);
+}
+
+/* Appends len bytes at off of the input file to the output. */
+void pcap_slice_append(struct pcap_slice *s, int fdi, int fdo,
+		       const uint8_t *map, off_t off, size_t len)
+{
+	ssize_t ret;
+
+	s->runs++;
+
+	while (len >= PCAP_SLICE_COPY_MIN && !s->no_copy_range) {
+		loff_t off_in = off;
+
+		ret = __copy_file_range(fdi, &off_in, fdo, NULL, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			/* Not supported here, e.g. output is a pipe. */
+			s->no_copy_range = true;
+			break;
+		}
+
+		off += ret;
+		len -= ret;
+		s->copied += ret;
+	}
+
+	while (len > 0) {
+		ret = write_or_die(fdo, map + off, len);
+
+		off += ret;
+		len -= ret;
+		s->written += ret;
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PCAP_SLICE_H
+#define PCAP_SLICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Extraction of a subset of a pcap into a new pcap. Records are never
+ * re-encoded: consecutive matching records form one contiguous range
+ * of the input file, which is appended to the output either in-kernel
+ * with copy_file_range(2) or with a single write(2) from the input
+ * mapping.
+ */
+
+/* Runs at least this long are copied in-kernel */
+#define PCAP_SLICE_COPY_MIN	(64 * 1024)
+
+struct pcap_slice {
+	/* Inclusive bounds, timestamps in ns, records counted from 1 */
+	uint64_t ts_from, ts_to;
+	unsigned long rec_from, rec_to;
+	bool no_copy_range;
+	unsigned long runs;
+	uint64_t copied, written;
+};
+
+extern void pcap_slice_parse(struct pcap_slice *s, const char *spec);
+extern void pcap_slice_append(struct pcap_slice *s, int fdi, int fdo,
+			      const uint8_t *map, off_t off, size_t len);
+
+static inline bool pcap_slice_match(const struct pcap_slice *s,
+				    unsigned long rec, uint64_t ts)
+{
+	return rec >= s->rec_from && rec <= s->rec_to &&
+	       ts >= s->ts_from && ts <= s->ts_to;
+}
+
+#endif /* PCAP_SLICE_H */
@@ -0,0 +1,129 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef PKT_OFF_H
+#define PKT_OFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <linux/if_ether.h>
+
+#include "built_in.h"
+#include "pcap_io.h"
+#include "csum.h"
+
+#ifndef ETH_P_8021AD
+# define ETH_P_8021AD	0x88A8
+#endif
+
+/*
+ * Header offsets of an Ethernet frame, as needed to rewrite fields in
+ * place. An offset of 0 means the header is not there (or truncated).
+ */
+struct pkt_off {
+	uint16_t vlan_off, l3_off, l4_off;
+	uint8_t family, proto;
+};
+
+static inline void pkt_off_parse(struct pkt_off *o, const uint8_t *pkt,
+				 size_t len, uint32_t link_type)
+{
+	uint16_t proto;
+	size_t off = ETH_HLEN, l4_len;
+
+	fmemset(o, 0, sizeof(*o));
+
+	if (link_type != LINKTYPE_EN10MB || len < ETH_HLEN)
+		return;
+
+	fmemcpy(&proto, pkt + 2 * ETH_ALEN, sizeof(proto));
+	while (proto == htons(ETH_P_8021Q) || proto == htons(ETH_P_8021AD)) {
+		if (off + 4 > len)
+			return;
+		if (o->vlan_off == 0)
+			o->vlan_off = off;
+		fmemcpy(&proto, pkt + off + 2, sizeof(proto));
+		off += 4;
+	}
+
+	switch (ntohs(proto)) {
+	case ETH_P_IP: {
+		const struct iphdr *ip4 = (const void *) (pkt + off);
+
+		if (off + sizeof(*ip4) > len || ip4->ihl < 5)
+			return;
+
+		o->family = AF_INET;
+		o->l3_off = off;
+
+		if (ntohs(ip4->frag_off) & 0x1fff)
+			return;
+
+		o->proto = ip4->protocol;
+		off += ip4->ihl * 4;
+		break; }
+	case ETH_P_IPV6:
+		if (off + 40 > len)
+			return;
+
+		o->family = AF_INET6;
+		o->l3_off = off;
+		o->proto = pkt[off + 6];
+		off += 40;
+		break;
+	default:
+		return;
+	}
+
+	switch (o->proto) {
+	case IPPROTO_TCP:
+		l4_len = 20;
+		break;
+	case IPPROTO_UDP:
+		l4_len = 8;
+		break;
+	default:
+		return;
+	}
+
+	if (off + l4_len <= len)
+		o->l4_off = off;
+}
+
+/* Field at l3_off + off changed from old to new, len bytes (even) */
+static inline void pkt_off_ip_csum(const struct pkt_off *o, uint8_t *pkt,
+				   const void *old, const void *new, size_t len)
+{
+	if (o->family == AF_INET)
+		csum_replace(pkt + o->l3_off + 10, old, new, len);
+}
+
+/* Covers L4 fields as well as IP addresses of the pseudo header */
+static inline void pkt_off_l4_csum(const struct pkt_off *o, uint8_t *pkt,
+				   const void *old, const void *new, size_t len)
+{
+	uint8_t *check;
+
+	if (!o->l4_off)
+		return;
+
+	if (o->proto == IPPROTO_UDP) {
+		check = pkt + o->l4_off + 6;
+		/* A zero UDP checksum over IPv4 means there is none. */
+		if (check[0] == 0 && check[1] == 0)
+			return;
+		csum_replace(check, old, new, len);
+		if (check[0] == 0 && check[1] == 0)
+			check[0] = check[1] = 0xff;
+	} else {
+		csum_replace(pkt + o->l4_off + 16, old, new, len);
+	}
+}
+
+#endif /* PKT_OFF_H */
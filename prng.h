@@ -0,0 +1,142 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ *
+ * xoshiro256** and splitmix64 follow the public domain reference code
+ * by David Blackman and Sebastiano Vigna, https://prng.di.unimi.it/.
+ */
+
+#ifndef PRNG_H
+#define PRNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "built_in.h"
+
+/*
+ * Lock-free per-thread pseudo random numbers, xoshiro256** by Blackman
+ * and Vigna, seeded through splitmix64. Not for cryptographic use. Long
+ * runs of random bytes come from PRNG_LANES independent generators that
+ * are stepped side by side, which the compiler turns into SIMD code.
+ */
+#define PRNG_LANES		4
+
+struct prng {
+	uint64_t s[4];
+	/* Lane generators, indexed [state word][lane] */
+	uint64_t v[4][PRNG_LANES];
+};
+
+static inline uint64_t __prng_rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t __prng_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t prng_u64(struct prng *p)
+{
+	uint64_t *s = p->s;
+	uint64_t ret = __prng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = __prng_rotl(s[3], 45);
+
+	return ret;
+}
+
+static inline uint32_t prng_u32(struct prng *p)
+{
+	return prng_u64(p) >> 32;
+}
+
+/* Uniform in [0, n), n > 0, with Lemire's multiply and shift */
+static inline uint32_t prng_range(struct prng *p, uint32_t n)
+{
+	return ((uint64_t) prng_u32(p) * n) >> 32;
+}
+
+static inline void prng_seed(struct prng *p, uint64_t seed)
+{
+	int i, j;
+
+	for (i = 0; i < 4; ++i)
+		p->s[i] = __prng_splitmix64(&seed);
+	for (i = 0; i < 4; ++i)
+		for (j = 0; j < PRNG_LANES; ++j)
+			p->v[i][j] = __prng_splitmix64(&seed);
+}
+
+static inline void __prng_fill_lanes(struct prng *p, uint8_t *buf, size_t len)
+{
+	uint64_t s0[PRNG_LANES], s1[PRNG_LANES], s2[PRNG_LANES], s3[PRNG_LANES];
+	uint64_t out[PRNG_LANES], t;
+	int j;
+
+	/* Local state, buf could alias it otherwise */
+	fmemcpy(s0, p->v[0], sizeof(s0));
+	fmemcpy(s1, p->v[1], sizeof(s1));
+	fmemcpy(s2, p->v[2], sizeof(s2));
+	fmemcpy(s3, p->v[3], sizeof(s3));
+
+	for (; len >= sizeof(out); buf += sizeof(out), len -= sizeof(out)) {
+		for (j = 0; j < PRNG_LANES; ++j) {
+			out[j] = __prng_rotl(s1[j] * 5, 7) * 9;
+			t = s1[j] << 17;
+
+			s2[j] ^= s0[j];
+			s3[j] ^= s1[j];
+			s1[j] ^= s2[j];
+			s0[j] ^= s3[j];
+			s2[j] ^= t;
+			s3[j] = __prng_rotl(s3[j], 45);
+		}
+
+		fmemcpy(buf, out, sizeof(out));
+	}
+
+	fmemcpy(p->v[0], s0, sizeof(s0));
+	fmemcpy(p->v[1], s1, sizeof(s1));
+	fmemcpy(p->v[2], s2, sizeof(s2));
+	fmemcpy(p->v[3], s3, sizeof(s3));
+}
+
+static inline void prng_fill(struct prng *p, uint8_t *buf, size_t len)
+{
+	uint64_t val;
+	size_t n;
+
+	if (len >= PRNG_LANES * sizeof(val)) {
+		n = len & ~(PRNG_LANES * sizeof(val) - 1);
+
+		__prng_fill_lanes(p, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	for (; len >= sizeof(val); buf += sizeof(val), len -= sizeof(val)) {
+		val = prng_u64(p);
+		fmemcpy(buf, &val, sizeof(val));
+	}
+
+	if (len > 0) {
+		val = prng_u64(p);
+		fmemcpy(buf, &val, len);
+	}
+}
+
+#endif /* PRNG_H */
@@ -0,0 +1,105 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#include "rec_queue.h"
+#include "xmalloc.h"
+#include "built_in.h"
+
+void rec_queue_init(struct rec_queue *q, size_t size, size_t len_max)
+{
+	fmemset(q, 0, sizeof(*q));
+
+	bug_on(size & (size - 1));
+
+	q->size = size;
+	q->resume = size / 2;
+	/* A full queue must have room for a record once it drained. */
+	bug_on(2 * round_up_cacheline(len_max) > q->size - q->resume);
+
+	q->buf = xmalloc_aligned(size, CO_CACHE_LINE_SIZE);
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->more, NULL);
+	pthread_cond_init(&q->room, NULL);
+}
+
+void rec_queue_destroy(struct rec_queue *q)
+{
+	pthread_cond_destroy(&q->room);
+	pthread_cond_destroy(&q->more);
+	pthread_mutex_destroy(&q->lock);
+
+	xfree(q->buf);
+}
+
+/* Producer: sleeps until the queue drained, false if the consumer quit */
+bool rec_queue_wait_room(struct rec_queue *q)
+{
+	bool gone;
+
+	pthread_mutex_lock(&q->lock);
+
+	q->wait_room = true;
+	/* Pairs with the barrier in rec_queue_pop(). */
+	__sync_synchronize();
+
+	while (q->head - q->tail > q->resume && !q->gone)
+		pthread_cond_wait(&q->room, &q->lock);
+
+	q->wait_room = false;
+	gone = q->gone;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return !gone;
+}
+
+/* Consumer: sleeps until there is a record, false once closed and empty */
+bool rec_queue_wait_more(struct rec_queue *q)
+{
+	bool more;
+
+	pthread_mutex_lock(&q->lock);
+
+	q->wait_more = true;
+	/* Pairs with the barrier in rec_queue_commit(). */
+	__sync_synchronize();
+
+	while (q->head == q->ctail && !q->done)
+		pthread_cond_wait(&q->more, &q->lock);
+
+	q->wait_more = false;
+	more = q->head != q->ctail;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return more;
+}
+
+void rec_queue_signal(struct rec_queue *q, pthread_cond_t *cond)
+{
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Producer: no more records, the consumer stops once it drained them */
+void rec_queue_close(struct rec_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->done = true;
+	pthread_cond_signal(&q->more);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Consumer: takes no more records, wakes up a waiting producer */
+void rec_queue_quit(struct rec_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->gone = true;
+	pthread_cond_signal(&q->room);
+	pthread_mutex_unlock(&q->lock);
+}
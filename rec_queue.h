@@ -0,0 +1,123 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef REC_QUEUE_H
+#define REC_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "built_in.h"
+
+/*
+ * Single producer, single consumer queue of variable sized records in a
+ * power of two sized buffer. Every record starts with its uint32_t size,
+ * which the queue fills in on commit, a size of 0 tells the consumer to
+ * continue at the buffer start. Whichever side finds the queue empty
+ * resp. full sets its wait flag and sleeps on the condition variable,
+ * the other side signals it after moving head resp. tail. A producer
+ * that found the queue full sleeps until it drained to half its size.
+ */
+struct rec_queue {
+	uint8_t *buf;
+	size_t size, resume;
+	pthread_mutex_t lock;
+	pthread_cond_t more, room;
+	volatile bool done, gone, wait_more, wait_room;
+	volatile unsigned long head __cacheline_aligned;
+	/* Producer private, where the reserved record starts */
+	unsigned long next;
+	volatile unsigned long tail __cacheline_aligned;
+	/* Consumer private, how far it got and the last head it saw */
+	unsigned long ctail, chead;
+};
+
+extern void rec_queue_init(struct rec_queue *q, size_t size, size_t len_max);
+extern void rec_queue_destroy(struct rec_queue *q);
+extern bool rec_queue_wait_room(struct rec_queue *q);
+extern bool rec_queue_wait_more(struct rec_queue *q);
+extern void rec_queue_signal(struct rec_queue *q, pthread_cond_t *cond);
+extern void rec_queue_close(struct rec_queue *q);
+extern void rec_queue_quit(struct rec_queue *q);
+
+/* Room for a record of up to len bytes, NULL if the consumer quit */
+static inline void *rec_queue_reserve(struct rec_queue *q, size_t len)
+{
+	unsigned long head = q->head, pos = head & (q->size - 1);
+	size_t size = round_up_cacheline(len);
+	size_t skip = pos + size > q->size ? q->size - pos : 0;
+
+	if (head + skip + size - q->tail > q->size && !rec_queue_wait_room(q))
+		return NULL;
+
+	if (skip) {
+		*(uint32_t *) (q->buf + pos) = 0;
+		head += skip;
+		pos = 0;
+	}
+
+	q->next = head;
+
+	return q->buf + pos;
+}
+
+/* Hands the reserved record, now len bytes, over to the consumer */
+static inline void rec_queue_commit(struct rec_queue *q, void *rec,
+				    size_t len)
+{
+	uint32_t size = round_up_cacheline(len);
+
+	*(uint32_t *) rec = size;
+
+	/* Record content must be visible before the consumer may see it. */
+	__sync_synchronize();
+	q->head = q->next + size;
+
+	/* Pairs with the barrier in rec_queue_wait_more(). */
+	__sync_synchronize();
+	if (unlikely(q->wait_more))
+		rec_queue_signal(q, &q->more);
+}
+
+/* The oldest record, NULL if the queue is empty right now */
+static inline void *rec_queue_peek(struct rec_queue *q)
+{
+	unsigned long pos;
+
+	while (1) {
+		if (q->ctail == q->chead) {
+			q->chead = q->head;
+			if (q->ctail == q->chead)
+				return NULL;
+			/* Record content is read after the head. */
+			__sync_synchronize();
+		}
+
+		pos = q->ctail & (q->size - 1);
+		if (*(uint32_t *) (q->buf + pos))
+			return q->buf + pos;
+
+		q->ctail += q->size - pos;
+	}
+}
+
+/* Done with the record from rec_queue_peek(), the producer may reuse it */
+static inline void rec_queue_pop(struct rec_queue *q, void *rec)
+{
+	q->ctail += *(uint32_t *) rec;
+
+	__sync_synchronize();
+	q->tail = q->ctail;
+
+	/* Pairs with the barrier in rec_queue_wait_room(). */
+	__sync_synchronize();
+	if (unlikely(q->wait_room) && q->head - q->ctail <= q->resume)
+		rec_queue_signal(q, &q->room);
+}
+
+#endif /* REC_QUEUE_H */
@@ -0,0 +1,297 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
+
+#include "rewrite.h"
+#include "pkt_off.h"
+#include "bpf.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "built_in.h"
+#include "die.h"
+
+static const struct {
+	const char *name;
+	size_t len;
+} rw_fields[] = {
+	[RW_ETH_DST]	=	{ "eth.dst",	6 },
+	[RW_ETH_SRC]	=	{ "eth.src",	6 },
+	[RW_VLAN_ID]	=	{ "vlan.id",	2 },
+	[RW_IP_SRC]	=	{ "ip.src",	4 },
+	[RW_IP_DST]	=	{ "ip.dst",	4 },
+	[RW_IP_TTL]	=	{ "ip.ttl",	1 },
+	[RW_L4_SPORT]	=	{ "l4.sport",	2 },
+	[RW_L4_DPORT]	=	{ "l4.dport",	2 },
+};
+
+static void rewrite_parse_value(struct rw_rule *r, const char *str, int line)
+{
+	unsigned long val;
+	char *end;
+
+	if (r->action == RW_INC) {
+		r->step = strtoll(str, &end, 0);
+		if (*end == ':')
+			r->count = strtoull(end + 1, &end, 0);
+		if (*end != 0 || r->step == 0)
+			panic("Rewrite line %d: bad step %s!\n", line, str);
+		return;
+	}
+
+	switch (r->field) {
+	case RW_ETH_DST:
+	case RW_ETH_SRC:
+		if (!ether_aton_r(str, (struct ether_addr *) r->value))
+			panic("Rewrite line %d: bad MAC %s!\n", line, str);
+		return;
+	case RW_IP_SRC:
+	case RW_IP_DST:
+		if (inet_pton(AF_INET, str, r->value) != 1)
+			panic("Rewrite line %d: bad IPv4 address %s!\n", line, str);
+		return;
+	default:
+		break;
+	}
+
+	val = strtoul(str, &end, 0);
+	if (*end != 0)
+		panic("Rewrite line %d: bad value %s!\n", line, str);
+
+	switch (r->field) {
+	case RW_VLAN_ID:
+		if (val > 4095)
+			panic("Rewrite line %d: VLAN id out of range!\n", line);
+		r->value[0] = val >> 8;
+		r->value[1] = val & 0xff;
+		break;
+	case RW_IP_TTL:
+		if (val > 255)
+			panic("Rewrite line %d: TTL out of range!\n", line);
+		r->value[0] = val;
+		break;
+	default:
+		if (val > 65535)
+			panic("Rewrite line %d: port out of range!\n", line);
+		r->value[0] = val >> 8;
+		r->value[1] = val & 0xff;
+		break;
+	}
+}
+
+void rewrite_init(struct rewrite *rw, const char *file, uint32_t link_type)
+{
+	int line = 0;
+	size_t i;
+	char buff[1024], action[16], field[16], value[64], *expr;
+	FILE *fp;
+
+	fmemset(rw, 0, sizeof(*rw));
+	rw->link_type = link_type;
+
+	if (link_type != LINKTYPE_EN10MB)
+		panic("Rewrite rules need Ethernet frames!\n");
+
+	fp = fopen(file, "r");
+	if (!fp)
+		panic("Cannot open rewrite rules %s!\n", file);
+
+	while (fgets(buff, sizeof(buff), fp) != NULL) {
+		struct rw_rule *r;
+		int n = 0, ret;
+
+		line++;
+		buff[strcspn(buff, "#\n")] = 0;
+
+		ret = sscanf(buff, "%15s %15s %63s %n", action, field, value, &n);
+		/* Blank or comment only */
+		if (ret == EOF)
+			continue;
+		if (ret < 3)
+			panic("Rewrite line %d: expected <action> <field> <value>!\n",
+			      line);
+
+		rw->rules = xrealloc(rw->rules, rw->nr + 1, sizeof(*rw->rules));
+		r = &rw->rules[rw->nr++];
+		fmemset(r, 0, sizeof(*r));
+
+		if (!strcmp(action, "set"))
+			r->action = RW_SET;
+		else if (!strcmp(action, "inc"))
+			r->action = RW_INC;
+		else
+			panic("Rewrite line %d: unknown action %s!\n", line, action);
+
+		for (i = 0; i < array_size(rw_fields); ++i)
+			if (!strcmp(field, rw_fields[i].name))
+				break;
+		if (i == array_size(rw_fields))
+			panic("Rewrite line %d: unknown field %s!\n", line, field);
+		r->field = i;
+
+		rewrite_parse_value(r, value, line);
+
+		expr = buff + n;
+		if (!strncmp(expr, "if ", strlen("if "))) {
+			expr += strlen("if ");
+			while (isspace(*expr))
+				expr++;
+
+			r->match = true;
+			bpf_parse_rules(expr, &r->bpf, link_type);
+		} else if (*expr) {
+			panic("Rewrite line %d: trailing garbage %s!\n", line, expr);
+		}
+	}
+
+	fclose(fp);
+
+	if (rw->nr == 0)
+		panic("No rewrite rules in %s!\n", file);
+}
+
+void rewrite_destroy(struct rewrite *rw)
+{
+	size_t i;
+
+	for (i = 0; i < rw->nr; ++i)
+		if (rw->rules[i].match)
+			bpf_release(&rw->rules[i].bpf);
+
+	xfree(rw->rules);
+}
+
+/* New value of the field: the configured one, or old + step * seq */
+static void rewrite_value(struct rw_rule *r, const uint8_t *old, uint8_t *new,
+			  size_t len)
+{
+	uint64_t val = 0, seq;
+	size_t i;
+
+	if (r->action == RW_SET) {
+		fmemcpy(new, r->value, len);
+		return;
+	}
+
+	/* Parallel TX workers share the rules, each frame takes its own seq. */
+	seq = __sync_fetch_and_add(&r->seq, 1);
+	if (r->count)
+		seq %= r->count;
+
+	for (i = 0; i < len; ++i)
+		val = (val << 8) | old[i];
+
+	val += r->step * (int64_t) seq;
+
+	for (i = len; i > 0; --i, val >>= 8)
+		new[i - 1] = val & 0xff;
+}
+
+static void rewrite_rule(struct rw_rule *r, const struct pkt_off *o,
+			 uint8_t *frame)
+{
+	uint8_t old[6], new[6], *ptr;
+	size_t len = rw_fields[r->field].len;
+
+	switch (r->field) {
+	case RW_ETH_DST:
+		rewrite_value(r, frame, frame, len);
+		break;
+	case RW_ETH_SRC:
+		rewrite_value(r, frame + 6, frame + 6, len);
+		break;
+	case RW_VLAN_ID:
+		if (!o->vlan_off)
+			return;
+
+		ptr = frame + o->vlan_off;
+		old[0] = ptr[0] & 0x0f;
+		old[1] = ptr[1];
+		rewrite_value(r, old, new, len);
+		/* Priority and DEI bits stay as they are. */
+		ptr[0] = (ptr[0] & 0xf0) | (new[0] & 0x0f);
+		ptr[1] = new[1];
+		break;
+	case RW_IP_SRC:
+	case RW_IP_DST:
+		if (o->family != AF_INET)
+			return;
+
+		ptr = frame + o->l3_off + (r->field == RW_IP_SRC ? 12 : 16);
+		fmemcpy(old, ptr, len);
+		rewrite_value(r, old, new, len);
+		fmemcpy(ptr, new, len);
+
+		pkt_off_ip_csum(o, frame, old, new, len);
+		pkt_off_l4_csum(o, frame, old, new, len);
+		break;
+	case RW_IP_TTL:
+		if (o->family == AF_INET6) {
+			ptr = frame + o->l3_off + 7;
+			rewrite_value(r, ptr, ptr, len);
+			return;
+		}
+		if (o->family != AF_INET)
+			return;
+
+		/* TTL shares its checksum word with the protocol. */
+		ptr = frame + o->l3_off + 8;
+		fmemcpy(old, ptr, 2);
+		new[1] = old[1];
+		rewrite_value(r, old, new, len);
+		ptr[0] = new[0];
+
+		pkt_off_ip_csum(o, frame, old, new, 2);
+		break;
+	case RW_L4_SPORT:
+	case RW_L4_DPORT:
+		if (!o->l4_off)
+			return;
+
+		ptr = frame + o->l4_off + (r->field == RW_L4_SPORT ? 0 : 2);
+		fmemcpy(old, ptr, len);
+		rewrite_value(r, old, new, len);
+		fmemcpy(ptr, new, len);
+
+		pkt_off_l4_csum(o, frame, old, new, len);
+		break;
+	}
+}
+
+void rewrite_apply(struct rewrite *rw, uint8_t *frame, size_t len)
+{
+	size_t i;
+	bool parsed = false, hit = false;
+	struct pkt_off o;
+
+	if (unlikely(len < ETH_HLEN))
+		return;
+
+	for (i = 0; i < rw->nr; ++i) {
+		struct rw_rule *r = &rw->rules[i];
+
+		if (r->match && !bpf_run_filter(&r->bpf, frame, len))
+			continue;
+
+		/* Rules never move headers, so one parse is good for all. */
+		if (!parsed) {
+			pkt_off_parse(&o, frame, len, rw->link_type);
+			parsed = true;
+		}
+
+		rewrite_rule(r, &o, frame);
+		hit = true;
+	}
+
+	if (hit)
+		__sync_add_and_fetch(&rw->rewritten, 1);
+}
@@ -0,0 +1,65 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/filter.h>
+
+/*
+ * In-place rewrite of frames on their way out. Rules are read from a
+ * file, one per line:
+ *
+ *   set <field> <value> [if <bpf-file|expr>]
+ *   inc <field> <step>[:<count>] [if <bpf-file|expr>]
+ *
+ * with fields eth.src, eth.dst, vlan.id, ip.src, ip.dst, ip.ttl,
+ * l4.sport and l4.dport. inc adds step * n to the original value of
+ * the n-th matching frame, n wraps at count if given. IP and TCP/UDP
+ * checksums are updated incrementally (RFC 1624).
+ */
+
+enum rw_action {
+	RW_SET,
+	RW_INC,
+};
+
+enum rw_field {
+	RW_ETH_DST,
+	RW_ETH_SRC,
+	RW_VLAN_ID,
+	RW_IP_SRC,
+	RW_IP_DST,
+	RW_IP_TTL,
+	RW_L4_SPORT,
+	RW_L4_DPORT,
+};
+
+struct rw_rule {
+	enum rw_action action;
+	enum rw_field field;
+	uint8_t value[6];
+	int64_t step;
+	uint64_t count, seq;
+	bool match;
+	struct sock_fprog bpf;
+};
+
+struct rewrite {
+	struct rw_rule *rules;
+	size_t nr;
+	uint32_t link_type;
+	unsigned long rewritten;
+};
+
+extern void rewrite_init(struct rewrite *rw, const char *file,
+			 uint32_t link_type);
+extern void rewrite_apply(struct rewrite *rw, uint8_t *frame, size_t len);
+extern void rewrite_destroy(struct rewrite *rw);
+
+#endif /* REWRITE_H */
@@ -33,6 +33,18 @@
 # define PACKET_FANOUT_POLICY_DEFAULT	PACKET_FANOUT_HASH
 #endif
 
+#ifndef PACKET_FANOUT_HASH
+# define PACKET_FANOUT_HASH		0
+#endif
+
+#ifndef PACKET_IGNORE_OUTGOING
+# define PACKET_IGNORE_OUTGOING		23
+#endif
+
+#ifndef PACKET_QDISC_BYPASS
+# define PACKET_QDISC_BYPASS		20
+#endif
+
 struct frame_map {
 	struct tpacket2_hdr tp_h __aligned_tpacket;
 	struct sockaddr_ll s_ll __align_tpacket(sizeof(struct tpacket2_hdr));
@@ -122,10 +134,26 @@ static inline void set_sockopt_fanout(int sock, unsigned int fanout_id,
 		panic("No packet fanout support!\n");
 }
 
+static inline int set_sockopt_qdisc_bypass(int sock)
+{
+	int val = 1;
+
+	/* Only a fast path, older kernels just keep using the qdisc layer. */
+	return setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &val,
+			  sizeof(val));
+}
+
 static inline void set_sockopt_tpacket(int sock)
 {
 	int ret, val = TPACKET_V2;
+	socklen_t len = sizeof(val);
+
+	/* Already set up if the socket carries a ring of the other kind. */
+	ret = getsockopt(sock, SOL_PACKET, PACKET_VERSION, &val, &len);
+	if (ret == 0 && val == TPACKET_V2)
+		return;
 
+	val = TPACKET_V2;
 	ret = setsockopt(sock, SOL_PACKET, PACKET_VERSION, &val, sizeof(val));
 	if (ret)
 		panic("Cannot set tpacketv2!\n");
@@ -9,7 +9,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -115,10 +118,26 @@ void alloc_tx_ring_frames(struct ring *ring)
 	}
 }
 
-void bind_tx_ring(int sock, struct ring *ring, int ifindex)
+/*
+ * With both rings set up on one socket, the kernel places the TX ring
+ * right behind the RX ring, so a single mapping covers both.
+ */
+void mmap_rx_tx_ring(int sock, struct ring *rx_ring, struct ring *tx_ring)
 {
-	int ret;
+	uint8_t *mm_space;
+
+	mm_space = mmap(0, rx_ring->mm_len + tx_ring->mm_len,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_LOCKED | MAP_POPULATE, sock, 0);
+	if (mm_space == MAP_FAILED)
+		panic("Cannot mmap RX/TX_RING!\n");
+
+	rx_ring->mm_space = mm_space;
+	tx_ring->mm_space = mm_space + rx_ring->mm_len;
+}
 
+void set_tx_ring_dest(struct ring *ring, int ifindex)
+{
 	fmemset(&ring->s_ll, 0, sizeof(ring->s_ll));
 
 	ring->s_ll.sll_family = AF_PACKET;
@@ -127,6 +146,13 @@ void bind_tx_ring(int sock, struct ring *ring, int ifindex)
 	ring->s_ll.sll_hatype = 0;
 	ring->s_ll.sll_halen = 0;
 	ring->s_ll.sll_pkttype = 0;
+}
+
+void bind_tx_ring(int sock, struct ring *ring, int ifindex)
+{
+	int ret;
+
+	set_tx_ring_dest(ring, ifindex);
 
 	ret = bind(sock, (struct sockaddr *) &ring->s_ll, sizeof(ring->s_ll));
 	if (ret < 0) {
@@ -134,3 +160,91 @@ void bind_tx_ring(int sock, struct ring *ring, int ifindex)
 		panic("Cannot bind TX_RING!\n");
 	}
 }
+
+static void *tx_flush_timer_loop(void *arg)
+{
+	ssize_t ret;
+	uint64_t expired;
+	struct tx_flush *f = arg;
+
+	while (!f->stop) {
+		ret = read(f->tfd, &expired, sizeof(expired));
+		if (ret < 0 && errno != EINTR)
+			panic("Cannot read flush timer: %s\n", strerror(errno));
+
+		/* The producer may have kicked on its own in the meantime. */
+		if (ret > 0 && f->armed && !f->stop) {
+			if (f->dest)
+				pull_and_flush_tx_ring_to(f->sock, f->dest);
+			else
+				pull_and_flush_tx_ring(f->sock);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+void tx_flush_timer_start(struct tx_flush *f)
+{
+	int ret;
+
+	f->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (f->tfd < 0)
+		panic("Cannot create flush timer: %s\n", strerror(errno));
+
+	f->armed = f->stop = false;
+
+	ret = pthread_create(&f->timer, NULL, tx_flush_timer_loop, f);
+	if (ret)
+		panic("Thread creation failed!\n");
+}
+
+/* One shot, runs off at the deadline of the oldest pending frame */
+void tx_flush_timer_arm(struct tx_flush *f)
+{
+	struct itimerspec its;
+
+	fmemset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = f->deadline / NSEC_PER_SEC;
+	its.it_value.tv_nsec = f->deadline % NSEC_PER_SEC;
+
+	f->armed = true;
+	/* Pairs with the check of armed in tx_flush_timer_loop(). */
+	__sync_synchronize();
+
+	if (timerfd_settime(f->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		panic("Cannot arm flush timer: %s\n", strerror(errno));
+}
+
+void tx_flush_timer_disarm(struct tx_flush *f)
+{
+	struct itimerspec its;
+
+	f->armed = false;
+	__sync_synchronize();
+
+	fmemset(&its, 0, sizeof(its));
+	if (timerfd_settime(f->tfd, 0, &its, NULL) < 0)
+		panic("Cannot disarm flush timer: %s\n", strerror(errno));
+}
+
+void tx_flush_timer_stop(struct tx_flush *f)
+{
+	struct itimerspec its;
+
+	if (f->tfd < 0)
+		return;
+
+	f->stop = true;
+	__sync_synchronize();
+
+	/* Fire right away, so the thread wakes up and sees stop. */
+	fmemset(&its, 0, sizeof(its));
+	its.it_value.tv_nsec = 1;
+	timerfd_settime(f->tfd, 0, &its, NULL);
+
+	pthread_join(f->timer, NULL);
+
+	close(f->tfd);
+	f->tfd = -1;
+}
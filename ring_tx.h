@@ -7,24 +7,76 @@
 #ifndef TX_RING_H
 #define TX_RING_H
 
+#include <pthread.h>
+
 #include "ring.h"
 #include "built_in.h"
+#include "xtime.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 /* Give userland 10 us time to push packets to the ring */
 #define TX_KERNEL_PULL_INT	10
+/* ... or kick the kernel once that many frames are queued */
+#define TX_FLUSH_BATCH		64
+
+/*
+ * Flush policy driven by the producer loop itself: the kernel is kicked
+ * once batch frames are pending or the oldest pending frame waited for
+ * the timeout. Producers must tx_flush_kick() before they block or spin
+ * on a full ring. Producers that may block where they cannot kick, e.g.
+ * in a read from a pipe, start the timer thread and tx_flush_may_block()
+ * before such a read, the thread then kicks at the deadline for them.
+ */
+struct tx_flush {
+	int sock;
+	const struct sockaddr_ll *dest;
+	unsigned int batch, pending;
+	uint64_t timeout, deadline;
+	unsigned long kicks, frames;
+	/* Optional timer thread, see tx_flush_timer_start() */
+	int tfd;
+	pthread_t timer;
+	volatile bool armed, stop;
+};
+
+/*
+ * Token bucket pacing on an absolute schedule: the n-th unit is due at
+ * start + n / rate, so rounding errors never add up over a long run.
+ * While the producer is late, e.g. spinning on a full ring, at most
+ * TX_RATE_BURST_NS worth of credit builds up. Times are taken from
+ * CLOCK_MONOTONIC_RAW, which NTP does not slew.
+ */
+#define TX_RATE_BURST_NS	(200 * NSEC_PER_USEC)
+
+struct tx_rate {
+	/* Packets or bytes per second, 0 means unlimited */
+	uint64_t rate;
+	bool bytes;
+	uint64_t start, units;
+};
 
 extern void destroy_tx_ring(int sock, struct ring *ring);
 extern void create_tx_ring(int sock, struct ring *ring, int verbose);
 extern void mmap_tx_ring(int sock, struct ring *ring);
 extern void alloc_tx_ring_frames(struct ring *ring);
 extern void bind_tx_ring(int sock, struct ring *ring, int ifindex);
+extern void set_tx_ring_dest(struct ring *ring, int ifindex);
+extern void mmap_rx_tx_ring(int sock, struct ring *rx_ring,
+			    struct ring *tx_ring);
 extern void setup_tx_ring_layout(int sock, struct ring *ring,
 				 unsigned int size, int jumbo_support);
 extern void set_packet_loss_discard(int sock);
+extern void tx_flush_timer_start(struct tx_flush *f);
+extern void tx_flush_timer_stop(struct tx_flush *f);
+extern void tx_flush_timer_arm(struct tx_flush *f);
+extern void tx_flush_timer_disarm(struct tx_flush *f);
 
 static inline int user_may_pull_from_tx(struct tpacket2_hdr *hdr)
 {
-	return ((hdr->tp_status & TP_STATUS_AVAILABLE) == TP_STATUS_AVAILABLE);
+	return !(hdr->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING));
 }
 
 static inline void kernel_may_pull_from_tx(struct tpacket2_hdr *hdr)
@@ -37,4 +89,132 @@ static inline int pull_and_flush_tx_ring(int sock)
 	return sendto(sock, NULL, 0, MSG_DONTWAIT, NULL, 0);
 }
 
+static inline int pull_and_flush_tx_ring_wait(int sock)
+{
+	return sendto(sock, NULL, 0, 0, NULL, 0);
+}
+
+/* For a TX ring on a socket that is bound to another device */
+static inline int pull_and_flush_tx_ring_to(int sock,
+					    const struct sockaddr_ll *dest)
+{
+	return sendto(sock, NULL, 0, MSG_DONTWAIT,
+		      (const struct sockaddr *) dest, sizeof(*dest));
+}
+
+/*
+ * Copies a frame into a TX slot. Large frames bypass the cache with
+ * non-temporal stores, so a busy forwarder does not evict the RX ring
+ * it is about to read next.
+ */
+#define TX_COPY_NT_MIN		512
+
+static inline void tx_frame_copy(uint8_t *out, const uint8_t *in, size_t len)
+{
+#if defined(__SSE2__)
+	if (len >= TX_COPY_NT_MIN && ((uintptr_t) out & 15) == 0) {
+		size_t i;
+
+		for (i = 0; i + 16 <= len; i += 16)
+			_mm_stream_si128((__m128i *) (out + i),
+					 _mm_loadu_si128((const __m128i *) (in + i)));
+		fmemcpy(out + i, in + i, len - i);
+		_mm_sfence();
+		return;
+	}
+#endif
+	fmemcpy(out, in, len);
+}
+
+static inline void tx_flush_init(struct tx_flush *f, int sock,
+				 struct ring *ring, unsigned long timeout_us)
+{
+	fmemset(f, 0, sizeof(*f));
+
+	f->sock = sock;
+	f->batch = min((unsigned int) TX_FLUSH_BATCH,
+		       max(ring->layout.tp_frame_nr / 2, 1U));
+	f->timeout = (timeout_us ? : TX_KERNEL_PULL_INT) * NSEC_PER_USEC;
+	f->tfd = -1;
+}
+
+static inline void tx_flush_kick(struct tx_flush *f)
+{
+	if (f->pending == 0)
+		return;
+
+	if (f->armed)
+		tx_flush_timer_disarm(f);
+
+	if (f->dest)
+		pull_and_flush_tx_ring_to(f->sock, f->dest);
+	else
+		pull_and_flush_tx_ring(f->sock);
+
+	f->kicks++;
+	f->frames += f->pending;
+	f->pending = 0;
+}
+
+static inline void tx_flush_queued(struct tx_flush *f)
+{
+	uint64_t now = time_now_ns();
+
+	if (f->pending++ == 0)
+		f->deadline = now + f->timeout;
+
+	if (f->pending >= f->batch || now >= f->deadline)
+		tx_flush_kick(f);
+}
+
+/* Before a read that may block with frames pending */
+static inline void tx_flush_may_block(struct tx_flush *f)
+{
+	if (f->pending && f->tfd >= 0 && !f->armed)
+		tx_flush_timer_arm(f);
+}
+
+/* For producers that wait: kicks if the oldest pending frame timed out */
+static inline void tx_flush_expire(struct tx_flush *f)
+{
+	if (f->pending && time_now_ns() >= f->deadline)
+		tx_flush_kick(f);
+}
+
+static inline uint64_t tx_rate_now(void)
+{
+	return xclock_ns(CLOCK_MONOTONIC_RAW);
+}
+
+static inline void tx_rate_init(struct tx_rate *r, uint64_t rate, bool bytes)
+{
+	fmemset(r, 0, sizeof(*r));
+
+	r->rate = rate;
+	r->bytes = bytes;
+	r->start = tx_rate_now();
+}
+
+/* Books a frame of len bytes and returns when it is due */
+static inline uint64_t tx_rate_due(struct tx_rate *r, size_t len, uint64_t now)
+{
+	uint64_t due = r->start + (r->units / r->rate) * NSEC_PER_SEC +
+		       (r->units % r->rate) * NSEC_PER_SEC / r->rate;
+
+	if (now > due + TX_RATE_BURST_NS) {
+		r->start += now - TX_RATE_BURST_NS - due;
+		due = now - TX_RATE_BURST_NS;
+	}
+
+	r->units += r->bytes ? len : 1;
+
+	return due;
+}
+
+static inline void tx_flush_print(struct tx_flush *f)
+{
+	printf("\r%12lu kernel kicks, %.1lf frames per kick\n", f->kicks,
+	       f->kicks ? 1.0 * f->frames / f->kicks : 0.0);
+}
+
 #endif /* TX_RING_H */
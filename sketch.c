@@ -0,0 +1,295 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sketch.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "built_in.h"
+#include "die.h"
+
+static const char *hh_key_names[] = {
+	[FLOW_KEY_SRC]		=	"src",
+	[FLOW_KEY_DST]		=	"dst",
+	[FLOW_KEY_5TUPLE]	=	"flow",
+	[FLOW_KEY_NET24]	=	"net24",
+};
+
+int hh_parse_key_type(const char *str, enum flow_key_type *type)
+{
+	int i;
+	/* The key may be followed by :<k> */
+	size_t len = strcspn(str, ":");
+
+	for (i = 0; i < array_size(hh_key_names); ++i) {
+		if (len == strlen(hh_key_names[i]) &&
+		    !strncmp(str, hh_key_names[i], len)) {
+			*type = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void hh_sketch_init(struct hh_sketch *s, enum flow_key_type type, uint32_t k)
+{
+	uint32_t isize = 1;
+
+	if (k == 0 || k > HH_TOPK_MAX)
+		panic("Top-k must be within 1 and %u!\n", HH_TOPK_MAX);
+
+	/* Keep the index at most 50% full for short probe sequences. */
+	while (isize < 2 * k)
+		isize <<= 1;
+
+	fmemset(s, 0, sizeof(*s));
+
+	s->type = type;
+	s->k = k;
+	s->imask = isize - 1;
+
+	s->cells = xzmalloc_aligned(HH_SKETCH_DEPTH * HH_SKETCH_WIDTH *
+				    sizeof(*s->cells), CO_CACHE_LINE_SIZE);
+	s->heap = xzmalloc(k * sizeof(*s->heap));
+	s->sorted = xzmalloc(k * sizeof(*s->sorted));
+	s->index = xmalloc(isize * sizeof(*s->index));
+
+	hh_sketch_reset(s);
+}
+
+void hh_sketch_reset(struct hh_sketch *s)
+{
+	fmemset(s->cells, 0, HH_SKETCH_DEPTH * HH_SKETCH_WIDTH *
+		sizeof(*s->cells));
+	fmemset(s->index, 0xff, (s->imask + 1) * sizeof(*s->index));
+
+	s->nr = 0;
+	s->packets = s->bytes = 0;
+}
+
+void hh_sketch_destroy(struct hh_sketch *s)
+{
+	xfree(s->cells);
+	xfree(s->heap);
+	xfree(s->sorted);
+	xfree(s->index);
+}
+
+static inline void __hh_heap_swap(struct hh_sketch *s, uint32_t a, uint32_t b)
+{
+	struct hh_entry tmp = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = tmp;
+
+	s->index[s->heap[a].islot] = a;
+	s->index[s->heap[b].islot] = b;
+}
+
+static void __hh_heap_sift_up(struct hh_sketch *s, uint32_t pos)
+{
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / 2;
+
+		if (s->heap[parent].packets <= s->heap[pos].packets)
+			break;
+
+		__hh_heap_swap(s, parent, pos);
+		pos = parent;
+	}
+}
+
+static void __hh_heap_sift_down(struct hh_sketch *s, uint32_t pos)
+{
+	while (1) {
+		uint32_t l = 2 * pos + 1, r = l + 1, min = pos;
+
+		if (l < s->nr && s->heap[l].packets < s->heap[min].packets)
+			min = l;
+		if (r < s->nr && s->heap[r].packets < s->heap[min].packets)
+			min = r;
+		if (min == pos)
+			break;
+
+		__hh_heap_swap(s, pos, min);
+		pos = min;
+	}
+}
+
+static int32_t __hh_index_lookup(struct hh_sketch *s, const struct flow_key *key,
+				 uint64_t hash, uint32_t *slot)
+{
+	uint32_t i = hash & s->imask;
+
+	while (s->index[i] >= 0) {
+		struct hh_entry *e = &s->heap[s->index[i]];
+
+		if (e->hash == hash && flow_key_equal(&e->key, key))
+			break;
+
+		i = (i + 1) & s->imask;
+	}
+
+	*slot = i;
+	return s->index[i];
+}
+
+/* Backward shift deletion, so that linear probing needs no tombstones. */
+static void __hh_index_remove(struct hh_sketch *s, uint32_t slot)
+{
+	uint32_t j = slot;
+
+	while (1) {
+		uint32_t home;
+
+		s->index[slot] = -1;
+		do {
+			j = (j + 1) & s->imask;
+			if (s->index[j] < 0)
+				return;
+
+			home = s->heap[s->index[j]].hash & s->imask;
+		} while (slot <= j ? (slot < home && home <= j) :
+				     (slot < home || home <= j));
+
+		s->index[slot] = s->index[j];
+		s->heap[s->index[slot]].islot = slot;
+		slot = j;
+	}
+}
+
+void hh_sketch_update(struct hh_sketch *s, const uint8_t *packet,
+		      size_t len, uint32_t wire_len)
+{
+	int i;
+	int32_t pos;
+	uint32_t slot, h1, h2;
+	uint64_t hash, est_packets = ~0ULL, est_bytes = ~0ULL;
+	struct flow_key key;
+	struct hh_entry *e;
+
+	if (flow_key_extract(&key, s->type, packet, len) < 0)
+		return;
+
+	s->packets++;
+	s->bytes += wire_len;
+
+	hash = flow_key_hash(&key);
+	h1 = (uint32_t) hash;
+	h2 = (uint32_t) (hash >> 32) | 1;
+
+	for (i = 0; i < HH_SKETCH_DEPTH; ++i) {
+		struct hh_cell *c = &s->cells[i * HH_SKETCH_WIDTH +
+					      ((h1 + i * h2) & (HH_SKETCH_WIDTH - 1))];
+
+		c->packets++;
+		c->bytes += wire_len;
+
+		est_packets = min(est_packets, c->packets);
+		est_bytes = min(est_bytes, c->bytes);
+	}
+
+	pos = __hh_index_lookup(s, &key, hash, &slot);
+	if (pos >= 0) {
+		s->heap[pos].packets = est_packets;
+		s->heap[pos].bytes = est_bytes;
+		__hh_heap_sift_down(s, pos);
+		return;
+	}
+
+	if (s->nr < s->k) {
+		pos = s->nr++;
+	} else {
+		if (est_packets <= s->heap[0].packets)
+			return;
+
+		/* Evict the current minimum, its slot might move. */
+		__hh_index_remove(s, s->heap[0].islot);
+		__hh_index_lookup(s, &key, hash, &slot);
+		pos = 0;
+	}
+
+	e = &s->heap[pos];
+	e->key = key;
+	e->hash = hash;
+	e->packets = est_packets;
+	e->bytes = est_bytes;
+	e->islot = slot;
+
+	s->index[slot] = pos;
+
+	if (pos == 0)
+		__hh_heap_sift_down(s, pos);
+	else
+		__hh_heap_sift_up(s, pos);
+}
+
+static void __hh_key_to_str(const struct flow_key *key, enum flow_key_type type,
+			    char *buff, size_t len)
+{
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+
+	inet_ntop(key->family, key->saddr, src, sizeof(src));
+	inet_ntop(key->family, key->daddr, dst, sizeof(dst));
+
+	switch (type) {
+	case FLOW_KEY_SRC:
+		slprintf(buff, len, "%s", src);
+		break;
+	case FLOW_KEY_DST:
+		slprintf(buff, len, "%s", dst);
+		break;
+	case FLOW_KEY_NET24:
+		slprintf(buff, len, "%s/%d", src, key->family == AF_INET ? 24 : 48);
+		break;
+	case FLOW_KEY_5TUPLE:
+		slprintf(buff, len, "%s:%u -> %s:%u (%u)", src, ntohs(key->sport),
+			 dst, ntohs(key->dport), key->proto);
+		break;
+	}
+}
+
+static int __hh_entry_cmp(const void *a, const void *b)
+{
+	const struct hh_entry *ea = a, *eb = b;
+
+	if (ea->packets == eb->packets)
+		return 0;
+
+	return ea->packets < eb->packets ? 1 : -1;
+}
+
+void hh_sketch_dump(struct hh_sketch *s, unsigned long interval)
+{
+	uint32_t i;
+	char key[128];
+	struct hh_entry *sorted = s->sorted;
+
+	fmemcpy(sorted, s->heap, s->nr * sizeof(*sorted));
+	qsort(sorted, s->nr, sizeof(*sorted), __hh_entry_cmp);
+
+	printf("\nTop %u %s in %lus (%llu pkts, %llu bytes):\n", s->nr,
+	       hh_key_names[s->type], interval,
+	       (unsigned long long) s->packets,
+	       (unsigned long long) s->bytes);
+
+	for (i = 0; i < s->nr; ++i) {
+		__hh_key_to_str(&sorted[i].key, s->type, key, sizeof(key));
+
+		printf("%4u  %-50s %12llu pkts %14llu bytes %6.2lf%%\n", i + 1,
+		       key, (unsigned long long) sorted[i].packets,
+		       (unsigned long long) sorted[i].bytes,
+		       s->packets ? 100.0 * sorted[i].packets / s->packets : 0.0);
+	}
+
+	fflush(stdout);
+}
@@ -0,0 +1,62 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+#include "flow_key.h"
+
+/*
+ * Heavy-hitter detection in constant memory: a count-min sketch of
+ * depth d and width w estimates per-key packet/byte counts, and a
+ * min-heap of the k keys with the largest estimates is maintained on
+ * top of it. Nothing is allocated after hh_sketch_init().
+ *
+ * Accuracy: for N packets seen in an interval, the estimate c' for a
+ * key with true count c satisfies c <= c' <= c + (e / w) * N with a
+ * probability of at least 1 - e^-d. With the defaults below (w = 4096,
+ * d = 4) the overestimate stays below 0.07% of N with 98% probability,
+ * so every key above that share of traffic is reported, and counts are
+ * never underestimated. A key can only be missed from the top-k list
+ * if its count is within that error of the k-th entry.
+ */
+
+#define HH_SKETCH_WIDTH		4096
+#define HH_SKETCH_DEPTH		4
+#define HH_TOPK_DEFAULT		10
+#define HH_TOPK_MAX		4096
+
+struct hh_cell {
+	uint64_t packets, bytes;
+};
+
+struct hh_entry {
+	struct flow_key key;
+	uint64_t hash, packets, bytes;
+	uint32_t islot;
+};
+
+struct hh_sketch {
+	enum flow_key_type type;
+	uint32_t k, nr, imask;
+	uint64_t packets, bytes;
+	struct hh_cell *cells;
+	struct hh_entry *heap, *sorted;
+	int32_t *index;
+};
+
+extern void hh_sketch_init(struct hh_sketch *s, enum flow_key_type type,
+			   uint32_t k);
+extern void hh_sketch_update(struct hh_sketch *s, const uint8_t *packet,
+			     size_t len, uint32_t wire_len);
+extern void hh_sketch_dump(struct hh_sketch *s, unsigned long interval);
+extern void hh_sketch_reset(struct hh_sketch *s);
+extern void hh_sketch_destroy(struct hh_sketch *s);
+extern int hh_parse_key_type(const char *str, enum flow_key_type *type);
+
+#endif /* SKETCH_H */
@@ -0,0 +1,120 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * Times the old __in_cksum() from csum_ref.h against the scalar, SSE2
+ * and AVX2 kernels for typical packet sizes, with the buffer in cache.
+ *
+ * Usage: csum_bench [bytes per size and kernel, default 1 GiB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "csum.h"
+#include "csum_ref.h"
+
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t k_ref(const uint8_t *p, size_t len)
+{
+	struct cksum_vec vec = { .ptr = p, .len = len };
+
+	return ref_in_cksum(&vec, 1);
+}
+
+static uint64_t k_scalar(const uint8_t *p, size_t len)
+{
+	return __csum_add_scalar(p, len, 0);
+}
+
+#if defined(__x86_64__)
+static uint64_t k_sse2(const uint8_t *p, size_t len)
+{
+	return __csum_add_sse2(p, len, 0);
+}
+
+static uint64_t k_avx2(const uint8_t *p, size_t len)
+{
+	return __csum_add_avx2(p, len, 0);
+}
+#endif
+
+static const struct kernel {
+	const char *name;
+	uint64_t (*fn)(const uint8_t *p, size_t len);
+} kernels[] = {
+	{ "old",	k_ref },
+	{ "scalar",	k_scalar },
+#if defined(__x86_64__)
+	{ "sse2",	k_sse2 },
+	{ "avx2",	k_avx2 },
+#endif
+};
+
+/* Header sizes, small and full sized frames, jumbo frames, GSO */
+static const size_t sizes[] = { 20, 40, 64, 128, 576, 1500, 9000, 65535 };
+
+int main(int argc, char **argv)
+{
+	uint64_t bytes = argc > 1 ? strtoull(argv[1], NULL, 0) : 1ULL << 30;
+	uint64_t t0, t1, n, iters;
+	uint8_t *buf;
+	size_t i, j;
+
+	buf = malloc(sizes[array_size(sizes) - 1]);
+	if (!buf) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizes[array_size(sizes) - 1]; ++i)
+		buf[i] = rand();
+
+	printf("%8s", "bytes");
+	for (j = 0; j < array_size(kernels); ++j)
+		printf(" %16s", kernels[j].name);
+	printf("   (ns per call, GB/s)\n");
+
+	for (i = 0; i < array_size(sizes); ++i) {
+		iters = max(bytes / sizes[i], (uint64_t) 1);
+
+		printf("%8zu", sizes[i]);
+
+		for (j = 0; j < array_size(kernels); ++j) {
+#if defined(__x86_64__)
+			if (kernels[j].fn == k_avx2 && !__csum_cpu_avx2()) {
+				printf(" %16s", "n/a");
+				continue;
+			}
+#endif
+			t0 = now_ns();
+			for (n = 0; n < iters; ++n)
+				sink += kernels[j].fn(buf, sizes[i]);
+			t1 = now_ns();
+
+			printf(" %8.1lf %6.2lf", 1.0 * (t1 - t0) / iters,
+			       1.0 * iters * sizes[i] / (t1 - t0));
+		}
+
+		printf("\n");
+	}
+
+	free(buf);
+
+	return 0;
+}
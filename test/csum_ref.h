@@ -0,0 +1,162 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2010 Emmanuel Roullit.
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef CSUM_REF_H
+#define CSUM_REF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "csum.h"
+
+/*
+ * Reference checksums for csum_test and csum_bench: csum() and
+ * __in_cksum() as they were before the 64 bit and SIMD kernels, and
+ * a plain word by word sum. The old code keeps its sums in 32 bits,
+ * so it is only exact up to 64 KiB.
+ */
+#define REF_OLD_LEN_MAX		65535
+
+static inline uint16_t ref_csum_words(const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0;
+	uint8_t last[2] = { 0, 0 };
+	uint16_t w;
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		fmemcpy(&w, p + i, sizeof(w));
+		sum += w;
+	}
+
+	if (len & 1) {
+		last[0] = p[len - 1];
+		fmemcpy(&w, last, sizeof(w));
+		sum += w;
+	}
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum & 0xffff;
+}
+
+static inline unsigned short ref_csum(unsigned short *buf, int nwords)
+{
+	unsigned long sum;
+
+	for (sum = 0; nwords > 0; nwords--)
+		sum += *buf++;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+
+	return ~sum;
+}
+
+/* Taken and modified from tcpdump, Copyright belongs to them! */
+
+#define ADDCARRY(x)		\
+	do { if ((x) > 65535)	\
+		(x) -= 65535;	\
+	} while (0)
+
+#define REDUCE						\
+	do {						\
+		l_util.l = sum;				\
+		sum = l_util.s[0] + l_util.s[1];	\
+		ADDCARRY(sum);				\
+	} while (0)
+
+static inline u16 ref_in_cksum(const struct cksum_vec *vec, int veclen)
+{
+	const u16 *w;
+	int sum = 0, mlen = 0;
+	int byte_swapped = 0;
+	union {
+		u8 c[2];
+		u16 s;
+	} s_util;
+	union {
+		u16 s[2];
+		u32 l;
+	} l_util;
+
+	for (; veclen != 0; vec++, veclen--) {
+		if (vec->len == 0)
+			continue;
+
+		w = (const u16 *) (void *) vec->ptr;
+
+		if (mlen == -1) {
+			s_util.c[1] = *(const u8 *) w;
+			sum += s_util.s;
+			w = (const u16 *) (void *) ((const u8 *) w + 1);
+			mlen = vec->len - 1;
+		} else
+			mlen = vec->len;
+
+		if ((1 & (unsigned long) w) && (mlen > 0)) {
+			REDUCE;
+			sum <<= 8;
+			s_util.c[0] = *(const u8 *) w;
+			w = (const u16 *) (void *) ((const u8 *) w + 1);
+			mlen--;
+			byte_swapped = 1;
+		}
+
+		while ((mlen -= 32) >= 0) {
+			sum +=  w[0]; sum +=  w[1]; sum +=  w[2]; sum +=  w[3];
+			sum +=  w[4]; sum +=  w[5]; sum +=  w[6]; sum +=  w[7];
+			sum +=  w[8]; sum +=  w[9]; sum += w[10]; sum += w[11];
+			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+			w += 16;
+		}
+
+		mlen += 32;
+
+		while ((mlen -= 8) >= 0) {
+			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+			w += 4;
+		}
+
+		mlen += 8;
+
+		if (mlen == 0 && byte_swapped == 0)
+			continue;
+
+		REDUCE;
+
+		while ((mlen -= 2) >= 0) {
+			sum += *w++;
+		}
+
+		if (byte_swapped) {
+			REDUCE;
+			sum <<= 8;
+			byte_swapped = 0;
+
+			if (mlen == -1) {
+				s_util.c[1] = *(const u8 *) w;
+				sum += s_util.s;
+				mlen = 0;
+			} else
+				mlen = -1;
+		} else if (mlen == -1)
+			s_util.c[0] = *(const u8 *) w;
+	}
+
+	if (mlen == -1) {
+		s_util.c[1] = 0;
+		sum += s_util.s;
+	}
+
+	REDUCE;
+
+	return (~sum & 0xffff);
+}
+
+#endif /* CSUM_REF_H */
@@ -0,0 +1,189 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+/*
+ * Checks the scalar, SSE2 and AVX2 checksum kernels, csum(), and
+ * __in_cksum() against the reference code in csum_ref.h, over all
+ * lengths up to a few vector blocks, all alignments within a cache
+ * line, lengths around the SIMD lane overflow limit, and random
+ * splits into odd and even sized vectors.
+ *
+ * Usage: csum_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "csum.h"
+#include "csum_ref.h"
+
+#define LEN_ALL		(4 * CSUM_SIMD_MIN + 64)
+#define ALIGN_MAX	64
+#define SPLITS		200000
+#define VEC_MAX		6
+
+static unsigned long checks, failures;
+
+static void check(const char *what, size_t len, size_t align,
+		  uint16_t got, uint16_t want)
+{
+	checks++;
+
+	if (got == want)
+		return;
+
+	if (failures++ < 20)
+		fprintf(stderr, "%s: len %zu align %zu: got 0x%04x, want 0x%04x\n",
+			what, len, align, got, want);
+}
+
+static inline uint16_t kernel_csum(uint64_t sum)
+{
+	return ~csum_fold(sum) & 0xffff;
+}
+
+static void fill(uint8_t *buf, size_t len, int pattern)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		buf[i] = pattern < 0 ? rand() : pattern;
+}
+
+/* One buffer at one alignment through every kernel */
+static void test_one(uint8_t *base, size_t len, size_t align)
+{
+	const uint8_t *p = base + align;
+	uint16_t want = ref_csum_words(p, len);
+
+	if (len <= REF_OLD_LEN_MAX) {
+		struct cksum_vec vec = { .ptr = p, .len = len };
+
+		check("ref_in_cksum", len, align, ref_in_cksum(&vec, 1), want);
+		/* The old csum() loads whole words, it needs them aligned. */
+		if (len % 2 == 0 && align % 2 == 0)
+			check("csum", len, align, csum((void *) p, len / 2),
+			      ref_csum((void *) p, len / 2));
+	}
+
+	check("scalar", len, align, kernel_csum(__csum_add_scalar(p, len, 0)),
+	      want);
+#if defined(__x86_64__)
+	check("sse2", len, align, kernel_csum(__csum_add_sse2(p, len, 0)),
+	      want);
+	if (__csum_cpu_avx2())
+		check("avx2", len, align,
+		      kernel_csum(__csum_add_avx2(p, len, 0)), want);
+#endif
+	check("csum_partial", len, align,
+	      kernel_csum(csum_partial(p, len, 0)), want);
+}
+
+static void test_lengths(uint8_t *base, int pattern)
+{
+	size_t len, align;
+
+	fill(base, LEN_ALL + ALIGN_MAX, pattern);
+
+	for (len = 0; len <= LEN_ALL; ++len)
+		for (align = 0; align < ALIGN_MAX; ++align)
+			test_one(base, len, align);
+}
+
+/* Around the point where a SIMD kernel has to empty its 32 bit lanes */
+static void test_blocks(uint8_t *base, size_t size, int pattern)
+{
+	static const size_t blocks[] = {
+		32 * CSUM_SIMD_BLOCKS, 64 * CSUM_SIMD_BLOCKS,
+		2 * 64 * CSUM_SIMD_BLOCKS,
+	};
+	size_t i, align;
+	long delta;
+
+	fill(base, size, pattern);
+
+	for (i = 0; i < array_size(blocks); ++i) {
+		for (delta = -65; delta <= 65; delta += 13) {
+			for (align = 0; align < 4; ++align) {
+				size_t len = blocks[i] + delta;
+
+				if (len + align <= size)
+					test_one(base, len, align);
+			}
+		}
+	}
+}
+
+/* The same bytes as one vector and split up at random points */
+static void test_splits(uint8_t *base)
+{
+	struct cksum_vec vec[VEC_MAX], whole;
+	unsigned long n;
+	size_t len, off, align;
+	int i, nr;
+
+	for (n = 0; n < SPLITS; ++n) {
+		align = rand() % ALIGN_MAX;
+		len = rand() % (n % 8 ? 256 : 4 * CSUM_SIMD_MIN);
+		nr = 1 + rand() % VEC_MAX;
+
+		fill(base + align, len, n % 16 ? -1 : 0xff);
+
+		for (i = 0, off = 0; i < nr; ++i) {
+			size_t part = i == nr - 1 ? len - off :
+				      rand() % (len - off + 1);
+
+			vec[i].ptr = base + align + off;
+			vec[i].len = part;
+			off += part;
+		}
+
+		whole.ptr = base + align;
+		whole.len = len;
+
+		check("__in_cksum split", len, align, __in_cksum(vec, nr),
+		      ref_in_cksum(vec, nr));
+		check("__in_cksum whole", len, align, __in_cksum(vec, nr),
+		      __in_cksum(&whole, 1));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+	size_t size = 3 * 64 * CSUM_SIMD_BLOCKS;
+	uint8_t *base;
+
+	srand(seed);
+
+	base = malloc(size);
+	if (!base) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+
+	test_lengths(base, -1);
+	test_lengths(base, 0xff);
+	test_lengths(base, 0);
+	test_blocks(base, size, -1);
+	test_blocks(base, size, 0xff);
+	test_splits(base);
+
+	free(base);
+
+	printf("csum_test: seed %u, avx2 %s, %lu checks, %lu failures\n",
+	       seed,
+#if defined(__x86_64__)
+	       __csum_cpu_avx2() ? "yes" : "no",
+#else
+	       "n/a",
+#endif
+	       checks, failures);
+
+	return failures ? 1 : 0;
+}
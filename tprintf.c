@@ -22,9 +22,15 @@
 
 #define term_curr_size		(get_tty_size() - term_trailing_size)
 
-static char buffer[1024];
+/*
+ * Each thread formats into its own buffer, the lock only serializes
+ * flushing to stdout. Dissectors flush once per packet, so with the
+ * buffer sized for a full packet dump, packets dissected in parallel
+ * do not end up interleaved on the terminal.
+ */
+static __thread char buffer[64 * 1024];
 
-static volatile size_t buffer_use = 0;
+static __thread size_t buffer_use = 0;
 
 static struct spinlock buffer_lock;
 
@@ -65,9 +71,11 @@ static inline int __tprintf_flush_skip(char *buffer, int i, size_t max)
 static void __tprintf_flush(void)
 {
 	int i;
-	static ssize_t line_count = 0;
+	static __thread ssize_t line_count = 0;
 	size_t term_len = term_curr_size;
 
+	spinlock_lock(&buffer_lock);
+
 	for (i = 0; i < buffer_use; ++i) {
 		if (buffer[i] == '\n') {
 			term_len = term_curr_size;
@@ -89,13 +97,13 @@ static void __tprintf_flush(void)
 
 	fflush(stdout);
 	buffer_use = 0;
+
+	spinlock_unlock(&buffer_lock);
 }
 
 void tprintf_flush(void)
 {
-	spinlock_lock(&buffer_lock);
 	__tprintf_flush();
-	spinlock_unlock(&buffer_lock);
 }
 
 void tprintf_init(void)
@@ -118,8 +126,6 @@ void tprintf(char *msg, ...)
 	ssize_t avail;
 	va_list vl;
 
-	spinlock_lock(&buffer_lock);
-
 	avail = sizeof(buffer) - buffer_use;
 	bug_on(avail < 0);
 
@@ -146,8 +152,6 @@ void tprintf(char *msg, ...)
 	}
 
 	buffer_use += ret;
-
-	spinlock_unlock(&buffer_lock);
 }
 
 void tputchar_safe(int c)
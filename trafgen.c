@@ -13,6 +13,7 @@
  *        Chapter 'The Stairs of Cirith Ungol'.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
@@ -23,8 +24,6 @@
 #include <sys/fsuid.h>
 #include <sys/stat.h>
 #include <sys/time.h>
-#include <sys/wait.h>
-#include <sys/mman.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -38,6 +37,7 @@
 #include <poll.h>
 #include <netdb.h>
 #include <math.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
@@ -50,31 +50,50 @@
 #include "tprintf.h"
 #include "ring_tx.h"
 #include "csum.h"
+#include "xtime.h"
+#include "prng.h"
 
 struct ctx {
 	bool rand, rfraw, jumbo_support, verbose, smoke_test, enforce;
-	unsigned long kpull, num, gap, reserve_size, cpus;
+	bool rate_bytes;
+	unsigned long kpull, num, gap, reserve_size, cpus, pool;
+	uint64_t rate;
 	uid_t uid; gid_t gid; char *device, *device_trans, *rhost;
 	struct sockaddr_in dest;
 };
 
+/*
+ * One per worker thread, written by that worker only. The tx_ counters
+ * are kept up to date while sending, for the once a second report.
+ */
 struct cpu_stats {
 	unsigned long tv_sec, tv_usec;
-	unsigned long long tx_packets, tx_bytes;
+	volatile unsigned long long tx_packets, tx_bytes, tx_full;
+	unsigned long long tx_kicks;
 	unsigned long long cf_packets, cf_bytes;
 	unsigned long long cd_packets;
-	sig_atomic_t state;
+	volatile sig_atomic_t state;
+} __cacheline_aligned;
+
+struct worker {
+	pthread_t trid;
+	int cpu;
+	struct ctx ctx;
+	const struct packet_set *set;
+	bool slow, reseed;
+	unsigned int seed;
 };
 
 sig_atomic_t sigint = 0;
 
-struct packet *packets = NULL;
-size_t plen = 0;
+/* Every worker's own selection from the compiled config */
+__thread struct packet *packets = NULL;
+__thread size_t plen = 0;
 
-struct packet_dyn *packet_dyn = NULL;
-size_t dlen = 0;
+__thread struct packet_dyn *packet_dyn = NULL;
+__thread size_t dlen = 0;
 
-static const char *short_options = "d:c:n:t:vJhS:rk:i:o:VRs:P:eE:pu:g:";
+static const char *short_options = "d:c:n:t:vJhS:rk:i:o:VRs:P:eE:pu:g:b:CK:L:";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"out",			required_argument,	NULL, 'o'},
@@ -82,17 +101,21 @@ static const struct option long_options[] = {
 	{"conf",		required_argument,	NULL, 'c'},
 	{"num",			required_argument,	NULL, 'n'},
 	{"gap",			required_argument,	NULL, 't'},
+	{"rate",		required_argument,	NULL, 'b'},
+	{"pool",		required_argument,	NULL, 'K'},
 	{"cpus",		required_argument,	NULL, 'P'},
 	{"ring-size",		required_argument,	NULL, 'S'},
 	{"kernel-pull",		required_argument,	NULL, 'k'},
 	{"smoke-test",		required_argument,	NULL, 's'},
 	{"seed",		required_argument,	NULL, 'E'},
+	{"csv",			required_argument,	NULL, 'L'},
 	{"user",		required_argument,	NULL, 'u'},
 	{"group",		required_argument,	NULL, 'g'},
 	{"jumbo-support",	no_argument,		NULL, 'J'},
 	{"cpp",			no_argument,		NULL, 'p'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"rand",		no_argument,		NULL, 'r'},
+	{"csum-check",		no_argument,		NULL, 'C'},
 	{"verbose",		no_argument,		NULL, 'V'},
 	{"version",		no_argument,		NULL, 'v'},
 	{"example",		no_argument,		NULL, 'e'},
@@ -100,15 +123,18 @@ static const struct option long_options[] = {
 	{NULL, 0, NULL, 0}
 };
 
-static int sock;
+static __thread int sock;
 
-static struct itimerval itimer;
+static struct cpu_stats *stats;
 
-static unsigned long interval = TX_KERNEL_PULL_INT;
+static __thread unsigned int seed;
 
-static struct cpu_stats *stats;
+/* Per worker, seeded with seed and the worker's CPU index */
+__thread struct prng rng;
 
-unsigned int seed;
+static pthread_mutex_t priv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t priv_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long priv_ready = 0;
 
 #define CPU_STATS_STATE_CFG	1
 #define CPU_STATS_STATE_CHK	2
@@ -133,13 +159,6 @@ static void signal_handler(int number)
 	}
 }
 
-static void timer_elapsed(int number)
-{
-	set_itimer_interval_value(&itimer, 0, interval);
-	pull_and_flush_tx_ring(sock);
-	setitimer(ITIMER_REAL, &itimer, NULL); 
-}
-
 static void help(void)
 {
 	printf("\ntrafgen %s, multithreaded zero-copy network packet generator\n", VERSION_STRING);
@@ -156,9 +175,13 @@ static void help(void)
 	     "  -r|--rand                      Randomize packet selection (def: round robin)\n"
 	     "  -P|--cpus <uint>               Specify number of forks(<= CPUs) (def: #CPUs)\n"
 	     "  -t|--gap <uint>                Interpacket gap in us (approx)\n"
+	     "  -b|--rate <rate>               Exact rate, in total: <n>[k|M]pps or <n>[k|M|G]bit\n"
+	     "  -K|--pool <uint>               Pre-render <uint> variants of dynamic packets\n"
 	     "  -S|--ring-size <size>          Manually set mmap size (KiB/MiB/GiB)\n"
-	     "  -k|--kernel-pull <uint>        Kernel batch interval in us (def: 10us)\n"
-	     "  -E|--seed <uint>               Manually set srand(3) seed\n"
+	     "  -k|--kernel-pull <uint>        Kernel pull at the latest after us (def: 10us/64 frames)\n"
+	     "  -E|--seed <uint>               Manually set PRNG seed (plus CPU index)\n"
+	     "  -L|--csv <file>                Dump stats per second as Gnuplot-ready data\n"
+	     "  -C|--csum-check                Verify incremental checksums (slow)\n"
 	     "  -u|--user <userid>             Drop privileges and change to userid\n"
 	     "  -g|--group <groupid>           Drop privileges and change to groupid\n"
 	     "  -V|--verbose                   Be more verbose\n"
@@ -172,6 +195,8 @@ static void help(void)
 	     "  trafgen --dev eth0 --conf fuzzing.cfg --smoke-test 10.0.0.1\n"
 	     "  trafgen --dev wlan0 --rfraw --conf beacon-test.txf -V --cpus 2\n"
 	     "  trafgen --dev eth0 --conf frag_dos.cfg --rand --gap 1000\n"
+	     "  trafgen --dev eth0 --conf udp.cfg --cpus 4 --rate 7.5Gbit\n"
+	     "  trafgen --dev eth0 --conf syn_flood.cfg --pool 256\n"
 	     "  trafgen --dev eth0 --conf icmp.cfg --rand --num 1400000 -k1000\n"
 	     "  trafgen --dev eth0 --conf tcp_syn.cfg -u `id -u bob` -g `id -g bob`\n\n"
 	     "Arbitrary packet config examples (e.g. trafgen -e > trafgen.cfg):\n"
@@ -184,6 +209,11 @@ static void help(void)
 	     "  we assume the kernel crashed, thus we print the packet and quit.\n"
 	     "  In case you find a ping-of-death, please mention trafgen in your\n"
 	     "  commit message of the fix!\n\n"
+	     "  With --pool, packets with counters, drnd() or csum16() are rendered\n"
+	     "  up front into a pool of variants per packet that is then sent in\n"
+	     "  turn, so the sequence repeats after <uint> sends of a packet. For\n"
+	     "  counters only, a multiple of their period keeps it exact. Pools of\n"
+	     "  all CPUs together may take up to 1 GiB.\n\n"
 	     "  For introducing bit errors, delays with random variation and more,\n"
 	     "  make use of tc(8) with its different disciplines, i.e. netem.\n\n"
 	     "  For generating different package distributions, you can use scripting\n"
@@ -269,6 +299,34 @@ static void version(void)
 	die();
 }
 
+/*
+ * Bytes changed by dynamic elements since the last send of a packet, so
+ * that its checksums can be updated incrementally (RFC 1624) instead of
+ * being recomputed over the whole range.
+ */
+struct csum_delta {
+	off_t off;
+	uint8_t old, new;
+};
+
+static __thread struct csum_delta *deltas;
+static __thread size_t ndeltas;
+static bool csum_check;
+
+static inline void __set_dyn_byte(int i, off_t off, uint8_t val)
+{
+	uint8_t *p = &packets[i].payload[off];
+
+	if (*p != val) {
+		deltas[ndeltas].off = off;
+		deltas[ndeltas].old = *p;
+		deltas[ndeltas].new = val;
+		ndeltas++;
+	}
+
+	*p = val;
+}
+
 static void apply_counter(int counter_id)
 {
 	int j, i = counter_id;
@@ -292,21 +350,150 @@ static void apply_counter(int counter_id)
 		}
 
 		counter->val = val + counter->min;
-		packets[i].payload[counter->off] = val;
+		__set_dyn_byte(i, counter->off, val);
 	}
 }
 
 static void apply_randomizer(int rand_id)
 {
 	int j, i = rand_id;
-	size_t rand_max = packet_dyn[i].rlen;
+	size_t k, l, n, rand_max = packet_dyn[i].rlen;
+	uint8_t vals[256];
 
 	for (j = 0; j < rand_max; ++j) {
-		uint8_t val = (uint8_t) rand();
 		struct randomizer *randomizer = &packet_dyn[i].rnd[j];
 
-		packets[i].payload[randomizer->off] = val;
+		/* Without checksums there are no deltas to track */
+		if (packet_dyn[i].slen == 0) {
+			prng_fill(&rng, &packets[i].payload[randomizer->off],
+				  randomizer->len);
+			continue;
+		}
+
+		for (k = 0; k < randomizer->len; k += n) {
+			n = min(randomizer->len - k, sizeof(vals));
+			prng_fill(&rng, vals, n);
+
+			for (l = 0; l < n; ++l)
+				__set_dyn_byte(i, randomizer->off + k + l, vals[l]);
+		}
+	}
+}
+
+/*
+ * Whether the byte at off is summed up by csum. base is where 16 bit
+ * words of that part of the range start. The checksum field itself
+ * is zero in a full computation, so it is never covered.
+ */
+static bool __csum16_covers(const struct csum16 *csum, size_t len, off_t off,
+			    off_t *base)
+{
+	if (off >= csum->off && off < csum->off + 2)
+		return false;
+
+	switch (csum->which) {
+	case CSUM_IP:
+		*base = csum->from;
+		return off >= csum->from &&
+		       off < csum->from + ((csum->to - csum->from + 1) & ~1);
+	case CSUM_UDP:
+	case CSUM_TCP:
+		/* IPv4 addresses of the pseudo header */
+		if (off >= csum->from + 12 && off < csum->from + 20) {
+			*base = csum->from;
+			return true;
+		}
+
+		*base = csum->to;
+		return off >= csum->to && off < len;
 	}
+
+	return false;
+}
+
+static uint16_t __csum16_full(int i, struct csum16 *csum)
+{
+	uint16_t sum = 0;
+
+	fmemset(&packets[i].payload[csum->off], 0, sizeof(sum));
+
+	switch (csum->which) {
+	case CSUM_IP:
+		if (csum->to >= packets[i].len)
+			csum->to = packets[i].len - 1;
+		sum = calc_csum(packets[i].payload + csum->from,
+				csum->to - csum->from + 1, 0);
+		break;
+	case CSUM_UDP:
+		sum = p4_csum((void *) packets[i].payload + csum->from,
+			      packets[i].payload + csum->to,
+			      (packets[i].len - csum->to),
+			      IPPROTO_UDP);
+		break;
+	case CSUM_TCP:
+		sum = p4_csum((void *) packets[i].payload + csum->from,
+			      packets[i].payload + csum->to,
+			      (packets[i].len - csum->to),
+			      IPPROTO_TCP);
+		break;
+	}
+
+	return sum;
+}
+
+/*
+ * Checksum fields of other checksums inside the range change along
+ * with their own updates, which deltas do not track: such checksums
+ * are recomputed in full on every send.
+ */
+static void __csum16_init(int i, struct csum16 *csum)
+{
+	int j;
+	off_t base;
+
+	csum->inited = true;
+	csum->full = false;
+
+	for (j = 0; j < packet_dyn[i].slen; ++j) {
+		struct csum16 *other = &packet_dyn[i].csum[j];
+
+		if (other == csum)
+			continue;
+
+		if (__csum16_covers(csum, packets[i].len, other->off, &base) ||
+		    __csum16_covers(csum, packets[i].len, other->off + 1, &base))
+			csum->full = true;
+	}
+}
+
+static uint16_t __csum16_update(int i, const struct csum16 *csum)
+{
+	int j;
+	off_t base;
+	uint16_t sum, o, n;
+	uint8_t ob[2], nb[2];
+
+	fmemcpy(&sum, &packets[i].payload[csum->off], sizeof(sum));
+
+	for (j = 0; j < ndeltas; ++j) {
+		const struct csum_delta *d = &deltas[j];
+
+		if (!__csum16_covers(csum, packets[i].len, d->off, &base))
+			continue;
+
+		/* The other byte of the word contributes nothing to the delta */
+		ob[0] = ob[1] = nb[0] = nb[1] = 0;
+		ob[(d->off - base) & 1] = d->old;
+		nb[(d->off - base) & 1] = d->new;
+
+		fmemcpy(&o, ob, sizeof(o));
+		fmemcpy(&n, nb, sizeof(n));
+
+		sum = csum_replace2(sum, o, n);
+	}
+
+	/* Full computation yields +0 for a zero sum, never -0 */
+	return sum == 0xffff ? 0 : sum;
 }
 
 static void apply_csum16(int csum_id)
@@ -315,69 +502,243 @@ static void apply_csum16(int csum_id)
 	size_t csum_max = packet_dyn[i].slen;
 
 	for (j = 0; j < csum_max; ++j) {
-		uint16_t sum = 0;
+		uint16_t sum, full;
 		struct csum16 *csum = &packet_dyn[i].csum[j];
 
-		fmemset(&packets[i].payload[csum->off], 0, sizeof(sum));
+		if (unlikely(!csum->inited)) {
+			sum = __csum16_full(i, csum);
+			__csum16_init(i, csum);
+		} else if (csum->full) {
+			sum = __csum16_full(i, csum);
+		} else {
+			if (ndeltas == 0)
+				continue;
 
-		switch (csum->which) {
-		case CSUM_IP:
-			if (csum->to >= packets[i].len)
-				csum->to = packets[i].len - 1;
-			sum = calc_csum(packets[i].payload + csum->from,
-					csum->to - csum->from + 1, 0);
-			break;
-		case CSUM_UDP:
-			sum = p4_csum((void *) packets[i].payload + csum->from,
-				      packets[i].payload + csum->to,
-				      (packets[i].len - csum->to),
-				      IPPROTO_UDP);
-			break;
-		case CSUM_TCP:
-			sum = p4_csum((void *) packets[i].payload + csum->from,
-				      packets[i].payload + csum->to,
-				      (packets[i].len - csum->to),
-				      IPPROTO_TCP);
-			break;
+			sum = __csum16_update(i, csum);
+
+			if (unlikely(csum_check)) {
+				full = __csum16_full(i, csum);
+				if (sum != full)
+					panic("Incremental checksum 0x%04x of packet%d "
+					      "at off %ld differs from 0x%04x!\n",
+					      sum, i, (long) csum->off, full);
+			}
 		}
 
 		fmemcpy(&packets[i].payload[csum->off], &sum, sizeof(sum));
 	}
+
+	ndeltas = 0;
 }
 
-static struct cpu_stats *setup_shared_var(unsigned long cpus)
+/*
+ * Optional pool of pre-rendered variants of each dynamic packet. The
+ * variants are produced once by the regular counter, randomizer and
+ * checksum code, so sending one is a plain copy.
+ */
+struct packet_pool {
+	uint8_t *data;
+	size_t cur;
+};
+
+static __thread struct packet_pool *pools;
+static __thread size_t pool_nr;
+
+/* Upper bound of the pools of all workers together */
+#define POOL_BYTES_MAX		(1ULL << 30)
+
+/* Every worker renders its own pool of each dynamic packet it sends */
+static void pool_check(const struct ctx *ctx, const struct packet_set *set)
 {
-	int fd;
-	char zbuff[cpus * sizeof(struct cpu_stats)], file[256];
-	struct cpu_stats *buff;
+	uint64_t per_variant = 0;
+	size_t i;
 
-	fmemset(zbuff, 0, sizeof(zbuff));
-	slprintf(file, sizeof(file), ".tmp_mmap.%u", (unsigned int) rand());
+	for (i = 0; i < set->plen; ++i) {
+		const struct packet *pkt = &set->packets[i];
+		const struct packet_dyn *pktd = &set->packet_dyn[i];
+		unsigned long cpus = ctx->cpus;
 
-	fd = creat(file, S_IRUSR | S_IWUSR);
-	bug_on(fd < 0);
-	close(fd);
+		if (pktd->clen + pktd->rlen + pktd->slen == 0)
+			continue;
 
-	fd = open_or_die_m(file, O_RDWR | O_CREAT | O_TRUNC,
-			   S_IRUSR | S_IWUSR);
-	write_or_die(fd, zbuff, sizeof(zbuff));
+		if (pkt->min_cpu >= 0) {
+			if ((unsigned long) pkt->min_cpu >= ctx->cpus)
+				continue;
+			cpus = min((unsigned long) pkt->max_cpu, ctx->cpus - 1) -
+			       pkt->min_cpu + 1;
+		}
+
+		per_variant += cpus * pkt->len;
+	}
 
-	buff = (void *) mmap(0, sizeof(zbuff), PROT_READ | PROT_WRITE,
-			     MAP_SHARED, fd, 0);
-	if (buff == (void *) -1)
-		panic("Cannot setup shared variable!\n");
+	if (per_variant && ctx->pool > POOL_BYTES_MAX / per_variant)
+		panic("A pool of %lu variants takes %.2Lf MiB, at most %llu MiB "
+		      "are allowed!\n", ctx->pool,
+		      (long double) ctx->pool * per_variant / (1 << 20),
+		      POOL_BYTES_MAX >> 20);
+}
 
-	close(fd);
-	unlink(file);
+static void pool_setup(struct ctx *ctx)
+{
+	size_t i, k;
+
+	pool_nr = ctx->pool;
+	pools = xzmalloc(plen * sizeof(*pools));
+
+	for (i = 0; i < plen; ++i) {
+		struct packet_dyn *pktd = &packet_dyn[i];
+
+		if (pktd->clen + pktd->rlen + pktd->slen == 0)
+			continue;
+
+		pools[i].data = xmalloc_aligned(pool_nr * packets[i].len,
+						CO_CACHE_LINE_SIZE);
+
+		for (k = 0; k < pool_nr; ++k) {
+			apply_counter(i);
+			apply_randomizer(i);
+			apply_csum16(i);
+
+			fmemcpy(pools[i].data + k * packets[i].len,
+				packets[i].payload, packets[i].len);
+		}
+	}
+}
+
+static void pool_destroy(void)
+{
+	size_t i;
+
+	for (i = 0; i < plen; ++i) {
+		if (pools[i].data)
+			xfree(pools[i].data);
+	}
+
+	xfree(pools);
+	pools = NULL;
+}
+
+/* Renders packet i, or takes its next variant from the pool */
+static inline uint8_t *packet_next(unsigned long i)
+{
+	struct packet_dyn *pktd = &packet_dyn[i];
+	struct packet_pool *pool;
+	uint8_t *ret;
+
+	if (pools && pools[i].data) {
+		pool = &pools[i];
+
+		ret = pool->data + pool->cur * packets[i].len;
+		if (++pool->cur == pool_nr)
+			pool->cur = 0;
+
+		return ret;
+	}
+
+	if (pktd->clen + pktd->rlen + pktd->slen) {
+		apply_counter(i);
+		apply_randomizer(i);
+		apply_csum16(i);
+	}
+
+	return packets[i].payload;
+}
+
+/* Copies the dynamic bytes of packet i, runs of random bytes optionally */
+static void __frame_copy_dyn(uint8_t *out, const uint8_t *src,
+			     unsigned long i, bool runs)
+{
+	size_t j;
+	off_t off;
+	struct packet_dyn *pktd = &packet_dyn[i];
+
+	for (j = 0; j < pktd->clen; ++j) {
+		off = pktd->cnt[j].off;
+		out[off] = src[off];
+	}
+
+	for (j = 0; runs && j < pktd->rlen; ++j) {
+		off = pktd->rnd[j].off;
+		fmemcpy(out + off, src + off, pktd->rnd[j].len);
+	}
+
+	for (j = 0; j < pktd->slen; ++j) {
+		off = pktd->csum[j].off;
+		fmemcpy(out + off, src + off, sizeof(uint16_t));
+	}
+}
+
+/*
+ * Renders packet i into the TX frame at out. The kernel does not touch
+ * the data of a frame, so if the frame carried packet i the last time
+ * around (same), only its dynamic bytes are rewritten. Without checksums
+ * to keep up to date, random bytes go straight into the frame instead
+ * of through the template.
+ */
+static void xmit_frame_render(uint8_t *out, unsigned long i, bool same)
+{
+	struct packet_dyn *pktd = &packet_dyn[i];
+	bool dyn = pktd->clen + pktd->rlen + pktd->slen > 0;
+	bool direct = false;
+	const uint8_t *src;
+	size_t j;
+
+	if (pools && pools[i].data) {
+		src = packet_next(i);
+	} else {
+		if (dyn) {
+			direct = pktd->slen == 0;
+
+			apply_counter(i);
+			if (!direct)
+				apply_randomizer(i);
+			apply_csum16(i);
+		}
 
-	memset(buff, 0, sizeof(zbuff));
+		src = packets[i].payload;
+	}
+
+	if (!same)
+		fmemcpy(out, src, packets[i].len);
+	else if (dyn)
+		__frame_copy_dyn(out, src, i, !direct);
+
+	for (j = 0; direct && j < pktd->rlen; ++j)
+		prng_fill(&rng, out + pktd->rnd[j].off, pktd->rnd[j].len);
+}
+
+static struct cpu_stats *setup_shared_var(unsigned long cpus)
+{
+	struct cpu_stats *buff;
+
+	buff = xmalloc_aligned(cpus * sizeof(*buff), CO_CACHE_LINE_SIZE);
+	fmemset(buff, 0, cpus * sizeof(*buff));
 
 	return buff;
 }
 
-static void destroy_shared_var(void *buff, unsigned long cpus)
+static void destroy_shared_var(struct cpu_stats *buff)
 {
-	munmap(buff, cpus * sizeof(struct cpu_stats));
+	xfree(buff);
+}
+
+/*
+ * set*id(2) act on all threads of the process, so privileges are
+ * dropped once, by the last worker done with its privileged setup.
+ */
+static void xmit_drop_privileges(struct ctx *ctx)
+{
+	pthread_mutex_lock(&priv_lock);
+
+	if (++priv_ready == ctx->cpus) {
+		drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+		pthread_cond_broadcast(&priv_cond);
+	}
+
+	while (priv_ready < ctx->cpus)
+		pthread_cond_wait(&priv_cond, &priv_lock);
+
+	pthread_mutex_unlock(&priv_lock);
 }
 
 static void dump_trafgen_snippet(uint8_t *payload, size_t len)
@@ -495,13 +856,121 @@ static int xmit_smoke_probe(int icmp_sock, struct ctx *ctx)
 	return -1;
 }
 
+/*
+ * Waits until due on the tx_rate_now() clock. Long waits sleep and kick
+ * the kernel first, short ones spin while still honouring the flush
+ * timeout of frames queued so far.
+ */
+static void xmit_wait_until(struct tx_flush *f, uint64_t due, uint64_t now)
+{
+	struct timespec ts;
+
+	while (now < due && likely(sigint == 0)) {
+		if (due - now > XTIME_SPIN_THRESH_NS) {
+			if (f)
+				tx_flush_kick(f);
+
+			ns_to_timespec(due - now - XTIME_SPIN_THRESH_NS, &ts);
+			nanosleep(&ts, NULL);
+		} else if (f) {
+			tx_flush_expire(f);
+		}
+
+		now = tx_rate_now();
+	}
+}
+
+/* Waits until the next frame of len bytes is due */
+static void xmit_rate_wait(struct tx_rate *r, struct tx_flush *f, size_t len)
+{
+	uint64_t now = tx_rate_now();
+
+	xmit_wait_until(f, tx_rate_due(r, len, now), now);
+}
+
+/* Backoff while the device drops for a full queue, doubled per retry */
+#define XMIT_BACKOFF_MIN_NS	(10 * NSEC_PER_USEC)
+#define XMIT_BACKOFF_MAX_NS	(1000 * NSEC_PER_USEC)
+
+/*
+ * Sends msgs[0..n), waiting for socket buffer space while the device
+ * queue is full. Returns how many went out, fewer only on ^C.
+ */
+static unsigned int xmit_mmsg_or_die(int cpu, struct mmsghdr *msgs,
+				     unsigned int n)
+{
+	int ret;
+	unsigned int sent = 0;
+	uint64_t backoff = XMIT_BACKOFF_MIN_NS;
+	struct timespec ts;
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = POLLOUT,
+	};
+
+	while (sent < n) {
+		ret = sendmmsg(sock, msgs + sent, n - sent, 0);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				stats[cpu].tx_full++;
+				if (unlikely(sigint == 1))
+					break;
+				/* Socket buffer is full, wait until it drains. */
+				poll(&pfd, 1, 100);
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				stats[cpu].tx_full++;
+				if (unlikely(sigint == 1))
+					break;
+				/*
+				 * Dropped by the qdisc or the driver. The socket
+				 * stays writable, so poll(2) would return at once.
+				 */
+				ns_to_timespec(backoff, &ts);
+				nanosleep(&ts, NULL);
+				backoff = min(backoff * 2,
+					      (uint64_t) XMIT_BACKOFF_MAX_NS);
+				continue;
+			}
+
+			panic("Sendmmsg error: %s!\n", strerror(errno));
+		}
+
+		sent += ret;
+		backoff = XMIT_BACKOFF_MIN_NS;
+	}
+
+	return sent;
+}
+
+/*
+ * Packets go out in sendmmsg(2) batches of everything that is due by
+ * the gap or rate schedule, at most XMIT_MMSG_BATCH, or one by one for
+ * smoke tests to probe after each. Dynamic packets are rendered into a
+ * buffer per batch slot, as a later one of the batch changes the
+ * template again.
+ */
+#define XMIT_MMSG_BATCH		64
+
 static void xmit_slowpath_or_die(struct ctx *ctx, int cpu)
 {
 	int ret, icmp_sock = -1;
 	unsigned long num = 1, i = 0;
+	unsigned int j, n = 0, batch = XMIT_MMSG_BATCH, sent;
 	struct timeval start, end, diff;
-	unsigned long long tx_bytes = 0, tx_packets = 0;
+	unsigned long long tx_bytes = 0, tx_packets = 0, booked = 0;
+	uint64_t now, due = 0, t0, gap = ctx->gap * NSEC_PER_USEC;
+	bool due_booked = false;
+	size_t max_len = 0;
+	uint8_t *payload, *bufs;
+	struct tx_rate rate;
 	struct packet_dyn *pktd;
+	struct mmsghdr msgs[XMIT_MMSG_BATCH];
+	struct iovec iovs[XMIT_MMSG_BATCH];
+	unsigned long idx[XMIT_MMSG_BATCH];
 	struct sockaddr_ll saddr = {
 		.sll_family = PF_PACKET,
 		.sll_halen = ETH_ALEN,
@@ -511,60 +980,106 @@ static void xmit_slowpath_or_die(struct ctx *ctx, int cpu)
 	if (ctx->num > 0)
 		num = ctx->num;
 
-	if (ctx->smoke_test)
+	if (ctx->smoke_test) {
 		icmp_sock = xmit_smoke_setup(ctx);
+		batch = 1;
+	}
+
+	for (j = 0; j < plen; ++j)
+		max_len = max(max_len, packets[j].len);
+
+	bufs = xmalloc_aligned(batch * max_len, CO_CACHE_LINE_SIZE);
+
+	fmemset(msgs, 0, sizeof(msgs));
+	for (j = 0; j < batch; ++j) {
+		msgs[j].msg_hdr.msg_name = &saddr;
+		msgs[j].msg_hdr.msg_namelen = sizeof(saddr);
+		msgs[j].msg_hdr.msg_iov = &iovs[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
 
-	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+	xmit_drop_privileges(ctx);
 
 	bug_on(gettimeofday(&start, NULL));
+	tx_rate_init(&rate, ctx->rate, ctx->rate_bytes);
+	t0 = tx_rate_now();
+
+	while (likely(sigint == 0) && (likely(num > 0) || n > 0)) {
+		if (num > 0 && (rate.rate || ctx->gap)) {
+			now = tx_rate_now();
+			if (!due_booked) {
+				if (rate.rate) {
+					due = tx_rate_due(&rate, packets[i].len, now);
+				} else {
+					due = t0 + booked * gap;
+					/* After a stall, go on from now, no burst. */
+					if (now > due + gap) {
+						t0 = due = now;
+						booked = 0;
+					}
+					booked++;
+				}
+				due_booked = true;
+			}
 
-	while (likely(sigint == 0) && likely(num > 0)) {
-		pktd = &packet_dyn[i];
-		if (pktd->clen + pktd->rlen + pktd->slen) {
-			apply_counter(i);
-			apply_randomizer(i);
-			apply_csum16(i);
+			/* Out with what is due before waiting for the next */
+			if (due > now && n > 0)
+				goto send;
+
+			xmit_wait_until(NULL, due, now);
+			due_booked = false;
 		}
-retry:
-		ret = sendto(sock, packets[i].payload, packets[i].len, 0,
-			     (struct sockaddr *) &saddr, sizeof(saddr));
-		if (unlikely(ret < 0)) {
-			if (errno == ENOBUFS) {
-				sched_yield();
-				goto retry;
+
+		if (num > 0) {
+			payload = packet_next(i);
+
+			pktd = &packet_dyn[i];
+			if (!(pools && pools[i].data) &&
+			    pktd->clen + pktd->rlen + pktd->slen) {
+				fmemcpy(bufs + n * max_len, payload, packets[i].len);
+				payload = bufs + n * max_len;
 			}
 
-			panic("Sendto error: %s!\n", strerror(errno));
+			iovs[n].iov_base = payload;
+			iovs[n].iov_len = packets[i].len;
+			idx[n++] = i;
+
+			if (!ctx->rand) {
+				i++;
+				if (i >= plen)
+					i = 0;
+			} else
+				i = prng_range(&rng, plen);
+
+			if (ctx->num > 0)
+				num--;
+
+			if (n < batch && num > 0)
+				continue;
 		}
+send:
+		sent = xmit_mmsg_or_die(cpu, msgs, n);
 
-		tx_bytes += packets[i].len;
-		tx_packets++;
+		for (j = 0; j < sent; ++j)
+			tx_bytes += iovs[j].iov_len;
+		tx_packets += sent;
+		n = 0;
 
-		if (ctx->smoke_test) {
+		stats[cpu].tx_packets = tx_packets;
+		stats[cpu].tx_bytes = tx_bytes;
+
+		if (ctx->smoke_test && sent > 0) {
 			ret = xmit_smoke_probe(icmp_sock, ctx);
 			if (unlikely(ret < 0)) {
 				printf("%sSmoke test alert:%s\n", colorize_start(bold), colorize_end());
 				printf("  Remote host seems to be unresponsive to ICMP probes!\n");
 				printf("  Last instance was packet%lu, seed:%u, trafgen snippet:\n\n",
-				       i, seed);
+				       idx[0], seed);
 
-				dump_trafgen_snippet(packets[i].payload, packets[i].len);
+				dump_trafgen_snippet(iovs[0].iov_base, iovs[0].iov_len);
 				break;
 			}
 		}
-
-		if (!ctx->rand) {
-			i++;
-			if (i >= plen)
-				i = 0;
-		} else
-			i = rand() % plen;
-
-		if (ctx->num > 0)
-			num--;
-
-		if (ctx->gap > 0)
-			usleep(ctx->gap);
 	}
 
 	bug_on(gettimeofday(&end, NULL));
@@ -573,6 +1088,8 @@ retry:
 	if (ctx->smoke_test)
 		close(icmp_sock);
 
+	xfree(bufs);
+
 	stats[cpu].tx_packets = tx_packets;
 	stats[cpu].tx_bytes = tx_bytes;
 	stats[cpu].tv_sec = diff.tv_sec;
@@ -586,11 +1103,13 @@ static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 	int ifindex = device_ifindex(ctx->device);
 	uint8_t *out = NULL;
 	unsigned int it = 0;
-	unsigned long num = 1, i = 0, size;
+	unsigned long num = 1, i = 0, size, *frame_pkt;
+	bool full = false;
 	struct ring tx_ring;
 	struct frame_map *hdr;
 	struct timeval start, end, diff;
-	struct packet_dyn *pktd;
+	struct tx_flush flush;
+	struct tx_rate rate;
 	unsigned long long tx_bytes = 0, tx_packets = 0;
 
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
@@ -606,46 +1125,50 @@ static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 	alloc_tx_ring_frames(&tx_ring);
 	bind_tx_ring(sock, &tx_ring, ifindex);
 
-	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
+	xmit_drop_privileges(ctx);
 
-	if (ctx->kpull)
-		interval = ctx->kpull;
 	if (ctx->num > 0)
 		num = ctx->num;
 
-	set_itimer_interval_value(&itimer, 0, interval);
-	setitimer(ITIMER_REAL, &itimer, NULL); 
+	tx_flush_init(&flush, sock, &tx_ring, ctx->kpull);
+
+	/* Packet each frame carried last, none yet */
+	frame_pkt = xmalloc(tx_ring.layout.tp_frame_nr * sizeof(*frame_pkt));
+	fmemset(frame_pkt, 0xff, tx_ring.layout.tp_frame_nr * sizeof(*frame_pkt));
 
 	bug_on(gettimeofday(&start, NULL));
+	tx_rate_init(&rate, ctx->rate, ctx->rate_bytes);
 
 	while (likely(sigint == 0) && likely(num > 0)) {
 		while (user_may_pull_from_tx(tx_ring.frames[it].iov_base) && likely(num > 0)) {
 			hdr = tx_ring.frames[it].iov_base;
 			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
+			if (rate.rate)
+				xmit_rate_wait(&rate, &flush, packets[i].len);
+
 			hdr->tp_h.tp_snaplen = packets[i].len;
 			hdr->tp_h.tp_len = packets[i].len;
 
-			pktd = &packet_dyn[i];
-			if (pktd->clen + pktd->rlen + pktd->slen) {
-				apply_counter(i);
-				apply_randomizer(i);
-				apply_csum16(i);
-			}
-
-			fmemcpy(out, packets[i].payload, packets[i].len);
+			xmit_frame_render(out, i, frame_pkt[it] == i);
+			frame_pkt[it] = i;
 
 			tx_bytes += packets[i].len;
 			tx_packets++;
 
+			stats[cpu].tx_packets = tx_packets;
+			stats[cpu].tx_bytes = tx_bytes;
+			full = false;
+
 			if (!ctx->rand) {
 				i++;
 				if (i >= plen)
 					i = 0;
 			} else
-				i = rand() % plen;
+				i = prng_range(&rng, plen);
 
 			kernel_may_pull_from_tx(&hdr->tp_h);
+			tx_flush_queued(&flush);
 
 			it++;
 			if (it >= tx_ring.layout.tp_frame_nr)
@@ -657,15 +1180,27 @@ static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 			if (unlikely(sigint == 1))
 				break;
 		}
+
+		/* Counted once per time the ring runs full */
+		if (num > 0 && likely(sigint == 0) && !full) {
+			stats[cpu].tx_full++;
+			full = true;
+		}
+
+		tx_flush_kick(&flush);
 	}
 
+	tx_flush_kick(&flush);
+
 	bug_on(gettimeofday(&end, NULL));
 	timersub(&end, &start, &diff);
 
 	destroy_tx_ring(sock, &tx_ring);
+	xfree(frame_pkt);
 
 	stats[cpu].tx_packets = tx_packets;
 	stats[cpu].tx_bytes = tx_bytes;
+	stats[cpu].tx_kicks = flush.kicks;
 	stats[cpu].tv_sec = diff.tv_sec;
 	stats[cpu].tv_usec = diff.tv_usec;
 
@@ -765,6 +1300,25 @@ static int xmit_packet_precheck(struct ctx *ctx, int cpu)
 	__set_state_cf(cpu, plen, total_len, CPU_STATS_STATE_CFG);
 	plen_total = __wait_and_sum_others(ctx, cpu);
 
+	/* Like the packet budget, the rate is split by configured share */
+	if (ctx->rate > 0 && plen > 0) {
+		if (ctx->rate_bytes) {
+			size_t total_bytes = 0;
+
+			for (i = 0; i < ctx->cpus; ++i)
+				total_bytes += stats[i].cf_bytes;
+
+			ctx->rate = (uint64_t) nearbyint((1.0 * total_len / total_bytes) *
+							 ctx->rate);
+		} else {
+			ctx->rate = (uint64_t) nearbyint((1.0 * plen / plen_total) *
+							 ctx->rate);
+		}
+
+		if (ctx->rate == 0)
+			ctx->rate = 1;
+	}
+
 	if (orig > 0) {
 		ctx->num = (unsigned long) nearbyint((1.0 * plen / plen_total) * orig);
 
@@ -788,12 +1342,32 @@ static int xmit_packet_precheck(struct ctx *ctx, int cpu)
 	return 0;
 }
 
-static void main_loop(struct ctx *ctx, char *confname, bool slow,
-		      int cpu, bool invoke_cpp)
+static void main_loop(struct ctx *ctx, const struct packet_set *set,
+		      bool slow, int cpu)
 {
-	compile_packets(confname, ctx->verbose, cpu, invoke_cpp);
-	if (xmit_packet_precheck(ctx, cpu) < 0)
+	size_t j, max_dyn = 1;
+
+	select_packets(set, cpu);
+
+	if (xmit_packet_precheck(ctx, cpu) < 0) {
+		xmit_drop_privileges(ctx);
+		cleanup_packets();
 		return;
+	}
+
+	for (j = 0; j < dlen; ++j) {
+		size_t k, n = packet_dyn[j].clen;
+
+		for (k = 0; k < packet_dyn[j].rlen; ++k)
+			n += packet_dyn[j].rnd[k].len;
+
+		max_dyn = max(max_dyn, n);
+	}
+
+	deltas = xmalloc(max_dyn * sizeof(*deltas));
+
+	if (ctx->pool > 0)
+		pool_setup(ctx);
 
 	if (cpu == 0) {
 		int i;
@@ -819,6 +1393,10 @@ static void main_loop(struct ctx *ctx, char *confname, bool slow,
 
 	close(sock);
 
+	if (pools)
+		pool_destroy();
+
+	xfree(deltas);
 	cleanup_packets();
 }
 
@@ -837,13 +1415,205 @@ static unsigned int generate_srand_seed(void)
 	return seed;
 }
 
+static void *xmit_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	seed = w->reseed ? generate_srand_seed() : w->seed;
+	prng_seed(&rng, ((uint64_t) seed << 32) | w->cpu);
+
+	cpu_affinity(w->cpu);
+	main_loop(&w->ctx, w->set, w->slow, w->cpu);
+
+	pthread_exit(NULL);
+}
+
+static bool __all_done(struct ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->cpus; ++i) {
+		if ((__get_state(i) & CPU_STATS_STATE_RES) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void report_csv_header(FILE *csv, struct ctx *ctx)
+{
+	int i, j = 1;
+
+	fprintf(csv, "# gnuplot dump (#col:description)\n");
+	fprintf(csv, "# networking interface: %s\n", ctx->device);
+	fprintf(csv, "# sampling interval (t): 1000 ms\n");
+	fprintf(csv, "# %d:unixtime ", j++);
+
+	fprintf(csv, "%d:tx-pkts-per-t ", j++);
+	fprintf(csv, "%d:tx-bytes-per-t ", j++);
+	fprintf(csv, "%d:tx-full-per-t ", j++);
+
+	fprintf(csv, "%d:tx-pkts ", j++);
+	fprintf(csv, "%d:tx-bytes ", j++);
+	fprintf(csv, "%d:tx-full ", j++);
+
+	for (i = 0; i < ctx->cpus; ++i) {
+		fprintf(csv, "%d:cpu%i-tx-pkts-per-t ", j++, i);
+		fprintf(csv, "%d:cpu%i-tx-bytes-per-t ", j++, i);
+		fprintf(csv, "%d:cpu%i-tx-full-per-t ", j++, i);
+	}
+
+	fprintf(csv, "\n");
+}
+
+struct tx_snap {
+	unsigned long long packets, bytes, full;
+};
+
+static void report_line(const char *who, const struct tx_snap *cur,
+			const struct tx_snap *prev, double secs, FILE *csv)
+{
+	if (who)
+		printf("  %-6s %12.0lf pps %12.2lf Mbit/s %8llu ring full\n",
+		       who, (cur->packets - prev->packets) / secs,
+		       8.0 * (cur->bytes - prev->bytes) / secs / 1e6,
+		       cur->full - prev->full);
+	if (csv)
+		fprintf(csv, "%llu %llu %llu ", cur->packets - prev->packets,
+			cur->bytes - prev->bytes, cur->full - prev->full);
+}
+
+/*
+ * Runs in the main thread while the workers send: once a second, the
+ * rates since the last report, in total and with --verbose per CPU,
+ * and the same as a Gnuplot-ready line to csv.
+ */
+static void report_loop(struct ctx *ctx, FILE *csv)
+{
+	int i;
+	char who[16];
+	struct tx_snap *cur, *prev, all, all_prev;
+	uint64_t next = time_now_ns() + NSEC_PER_SEC;
+	double secs;
+
+	cur = xzmalloc(ctx->cpus * sizeof(*cur));
+	prev = xzmalloc(ctx->cpus * sizeof(*prev));
+	fmemset(&all_prev, 0, sizeof(all_prev));
+
+	if (csv)
+		report_csv_header(csv, ctx);
+
+	while (!__all_done(ctx)) {
+		if (time_now_ns() < next) {
+			poll(NULL, 0, 100);
+			continue;
+		}
+
+		secs = 1.0 + (time_now_ns() - next) / (double) NSEC_PER_SEC;
+		next = time_now_ns() + NSEC_PER_SEC;
+
+		fmemset(&all, 0, sizeof(all));
+
+		for (i = 0; i < ctx->cpus; ++i) {
+			cur[i].packets = stats[i].tx_packets;
+			cur[i].bytes = stats[i].tx_bytes;
+			cur[i].full = stats[i].tx_full;
+
+			all.packets += cur[i].packets;
+			all.bytes += cur[i].bytes;
+			all.full += cur[i].full;
+		}
+
+		if (csv)
+			fprintf(csv, "%ld ", time(0));
+
+		report_line("all", &all, &all_prev, secs, csv);
+		if (csv)
+			fprintf(csv, "%llu %llu %llu ", all.packets, all.bytes,
+				all.full);
+
+		for (i = 0; i < ctx->cpus; ++i) {
+			slprintf(who, sizeof(who), "CPU%d", i);
+			report_line(ctx->verbose ? who : NULL, &cur[i], &prev[i],
+				    secs, csv);
+			prev[i] = cur[i];
+		}
+
+		fflush(stdout);
+		if (csv) {
+			fprintf(csv, "\n");
+			fflush(csv);
+		}
+
+		all_prev = all;
+	}
+
+	xfree(cur);
+	xfree(prev);
+}
+
+/* <n>[k|M]pps or <n>[k|M|G]bit, fractions allowed, default pps */
+static void parse_rate(struct ctx *ctx, const char *str)
+{
+	char *end;
+	double rate = strtod(str, &end), mult = 1;
+
+	if (*end == 'k' || *end == 'K')
+		mult = 1e3;
+	else if (*end == 'm' || *end == 'M')
+		mult = 1e6;
+	else if (*end == 'g' || *end == 'G')
+		mult = 1e9;
+	if (mult > 1)
+		end++;
+
+	if (*end == 0 || !strcasecmp(end, "pps")) {
+		if (mult > 1e6)
+			panic("Rate %s is out of range!\n", str);
+		ctx->rate_bytes = false;
+	} else if (!strcasecmp(end, "bit")) {
+		ctx->rate_bytes = true;
+		mult /= 8;
+	} else {
+		panic("Syntax error in rate param, use pps or bit!\n");
+	}
+
+	if (rate * mult < 1)
+		panic("Rate %s is too low!\n", str);
+
+	ctx->rate = (uint64_t) nearbyint(rate * mult);
+}
+
+static void print_rate(struct ctx *ctx)
+{
+	int i;
+	double secs, achieved = 0, offered = ctx->rate;
+	const char *unit = ctx->rate_bytes ? "bit/s" : "pps";
+
+	for (i = 0; i < ctx->cpus; i++) {
+		secs = stats[i].tv_sec + stats[i].tv_usec / 1e6;
+		if (secs > 0)
+			achieved += (ctx->rate_bytes ? 8.0 * stats[i].tx_bytes :
+				     stats[i].tx_packets) / secs;
+	}
+
+	if (ctx->rate_bytes)
+		offered *= 8;
+
+	printf("\r%12.0lf %s offered, %.0lf %s achieved (%.2lf%%)\n",
+	       offered, unit, achieved, unit, 100.0 * achieved / offered);
+}
+
 int main(int argc, char **argv)
 {
 	bool slow = false, invoke_cpp = false, reseed = true;
 	int c, opt_index, i, j, vals[4] = {0}, irq;
-	char *confname = NULL, *ptr;
+	char *confname = NULL, *ptr, *csvname = NULL;
 	unsigned long cpus_tmp;
 	unsigned long long tx_packets, tx_bytes;
+	struct worker *workers;
+	struct packet_set set;
+	FILE *csv = NULL;
 	struct ctx ctx;
 
 	fmemset(&ctx, 0, sizeof(ctx));
@@ -881,6 +1651,9 @@ int main(int argc, char **argv)
 		case 'r':
 			ctx.rand = true;
 			break;
+		case 'C':
+			csum_check = true;
+			break;
 		case 's':
 			slow = true;
 			ctx.cpus = 1;
@@ -896,8 +1669,6 @@ int main(int argc, char **argv)
 		case 'c':
 		case 'i':
 			confname = xstrdup(optarg);
-			if (!strncmp("-", confname, strlen("-")))
-				ctx.cpus = 1;
 			break;
 		case 'u':
 			ctx.uid = strtoul(optarg, NULL, 0);
@@ -914,6 +1685,9 @@ int main(int argc, char **argv)
 			seed = strtoul(optarg, NULL, 0);
 			reseed = false;
 			break;
+		case 'L':
+			csvname = xstrdup(optarg);
+			break;
 		case 'n':
 			ctx.num = strtoul(optarg, NULL, 0);
 			break;
@@ -927,6 +1701,14 @@ int main(int argc, char **argv)
 				 */
 				ctx.cpus = 1;
 			break;
+		case 'b':
+			parse_rate(&ctx, optarg);
+			break;
+		case 'K':
+			ctx.pool = strtoul(optarg, &ptr, 0);
+			if (!isdigit(*optarg) || *ptr || ctx.pool == 0)
+				panic("Pool size must be a number > 0!\n");
+			break;
 		case 'S':
 			ptr = optarg;
 			ctx.reserve_size = 0;
@@ -964,6 +1746,9 @@ int main(int argc, char **argv)
 			case 'u':
 			case 'g':
 			case 't':
+			case 'b':
+			case 'K':
+			case 'L':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -986,10 +1771,11 @@ int main(int argc, char **argv)
 		panic("This is no networking device!\n");
 	if (!ctx.rfraw && device_up_and_running(ctx.device) == 0)
 		panic("Networking device not running!\n");
+	if (ctx.rate > 0 && ctx.gap > 0)
+		panic("Either give an exact --rate or a --gap, not both!\n");
 
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
-	register_signal_f(SIGALRM, timer_elapsed, SA_SIGINFO);
 
 	set_system_socket_memory(vals, array_size(vals));
 	xlockme();
@@ -1008,33 +1794,46 @@ int main(int argc, char **argv)
 	if (ctx.num > 0 && ctx.num <= ctx.cpus)
 		ctx.cpus = 1;
 
+	if (csvname) {
+		csv = fopen(csvname, "w");
+		if (!csv)
+			panic("Cannot open %s: %s!\n", csvname, strerror(errno));
+	}
+
+	srand(reseed ? generate_srand_seed() : seed);
+	/* Static rnd() bytes, a stream of its own next to the workers' */
+	prng_seed(&rng, ((uint64_t) rand() << 32) | UINT32_MAX);
+
+	compile_packets(confname, ctx.verbose, invoke_cpp, &set);
+	if (ctx.pool > 0)
+		pool_check(&ctx, &set);
+
 	stats = setup_shared_var(ctx.cpus);
+	workers = xzmalloc(ctx.cpus * sizeof(*workers));
 
 	for (i = 0; i < ctx.cpus; i++) {
-		pid_t pid = fork();
-
-		switch (pid) {
-		case 0:
-			if (reseed)
-				seed = generate_srand_seed();
-			srand(seed);
+		struct worker *w = &workers[i];
 
-			cpu_affinity(i);
-			main_loop(&ctx, confname, slow, i, invoke_cpp);
+		w->cpu = i;
+		w->ctx = ctx;
+		w->set = &set;
+		w->slow = slow;
+		w->reseed = reseed;
+		w->seed = seed;
 
-			goto thread_out;
-		case -1:
-			panic("Cannot fork processes!\n");
-		}
+		if (pthread_create(&w->trid, NULL, xmit_worker, w))
+			panic("Cannot create worker threads!\n");
 	}
 
-	for (i = 0; i < ctx.cpus; i++) {
-		int status;
+	report_loop(&ctx, csv);
 
-		wait(&status);
-		if (WEXITSTATUS(status) == EXIT_FAILURE)
-			die();
-	}
+	for (i = 0; i < ctx.cpus; i++)
+		pthread_join(workers[i].trid, NULL);
+
+	xfree(workers);
+	destroy_packets(&set);
+	if (csv)
+		fclose(csv);
 
 	if (ctx.rfraw)
 		leave_rfmon_mac80211(ctx.device_trans, ctx.device);
@@ -1042,9 +1841,6 @@ int main(int argc, char **argv)
 	reset_system_socket_memory(vals, array_size(vals));
 
 	for (i = 0, tx_packets = tx_bytes = 0; i < ctx.cpus; i++) {
-		while ((__get_state(i) & CPU_STATS_STATE_RES) == 0)
-			sched_yield();
-
 		tx_packets += stats[i].tx_packets;
 		tx_bytes   += stats[i].tx_bytes;
 	}
@@ -1054,19 +1850,26 @@ int main(int argc, char **argv)
 	printf("\r%12llu packets outgoing\n", tx_packets);
 	printf("\r%12llu bytes outgoing\n", tx_bytes);
 	for (i = 0; i < ctx.cpus; i++) {
-		printf("\r%12lu sec, %lu usec on CPU%d (%llu packets)\n",
+		printf("\r%12lu sec, %lu usec on CPU%d (%llu packets",
 		       stats[i].tv_sec, stats[i].tv_usec, i,
 		       stats[i].tx_packets);
+		if (stats[i].tx_kicks)
+			printf(", %.1lf per kernel kick",
+			       1.0 * stats[i].tx_packets / stats[i].tx_kicks);
+		printf(")\n");
 	}
 
-thread_out:
+	if (ctx.rate > 0)
+		print_rate(&ctx);
+
 	xunlockme();
-	destroy_shared_var(stats, ctx.cpus);
+	destroy_shared_var(stats);
 
 	free(ctx.device);
 	free(ctx.device_trans);
 	free(ctx.rhost);
 	free(confname);
+	free(csvname);
 
 	return 0;
 }
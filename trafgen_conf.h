@@ -8,6 +8,7 @@
 #define TRAFGEN_CONF
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -26,18 +27,24 @@ struct counter {
 	off_t off;
 };
 
+/* A run of consecutive drnd() bytes */
 struct randomizer {
 	off_t off;
+	size_t len;
 };
 
 struct csum16 {
 	off_t off, from, to;
 	enum csum which;
+	/* Computed once in full, full recompute on every send */
+	bool inited, full;
 };
 
 struct packet {
 	uint8_t *payload;
 	size_t len;
+	/* CPUs it is sent on, all of them if both are -1 */
+	int min_cpu, max_cpu;
 };
 
 struct packet_dyn {
@@ -49,7 +56,34 @@ struct packet_dyn {
 	size_t slen;
 };
 
-extern int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp);
+/*
+ * Payloads and dynamic elements of a set of packets, each kind in one
+ * flat array, in packet order.
+ */
+struct packet_store {
+	uint8_t *data;
+	size_t data_len, data_max;
+	struct counter *cnt;
+	size_t clen, cmax;
+	struct randomizer *rnd;
+	size_t rlen, rmax;
+	struct csum16 *csum;
+	size_t slen, smax;
+};
+
+/* A compiled config, read-only once workers select from it */
+struct packet_set {
+	struct packet *packets;
+	size_t plen;
+	struct packet_dyn *packet_dyn;
+	size_t dlen;
+	struct packet_store store;
+};
+
+extern int compile_packets(char *file, int verbose, bool invoke_cpp,
+			   struct packet_set *set);
+extern void select_packets(const struct packet_set *set, int cpu);
 extern void cleanup_packets(void);
+extern void destroy_packets(struct packet_set *set);
 
 #endif /* TRAFGEN_CONF */
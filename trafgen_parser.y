@@ -25,6 +25,7 @@
 #include "die.h"
 #include "csum.h"
 #include "xutils.h"
+#include "prng.h"
 
 #define YYERROR_VERBOSE		0
 #define YYDEBUG			0
@@ -38,15 +39,17 @@ extern void yyerror(const char *);
 extern int yylineno;
 extern char *yytext;
 
-extern struct packet *packets;
-extern size_t plen;
+extern __thread struct packet *packets;
+extern __thread size_t plen;
 
 #define packet_last		(plen - 1)
 
 #define payload_last		(packets[packet_last].len - 1)
 
-extern struct packet_dyn *packet_dyn;
-extern size_t dlen;
+extern __thread struct packet_dyn *packet_dyn;
+extern __thread size_t dlen;
+
+extern __thread struct prng rng;
 
 #define packetd_last		(dlen - 1)
 
@@ -54,19 +57,7 @@ extern size_t dlen;
 #define packetdr_last		(packet_dyn[packetd_last].rlen - 1)
 #define packetds_last		(packet_dyn[packetd_last].slen - 1)
 
-static int our_cpu, min_cpu = -1, max_cpu = -1;
-
-static inline int test_ignore(void)
-{
-	if (min_cpu < 0 && max_cpu < 0)
-		return 0;
-	else if (max_cpu >= our_cpu && min_cpu <= our_cpu)
-		return 0;
-	else
-		return 1;
-}
-
-static inline int has_dynamic_elems(struct packet_dyn *p)
+static inline int has_dynamic_elems(const struct packet_dyn *p)
 {
 	return (p->rlen + p->slen + p->clen);
 }
@@ -75,6 +66,7 @@ static inline void __init_new_packet_slot(struct packet *slot)
 {
 	slot->payload = NULL;
 	slot->len = 0;
+	slot->min_cpu = slot->max_cpu = -1;
 }
 
 static inline void __init_new_counter_slot(struct packet_dyn *slot)
@@ -110,6 +102,7 @@ static inline void __setup_new_counter(struct counter *c, uint8_t start,
 static inline void __setup_new_randomizer(struct randomizer *r)
 {
 	r->off = payload_last;
+	r->len = 1;
 }
 
 static inline void __setup_new_csum16(struct csum16 *s, off_t from, off_t to,
@@ -119,72 +112,143 @@ static inline void __setup_new_csum16(struct csum16 *s, off_t from, off_t to,
 	s->from = from;
 	s->to = to;
 	s->which = which;
+	s->inited = false;
+	s->full = false;
 }
 
-static void realloc_packet(void)
+/*
+ * Payloads and dynamic elements of all packets are appended back to back
+ * to flat arrays that grow geometrically. The packet being parsed always
+ * sits at their tail, so only its pointers are kept up to date while
+ * parsing, those of all others are set in finalize_packet().
+ */
+static struct packet_store store;
+static size_t pmax;
+
+static __thread struct packet_store sel;
+
+static void *__store_grow(void *ptr, size_t *max, size_t need, size_t size)
 {
-	if (test_ignore())
-		return;
+	if (need <= *max)
+		return ptr;
 
-	plen++;
-	packets = xrealloc(packets, 1, plen * sizeof(*packets));
+	while (*max < need)
+		*max = *max ? *max * 2 : 64;
 
-	__init_new_packet_slot(&packets[packet_last]);
+	return xrealloc(ptr, *max, size);
+}
+
+static uint8_t *payload_append(size_t len)
+{
+	struct packet *pkt = &packets[packet_last];
+
+	store.data = __store_grow(store.data, &store.data_max,
+				  store.data_len + len, sizeof(*store.data));
+	store.data_len += len;
+
+	pkt->len += len;
+	pkt->payload = store.data + store.data_len - pkt->len;
+
+	return &pkt->payload[pkt->len - len];
+}
+
+static struct counter *counter_append(void)
+{
+	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+
+	store.cnt = __store_grow(store.cnt, &store.cmax, store.clen + 1,
+				 sizeof(*store.cnt));
+	store.clen++;
+
+	pktd->clen++;
+	pktd->cnt = store.cnt + store.clen - pktd->clen;
+
+	return &pktd->cnt[packetdc_last];
+}
+
+static struct randomizer *randomizer_append(void)
+{
+	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+
+	store.rnd = __store_grow(store.rnd, &store.rmax, store.rlen + 1,
+				 sizeof(*store.rnd));
+	store.rlen++;
+
+	pktd->rlen++;
+	pktd->rnd = store.rnd + store.rlen - pktd->rlen;
+
+	return &pktd->rnd[packetdr_last];
+}
+
+static struct csum16 *csum_append(void)
+{
+	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+
+	store.csum = __store_grow(store.csum, &store.smax, store.slen + 1,
+				  sizeof(*store.csum));
+	store.slen++;
 
+	pktd->slen++;
+	pktd->csum = store.csum + store.slen - pktd->slen;
+
+	return &pktd->csum[packetds_last];
+}
+
+static void realloc_packet(void)
+{
+	plen++;
 	dlen++;
-	packet_dyn = xrealloc(packet_dyn, 1, dlen * sizeof(*packet_dyn));
+
+	if (plen > pmax) {
+		pmax = pmax ? pmax * 2 : 64;
+
+		packets = xrealloc(packets, pmax, sizeof(*packets));
+		packet_dyn = xrealloc(packet_dyn, pmax, sizeof(*packet_dyn));
+	}
+
+	__init_new_packet_slot(&packets[packet_last]);
 
 	__init_new_counter_slot(&packet_dyn[packetd_last]);
 	__init_new_randomizer_slot(&packet_dyn[packetd_last]);
 	__init_new_csum_slot(&packet_dyn[packetd_last]);
 }
 
-static void set_byte(uint8_t val)
+/* CPUs the packet just parsed is sent on, all of them if both are -1 */
+static void set_packet_cpus(int min_cpu, int max_cpu)
 {
 	struct packet *pkt = &packets[packet_last];
 
-	if (test_ignore())
-		return;
+	if (min_cpu > max_cpu) {
+		int tmp = min_cpu;
 
-	pkt->len++;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
-	pkt->payload[payload_last] = val;
+		min_cpu = max_cpu;
+		max_cpu = tmp;
+	}
+
+	pkt->min_cpu = min_cpu;
+	pkt->max_cpu = max_cpu;
 }
 
-static void set_multi_byte(uint8_t *s, size_t len)
+static void set_byte(uint8_t val)
 {
-	int i;
+	*payload_append(1) = val;
+}
 
-	for (i = 0; i < len; ++i)
-		set_byte(s[i]);
+static void set_multi_byte(uint8_t *s, size_t len)
+{
+	fmemcpy(payload_append(len), s, len);
 }
 
 static void set_fill(uint8_t val, size_t len)
 {
-	size_t i;
-	struct packet *pkt = &packets[packet_last];
-
-	if (test_ignore())
-		return;
-
-	pkt->len += len;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
-	for (i = 0; i < len; ++i)
-		pkt->payload[payload_last - i] = val;
+	fmemset(payload_append(len), val, len);
 }
 
 static void __set_csum16_dynamic(size_t from, size_t to, enum csum which)
 {
-	struct packet *pkt = &packets[packet_last];
-	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+	payload_append(2);
 
-	pkt->len += 2;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
-
-	pktd->slen++;
-	pktd->csum = xrealloc(pktd->csum, 1, pktd->slen * sizeof(struct csum16));
-
-	__setup_new_csum16(&pktd->csum[packetds_last], from, to, which);
+	__setup_new_csum16(csum_append(), from, to, which);
 }
 
 static void __set_csum16_static(size_t from, size_t to, enum csum which)
@@ -206,9 +270,6 @@ static void set_csum16(size_t from, size_t to, enum csum which)
 	struct packet *pkt = &packets[packet_last];
 	struct packet_dyn *pktd = &packet_dyn[packetd_last];
 
-	if (test_ignore())
-		return;
-
 	if (to < from) {
 		size_t tmp = to;
 
@@ -229,32 +290,16 @@ static void set_csum16(size_t from, size_t to, enum csum which)
 
 static void set_rnd(size_t len)
 {
-	size_t i;
-	struct packet *pkt = &packets[packet_last];
-
-	if (test_ignore())
-		return;
-
-	pkt->len += len;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
-	for (i = 0; i < len; ++i)
-		pkt->payload[payload_last - i] = (uint8_t) rand();
+	prng_fill(&rng, payload_append(len), len);
 }
 
 static void set_sequential_inc(uint8_t start, size_t len, uint8_t stepping)
 {
 	size_t i;
-	struct packet *pkt = &packets[packet_last];
-
-	if (test_ignore())
-		return;
+	uint8_t *p = payload_append(len);
 
-	pkt->len += len;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
 	for (i = 0; i < len; ++i) {
-		off_t off = len - 1 - i;
-
-		pkt->payload[payload_last - off] = start;
+		p[i] = start;
 		start += stepping;
 	}
 }
@@ -262,54 +307,36 @@ static void set_sequential_inc(uint8_t start, size_t len, uint8_t stepping)
 static void set_sequential_dec(uint8_t start, size_t len, uint8_t stepping)
 {
 	size_t i;
-	struct packet *pkt = &packets[packet_last];
-
-	if (test_ignore())
-		return;
+	uint8_t *p = payload_append(len);
 
-	pkt->len += len;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
 	for (i = 0; i < len; ++i) {
-		int off = len - 1 - i;
-
-		pkt->payload[payload_last - off] = start;
+		p[i] = start;
 		start -= stepping;
 	}
 }
 
 static void set_dynamic_rnd(void)
 {
-	struct packet *pkt = &packets[packet_last];
 	struct packet_dyn *pktd = &packet_dyn[packetd_last];
 
-	if (test_ignore())
-		return;
-
-	pkt->len++;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
+	payload_append(1);
 
-	pktd->rlen++;
-	pktd->rnd = xrealloc(pktd->rnd, 1, pktd->rlen *	sizeof(struct randomizer));
+	/* Extend the last run, so it can be filled in one go */
+	if (pktd->rlen > 0 && pktd->rnd[packetdr_last].off +
+	    pktd->rnd[packetdr_last].len == payload_last) {
+		pktd->rnd[packetdr_last].len++;
+		return;
+	}
 
-	__setup_new_randomizer(&pktd->rnd[packetdr_last]);
+	__setup_new_randomizer(randomizer_append());
 }
 
 static void set_dynamic_incdec(uint8_t start, uint8_t stop, uint8_t stepping,
 			       int type)
 {
-	struct packet *pkt = &packets[packet_last];
-	struct packet_dyn *pktd = &packet_dyn[packetd_last];
-
-	if (test_ignore())
-		return;
+	payload_append(1);
 
-	pkt->len++;
-	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
-
-	pktd->clen++;
-	pktd->cnt =xrealloc(pktd->cnt, 1, pktd->clen * sizeof(struct counter));
-
-	__setup_new_counter(&pktd->cnt[packetdc_last], start, stop, stepping, type);
+	__setup_new_counter(counter_append(), start, stop, stepping, type);
 }
 
 %}
@@ -346,24 +373,15 @@ inline_comment
 
 packet
 	: '{' delimiter payload delimiter '}' {
-			min_cpu = max_cpu = -1;
+			set_packet_cpus(-1, -1);
 			realloc_packet();
 		}
 	| K_CPU '(' number ':' number ')' ':' K_WHITE '{' delimiter payload delimiter '}' {
-			min_cpu = $3;
-			max_cpu = $5;
-
-			if (min_cpu > max_cpu) {
-				int tmp = min_cpu;
-
-				min_cpu = max_cpu;
-				max_cpu = tmp;
-			}
-
+			set_packet_cpus($3, $5);
 			realloc_packet();
 		}
 	| K_CPU '(' number ')' ':' K_WHITE '{' delimiter payload delimiter '}' {
-			min_cpu = max_cpu = $3;
+			set_packet_cpus($3, $3);
 			realloc_packet();
 		}
 	;
@@ -507,9 +525,25 @@ ddec
 
 static void finalize_packet(void)
 {
+	size_t i, data = 0, c = 0, r = 0, s = 0;
+
 	/* XXX hack ... we allocated one packet pointer too much */
 	plen--;
 	dlen--;
+
+	for (i = 0; i < plen; ++i) {
+		struct packet_dyn *pktd = &packet_dyn[i];
+
+		packets[i].payload = packets[i].len ? store.data + data : NULL;
+		pktd->cnt = pktd->clen ? store.cnt + c : NULL;
+		pktd->rnd = pktd->rlen ? store.rnd + r : NULL;
+		pktd->csum = pktd->slen ? store.csum + s : NULL;
+
+		data += packets[i].len;
+		c += pktd->clen;
+		r += pktd->rlen;
+		s += pktd->slen;
+	}
 }
 
 static void dump_conf(void)
@@ -518,6 +552,9 @@ static void dump_conf(void)
 
 	for (i = 0; i < plen; ++i) {
 		printf("[%zu] pkt\n", i);
+		if (packets[i].min_cpu >= 0)
+			printf(" cpus %d-%d\n", packets[i].min_cpu,
+			       packets[i].max_cpu);
 		printf(" len %zu cnts %zu rnds %zu\n",
 		       packets[i].len,
 		       packet_dyn[i].clen,
@@ -538,36 +575,147 @@ static void dump_conf(void)
 			       "inc" : "dec");
 
 		for (j = 0; j < packet_dyn[i].rlen; ++j)
-			printf(" rnd%zu off %ld\n", j,
-			       packet_dyn[i].rnd[j].off);
+			printf(" rnd%zu off %ld len %zu\n", j,
+			       packet_dyn[i].rnd[j].off,
+			       packet_dyn[i].rnd[j].len);
 	}
 }
 
+/* Frees the selection of a worker, the payloads of static packets are shared */
 void cleanup_packets(void)
 {
-	size_t i;
+	free(packets);
+	free(packet_dyn);
 
-	for (i = 0; i < plen; ++i) {
-		if (packets[i].len > 0)
-			xfree(packets[i].payload);
+	free(sel.data);
+	free(sel.cnt);
+	free(sel.rnd);
+	free(sel.csum);
+
+	packets = NULL;
+	packet_dyn = NULL;
+	plen = dlen = 0;
+
+	fmemset(&sel, 0, sizeof(sel));
+}
+
+static void *__alloc_or_null(size_t nmemb, size_t size)
+{
+	return nmemb ? xmalloc(nmemb * size) : NULL;
+}
+
+static inline bool __on_cpu(const struct packet *pkt, int cpu)
+{
+	return pkt->min_cpu < 0 || (cpu >= pkt->min_cpu && cpu <= pkt->max_cpu);
+}
+
+/*
+ * Makes the packets of set that are sent on cpu the packets of the
+ * calling worker. Dynamic packets are changed while sending, so they
+ * and their state are copied, in order, into a store of the worker's
+ * own. Static ones point into set.
+ */
+void select_packets(const struct packet_set *set, int cpu)
+{
+	size_t i, n = 0;
+
+	packets = NULL;
+	packet_dyn = NULL;
+	plen = dlen = 0;
+
+	fmemset(&sel, 0, sizeof(sel));
+
+	for (i = 0; i < set->plen; ++i) {
+		const struct packet_dyn *pktd = &set->packet_dyn[i];
+
+		if (!__on_cpu(&set->packets[i], cpu))
+			continue;
+
+		n++;
+		if (has_dynamic_elems(pktd)) {
+			sel.data_max += set->packets[i].len;
+			sel.cmax += pktd->clen;
+			sel.rmax += pktd->rlen;
+			sel.smax += pktd->slen;
+		}
 	}
 
-	free(packets);
+	if (n == 0)
+		return;
 
-	for (i = 0; i < dlen; ++i) {
-		free(packet_dyn[i].cnt);
-		free(packet_dyn[i].rnd);
+	packets = xmalloc(n * sizeof(*packets));
+	packet_dyn = xmalloc(n * sizeof(*packet_dyn));
+
+	sel.data = __alloc_or_null(sel.data_max, sizeof(*sel.data));
+	sel.cnt = __alloc_or_null(sel.cmax, sizeof(*sel.cnt));
+	sel.rnd = __alloc_or_null(sel.rmax, sizeof(*sel.rnd));
+	sel.csum = __alloc_or_null(sel.smax, sizeof(*sel.csum));
+
+	for (i = 0; i < set->plen; ++i) {
+		const struct packet *pkt = &set->packets[i];
+		const struct packet_dyn *pktd = &set->packet_dyn[i];
+		struct packet *out = &packets[plen];
+		struct packet_dyn *outd = &packet_dyn[dlen];
+
+		if (!__on_cpu(pkt, cpu))
+			continue;
+
+		*out = *pkt;
+		*outd = *pktd;
+
+		if (has_dynamic_elems(outd)) {
+			out->payload = sel.data + sel.data_len;
+			fmemcpy(out->payload, pkt->payload, pkt->len);
+			sel.data_len += pkt->len;
+
+			outd->cnt = outd->clen ? sel.cnt + sel.clen : NULL;
+			outd->rnd = outd->rlen ? sel.rnd + sel.rlen : NULL;
+			outd->csum = outd->slen ? sel.csum + sel.slen : NULL;
+
+			if (outd->clen)
+				fmemcpy(outd->cnt, pktd->cnt,
+					outd->clen * sizeof(*outd->cnt));
+			if (outd->rlen)
+				fmemcpy(outd->rnd, pktd->rnd,
+					outd->rlen * sizeof(*outd->rnd));
+			if (outd->slen)
+				fmemcpy(outd->csum, pktd->csum,
+					outd->slen * sizeof(*outd->csum));
+
+			sel.clen += outd->clen;
+			sel.rlen += outd->rlen;
+			sel.slen += outd->slen;
+		}
+
+		plen++;
+		dlen++;
 	}
+}
 
-	free(packet_dyn);
+void destroy_packets(struct packet_set *set)
+{
+	free(set->packets);
+	free(set->packet_dyn);
+
+	free(set->store.data);
+	free(set->store.cnt);
+	free(set->store.rnd);
+	free(set->store.csum);
+
+	fmemset(set, 0, sizeof(*set));
 }
 
-int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp)
+/*
+ * Compiles the config once for all workers, which then take their share
+ * with select_packets().
+ */
+int compile_packets(char *file, int verbose, bool invoke_cpp,
+		    struct packet_set *set)
 {
 	char tmp_file[128];
 
 	memset(tmp_file, 0, sizeof(tmp_file));
-	our_cpu = cpu;
+	yylineno = 1;
 
 	if (invoke_cpp) {
 		char cmd[256], *dir, *base, *a, *b;
@@ -595,13 +743,25 @@ int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp)
 	yyparse();
 	finalize_packet();
 
-	if (our_cpu == 0 && verbose)
+	if (verbose)
 		dump_conf();
 
 	fclose(yyin);
 	if (invoke_cpp)
 		unlink(tmp_file);
 
+	set->packets = packets;
+	set->plen = plen;
+	set->packet_dyn = packet_dyn;
+	set->dlen = dlen;
+	set->store = store;
+
+	packets = NULL;
+	packet_dyn = NULL;
+	plen = dlen = pmax = 0;
+
+	fmemset(&store, 0, sizeof(store));
+
 	return 0;
 }
 
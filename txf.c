@@ -0,0 +1,318 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include "txf.h"
+#include "xio.h"
+#include "xmalloc.h"
+#include "xutils.h"
+#include "built_in.h"
+#include "die.h"
+
+/* Byte changed by different amounts between packets */
+#define TXF_STEP_IRREGULAR	-1
+
+static const char txf_hex[] = "0123456789abcdef";
+
+static void __txf_flush(struct txf *t)
+{
+	size_t done = 0;
+
+	while (done < t->blen)
+		done += write_or_die(t->fd, t->buff + done, t->blen - done);
+
+	t->blen = 0;
+}
+
+static inline char *__txf_reserve(struct txf *t, size_t len)
+{
+	if (unlikely(t->blen + len > TXF_BUFF_SIZE))
+		__txf_flush(t);
+
+	t->blen += len;
+	return t->buff + t->blen - len;
+}
+
+static void __txf_puts(struct txf *t, const char *str)
+{
+	size_t len = strlen(str);
+
+	fmemcpy(__txf_reserve(t, len), str, len);
+}
+
+static inline void __txf_byte(struct txf *t, uint8_t byte)
+{
+	char *p = __txf_reserve(t, 6);
+
+	p[0] = '0';
+	p[1] = 'x';
+	p[2] = txf_hex[byte >> 4];
+	p[3] = txf_hex[byte & 0xf];
+	p[4] = ',';
+	p[5] = ' ';
+}
+
+/* Ten elements per line, same layout as we always had */
+static inline void __txf_elem_done(struct txf *t, size_t done, size_t total)
+{
+	if (done % 10 == 0) {
+		__txf_puts(t, "\n");
+		if (done < total)
+			__txf_puts(t, "  ");
+	}
+}
+
+static void __txf_literal(struct txf *t, const uint8_t *pkt, size_t len)
+{
+	size_t i;
+
+	__txf_puts(t, "{\n  ");
+
+	for (i = 0; i < len; ++i) {
+		__txf_byte(t, pkt[i]);
+		__txf_elem_done(t, i + 1, len);
+	}
+	if (len % 10 != 0)
+		__txf_puts(t, "\n");
+
+	__txf_puts(t, "}\n\n");
+}
+
+void txf_init(struct txf *t, int fd, bool infer, uint32_t link_type)
+{
+	fmemset(t, 0, sizeof(*t));
+
+	t->fd = fd;
+	t->infer = infer;
+	t->link_type = link_type;
+	t->buff = xmalloc(TXF_BUFF_SIZE);
+
+	if (!infer)
+		return;
+
+	/* Index at most 50% full, as in the heavy hitter sketch. */
+	t->imask = 2 * TXF_GROUPS_MAX - 1;
+	t->index = xmalloc((t->imask + 1) * sizeof(*t->index));
+	fmemset(t->index, 0xff, (t->imask + 1) * sizeof(*t->index));
+	t->groups = xzmalloc(TXF_GROUPS_MAX * sizeof(*t->groups));
+}
+
+/*
+ * Only complete IPv4 TCP/UDP packets without trailing padding can be
+ * templated, since trafgen computes the L4 checksum over everything
+ * from the L4 header to the end of the packet, and only for IPv4.
+ */
+static int __txf_templatable(struct txf *t, const uint8_t *pkt, size_t len,
+			     uint32_t wire_len, struct pkt_off *off)
+{
+	const struct iphdr *ip4;
+
+	if (len != wire_len)
+		return 0;
+
+	pkt_off_parse(off, pkt, len, t->link_type);
+	if (off->family != AF_INET || off->l4_off == 0)
+		return 0;
+
+	ip4 = (const void *) (pkt + off->l3_off);
+
+	return off->l3_off + ntohs(ip4->tot_len) == len;
+}
+
+static struct txf_group *__txf_group_find(struct txf *t, const uint8_t *pkt,
+					  size_t len, const struct pkt_off *off,
+					  bool *new)
+{
+	uint32_t i;
+	uint64_t hash;
+	struct flow_key key;
+	struct txf_group *g;
+
+	if (flow_key_extract(&key, FLOW_KEY_5TUPLE, pkt, len) < 0)
+		return NULL;
+
+	hash = flow_key_hash(&key) ^ __flow_mix64(len);
+
+	for (i = hash & t->imask; t->index[i] >= 0; i = (i + 1) & t->imask) {
+		g = &t->groups[t->index[i]];
+		if (g->hash == hash && g->len == len &&
+		    flow_key_equal(&g->key, &key)) {
+			*new = false;
+			return g;
+		}
+	}
+
+	if (t->nr == TXF_GROUPS_MAX)
+		return NULL;
+
+	t->index[i] = t->nr;
+	g = &t->groups[t->nr++];
+
+	g->key = key;
+	g->hash = hash;
+	g->len = len;
+	g->off = *off;
+	g->tmpl = xmalloc(len);
+	g->last = xmalloc(len);
+	g->step = xzmalloc(len * sizeof(*g->step));
+
+	*new = true;
+	return g;
+}
+
+static void __txf_group_update(struct txf_group *g, const uint8_t *pkt)
+{
+	uint32_t i;
+
+	for (i = 0; i < g->len; ++i) {
+		int16_t diff = (uint8_t) (pkt[i] - g->last[i]);
+
+		if (g->packets == 1)
+			g->step[i] = diff;
+		else if (g->step[i] != diff)
+			g->step[i] = TXF_STEP_IRREGULAR;
+	}
+
+	fmemcpy(g->last, pkt, g->len);
+	g->packets++;
+}
+
+void txf_packet(struct txf *t, const uint8_t *pkt, size_t len,
+		uint32_t wire_len)
+{
+	bool new;
+	struct pkt_off off;
+	struct txf_group *g;
+
+	if (!t->infer || !__txf_templatable(t, pkt, len, wire_len, &off))
+		goto literal;
+
+	g = __txf_group_find(t, pkt, len, &off, &new);
+	if (!g)
+		goto literal;
+
+	if (new) {
+		fmemcpy(g->tmpl, pkt, len);
+		fmemcpy(g->last, pkt, len);
+		g->packets = 1;
+	} else {
+		__txf_group_update(g, pkt);
+	}
+
+	return;
+literal:
+	t->literal++;
+	__txf_literal(t, pkt, len);
+}
+
+static bool __txf_any_dynamic(const struct txf_group *g, uint32_t from,
+			      uint32_t to)
+{
+	for (; from <= to && from < g->len; ++from) {
+		if (g->step[from] != 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void __txf_group_emit(struct txf *t, const struct txf_group *g)
+{
+	char buff[256], src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+	const struct pkt_off *o = &g->off;
+	uint32_t i, elems = 0, total = g->len, ip_end, ip_csum, l4_csum;
+	bool need_ip, need_l4;
+
+	ip_end = o->l3_off + (g->tmpl[o->l3_off] & 0xf) * 4 - 1;
+	ip_csum = o->l3_off + 10;
+	l4_csum = o->l4_off + (o->proto == IPPROTO_TCP ? 16 : 6);
+
+	need_ip = __txf_any_dynamic(g, o->l3_off, ip_end);
+	/* Pseudo header addresses, L4 header and payload */
+	need_l4 = __txf_any_dynamic(g, o->l3_off + 12, o->l3_off + 19) ||
+		  __txf_any_dynamic(g, o->l4_off, g->len - 1);
+	/* A zero UDP checksum means there is none, keep it that way. */
+	if (o->proto == IPPROTO_UDP && !g->tmpl[l4_csum] &&
+	    !g->tmpl[l4_csum + 1] && !__txf_any_dynamic(g, l4_csum, l4_csum + 1))
+		need_l4 = false;
+
+	/* Every checksum element stands for two bytes. */
+	total -= need_ip + need_l4;
+
+	inet_ntop(AF_INET, g->key.saddr, src, sizeof(src));
+	inet_ntop(AF_INET, g->key.daddr, dst, sizeof(dst));
+
+	slprintf(buff, sizeof(buff), "/* %s:%u -> %s:%u (%u), %u bytes, "
+		 "%lu packets */\n{\n  ", src, ntohs(g->key.sport), dst,
+		 ntohs(g->key.dport), g->key.proto, g->len, g->packets);
+	__txf_puts(t, buff);
+
+	for (i = 0; i < g->len; ++i) {
+		if (need_ip && i == ip_csum) {
+			slprintf(buff, sizeof(buff), "csumip(%u, %u), ",
+				 o->l3_off, ip_end);
+			__txf_puts(t, buff);
+			i++;
+		} else if (need_l4 && i == l4_csum) {
+			slprintf(buff, sizeof(buff), "csum%s(%u, %u), ",
+				 o->proto == IPPROTO_TCP ? "tcp" : "udp",
+				 o->l3_off, o->l4_off);
+			__txf_puts(t, buff);
+			i++;
+		} else if (g->step[i] == 0) {
+			__txf_byte(t, g->tmpl[i]);
+		} else if (g->step[i] > 0) {
+			uint8_t first = g->tmpl[i], last = g->last[i];
+
+			/* A counter that wrapped around covers the whole byte. */
+			if (first + (g->packets - 1) * g->step[i] > 255) {
+				first = 0;
+				last = 255;
+			}
+
+			slprintf(buff, sizeof(buff), "dinc(%u, %u, %d), ",
+				 first, last, g->step[i]);
+			__txf_puts(t, buff);
+		} else {
+			__txf_puts(t, "drnd(), ");
+		}
+
+		__txf_elem_done(t, ++elems, total);
+	}
+	if (elems % 10 != 0)
+		__txf_puts(t, "\n");
+
+	__txf_puts(t, "}\n\n");
+}
+
+void txf_destroy(struct txf *t)
+{
+	uint32_t i;
+
+	for (i = 0; i < t->nr; ++i) {
+		struct txf_group *g = &t->groups[i];
+
+		__txf_group_emit(t, g);
+
+		xfree(g->tmpl);
+		xfree(g->last);
+		xfree(g->step);
+	}
+
+	__txf_flush(t);
+
+	if (t->infer) {
+		xfree(t->index);
+		xfree(t->groups);
+	}
+
+	xfree(t->buff);
+}
@@ -0,0 +1,63 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef TXF_H
+#define TXF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "flow_key.h"
+#include "pkt_off.h"
+
+/*
+ * pcap to trafgen config conversion. Output goes through a private
+ * buffer, so a packet costs a table lookup per byte instead of a
+ * write(2) per byte.
+ *
+ * In inference mode, IPv4 TCP/UDP packets are grouped by 5-tuple and
+ * length, and each group is emitted once as a template: bytes that
+ * never change stay literal, bytes that change by a constant step per
+ * packet become dinc() over the observed range, other changing bytes
+ * become drnd(), and the IP and L4 checksums are recomputed by
+ * csumip()/csumtcp()/csumudp() whenever a byte they cover is dynamic.
+ * trafgen's dynamic elements are one byte wide, so a 16 or 32 bit
+ * counter is only reproduced exactly in its low byte. Everything else
+ * is emitted literally.
+ */
+
+#define TXF_BUFF_SIZE		(64 * 1024)
+#define TXF_GROUPS_MAX		4096
+
+struct txf_group {
+	struct flow_key key;
+	uint64_t hash;
+	uint32_t len;
+	unsigned long packets;
+	struct pkt_off off;
+	uint8_t *tmpl, *last;
+	int16_t *step;
+};
+
+struct txf {
+	int fd;
+	bool infer;
+	uint32_t link_type;
+	char *buff;
+	size_t blen;
+	uint32_t nr, imask;
+	int32_t *index;
+	struct txf_group *groups;
+	unsigned long literal;
+};
+
+extern void txf_init(struct txf *t, int fd, bool infer, uint32_t link_type);
+extern void txf_packet(struct txf *t, const uint8_t *pkt, size_t len,
+		       uint32_t wire_len);
+extern void txf_destroy(struct txf *t);
+
+#endif /* TXF_H */
@@ -0,0 +1,83 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Copyright 2026 agent <agent@local>.
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef XTIME_H
+#define XTIME_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "built_in.h"
+
+#define NSEC_PER_USEC		1000ULL
+#define NSEC_PER_SEC		1000000000ULL
+
+/*
+ * Below this distance to a deadline we stop sleeping and busy-wait,
+ * since a sleep would easily wake up tens of microseconds late.
+ */
+#define XTIME_SPIN_THRESH_NS	(50 * NSEC_PER_USEC)
+
+static inline uint64_t timespec_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static inline uint64_t xclock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return timespec_to_ns(&ts);
+}
+
+static inline uint64_t time_now_ns(void)
+{
+	return xclock_ns(CLOCK_MONOTONIC);
+}
+
+/* Cycle counter for cost accounting, nanoseconds where there is none */
+static inline uint64_t xcycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return time_now_ns();
+#endif
+}
+
+/*
+ * Waits until the CLOCK_MONOTONIC deadline: sleeps for the coarse part
+ * and spins for the remainder. Returns the time we woke up at, which is
+ * before the deadline only if a signal interrupted the sleep.
+ */
+static inline uint64_t time_wait_until_ns(uint64_t deadline)
+{
+	uint64_t now = time_now_ns();
+
+	if (deadline > now + XTIME_SPIN_THRESH_NS) {
+		struct timespec ts;
+
+		ns_to_timespec(deadline - XTIME_SPIN_THRESH_NS, &ts);
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				    &ts, NULL) == EINTR)
+			return time_now_ns();
+	}
+
+	while ((now = time_now_ns()) < deadline)
+		;
+
+	return now;
+}
+
+#endif /* XTIME_H */
@@ -650,6 +650,38 @@ int device_irq_number(const char *ifname)
 	return irq;
 }
 
+/*
+ * Multiqueue drivers register one IRQ per queue with names such as
+ * eth0-TxRx-0 or eth0-rx-1. Returns the number of IRQs found, in the
+ * order of /proc/interrupts.
+ */
+int device_queue_irqs(const char *ifname, int *irqs, int max)
+{
+	int nr = 0;
+	char buff[512], name[IFNAMSIZ + 2], *ptr;
+	FILE *fp;
+
+	fp = fopen("/proc/interrupts", "r");
+	if (!fp)
+		return 0;
+
+	slprintf(name, sizeof(name), "%s-", ifname);
+
+	while (nr < max && fgets(buff, sizeof(buff), fp) != NULL) {
+		buff[sizeof(buff) - 1] = 0;
+
+		ptr = strstr(buff, name);
+		if (ptr == NULL || (ptr != buff && !isspace(ptr[-1])))
+			continue;
+
+		irqs[nr++] = atoi(buff);
+	}
+
+	fclose(fp);
+
+	return nr;
+}
+
 int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to)
 {
 	int ret, fd;
@@ -697,7 +729,8 @@ int device_bind_irq_to_cpu(int irq, int cpu)
 	return (ret > 0 ? 0 : ret);
 }
 
-void sock_print_net_stats(int sock, unsigned long skipped)
+void sock_print_net_stats(int sock, unsigned long skipped,
+			  unsigned long sample)
 {
 	int ret;
 	struct tpacket_stats kstats;
@@ -715,6 +748,10 @@ void sock_print_net_stats(int sock, unsigned long skipped)
 		printf("\r%12ld  packets failed filter (out of space)\n", drops + skipped);
 		if (kstats.tp_packets > 0)
 			printf("\r%12.4lf%\% packet droprate\n", (1.0 * drops / packets) * 100.0);
+		/* The kernel counts what the sampler and filter let through */
+		if (sample > 1)
+			printf("\r%12ld  packets estimated to match filter (1:%lu sampling)\n",
+			       packets * sample, sample);
 	}
 }
 
@@ -785,8 +822,8 @@ void cpu_affinity(int cpu)
 	CPU_ZERO(&cpu_bitmask);
 	CPU_SET(cpu, &cpu_bitmask);
 
-	ret = sched_setaffinity(getpid(), sizeof(cpu_bitmask),
-				&cpu_bitmask);
+	/* The calling thread only, which is the process if single threaded */
+	ret = sched_setaffinity(0, sizeof(cpu_bitmask), &cpu_bitmask);
 	if (ret)
 		panic("Can't set this cpu affinity!\n");
 }